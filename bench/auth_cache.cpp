@@ -0,0 +1,91 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// Measures incoming connection handshakes per second with the auth cache (AUTH_CACHE_TTL) off and
+// on.  A single client keypair reconnects over and over, as a wallet reconnecting to a public node
+// does.  An optional argument gives a simulated AllowFunc cost in microseconds (default 0).
+
+#include <sodium.h>
+#include <thread>
+#include "bench.h"
+#include "client.h"
+#include "lokimq/lokimq.h"
+
+using namespace lokimq;
+using namespace lokimq::bench;
+
+namespace {
+
+result handshakes(std::string name, std::chrono::milliseconds cache_ttl, const std::string& addr,
+        std::chrono::microseconds allow_cost) {
+    std::atomic<uint64_t> allow_calls{0};
+    LokiMQ server{"", "", false, {addr},
+        [](const std::string&) { return ""s; },
+        [&](string_view, string_view) {
+            allow_calls++;
+            if (allow_cost > 0us)
+                std::this_thread::sleep_for(allow_cost);
+            return Allow{AuthLevel::none, false};
+        }};
+    server.AUTH_CACHE_TTL = cache_ttl;
+    server.start();
+
+    zmq::context_t ctx;
+    std::string pubkey(crypto_box_PUBLICKEYBYTES, 0), privkey(crypto_box_SECRETKEYBYTES, 0);
+    crypto_box_keypair(reinterpret_cast<unsigned char*>(&pubkey[0]), reinterpret_cast<unsigned char*>(&privkey[0]));
+
+    result r;
+    r.name = std::move(name);
+    auto start = clock::now();
+    while (clock::now() - start < 3s) {
+        raw_client client{ctx, addr, server.get_pubkey(), pubkey, privkey};
+        if (!client.handshake()) {
+            std::fprintf(stderr, "handshake timed out\n");
+            std::exit(1);
+        }
+        r.iterations++;
+    }
+    r.seconds = std::chrono::duration<double>(clock::now() - start).count();
+    print(r);
+    std::printf("%-40s %12llu AllowFunc calls\n", "", static_cast<unsigned long long>(allow_calls));
+    return r;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    if (sodium_init() < 0)
+        return 1;
+    std::chrono::microseconds allow_cost{argc > 1 ? std::atoll(argv[1]) : 0};
+    auto off = handshakes("handshake, no auth cache", 0ms, "tcp://127.0.0.1:4701", allow_cost);
+    auto on = handshakes("handshake, auth cache", 1min, "tcp://127.0.0.1:4702", allow_cost);
+    compare(on, off);
+}
+
+// vim:sw=4:et
@@ -0,0 +1,140 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+// A minimal harness shared by the benchmark programs in this directory.  Each `bench/*.cpp` is a
+// standalone program (they aren't part of the library build); build one from the top-level
+// directory with something like:
+//
+//     g++ -std=c++14 -O2 -I. -Icppzmq -Imapbox-variant/include bench/hex.cpp lokimq/*.cpp
+//         -lzmq -lsodium -pthread -o bench-hex
+//
+// (adding -DLOKIMQ_ZSTD and -lzstd to build with compression support).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace lokimq { namespace bench {
+
+using namespace std::literals;
+using clock = std::chrono::steady_clock;
+
+/// Keeps the compiler from optimizing away the computation of `value`
+template <typename T>
+inline void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/// The timing of one benchmark
+struct result {
+    std::string name;
+    uint64_t iterations = 0;
+    double seconds = 0;
+    /// Bytes processed per iteration, if meaningful (for a throughput column)
+    size_t bytes = 0;
+
+    double ns_per_op() const { return seconds * 1e9 / iterations; }
+    double ops_per_sec() const { return iterations / seconds; }
+};
+
+/// Prints a result as a single line: name, ns/op, ops/s and (if `bytes` is set) MB/s
+inline void print(const result& r) {
+    std::printf("%-40s %12.1f ns/op %14.0f ops/s", r.name.c_str(), r.ns_per_op(), r.ops_per_sec());
+    if (r.bytes)
+        std::printf(" %10.1f MB/s", r.bytes * r.ops_per_sec() / 1e6);
+    std::printf("\n");
+}
+
+/// Prints how many times faster `fast` is than `slow`
+inline void compare(const result& fast, const result& slow) {
+    std::printf("%-40s %12.2fx faster than %s\n", fast.name.c_str(), slow.ns_per_op() / fast.ns_per_op(), slow.name.c_str());
+}
+
+/// Calls `f()` repeatedly, doubling the number of calls until a batch takes at least `min_time`,
+/// then prints and returns the per-call timing of that batch.  `bytes` is the amount of data each
+/// call processes, if a throughput figure is wanted.
+template <typename F>
+result run(std::string name, F&& f, size_t bytes = 0, std::chrono::milliseconds min_time = 500ms) {
+    f(); // warm up
+    result r;
+    r.name = std::move(name);
+    r.bytes = bytes;
+    for (uint64_t n = 1; ; n *= 2) {
+        auto start = clock::now();
+        for (uint64_t i = 0; i < n; i++)
+            f();
+        auto elapsed = clock::now() - start;
+        if (elapsed >= min_time || n >= (uint64_t{1} << 40)) {
+            r.iterations = n;
+            r.seconds = std::chrono::duration<double>(elapsed).count();
+            break;
+        }
+    }
+    print(r);
+    return r;
+}
+
+/// Returns the `p`th percentile (0-100) of a set of samples (which gets sorted)
+template <typename T>
+T percentile(std::vector<T>& samples, double p) {
+    if (samples.empty())
+        return T{};
+    std::sort(samples.begin(), samples.end());
+    size_t i = static_cast<size_t>(p / 100 * (samples.size() - 1) + 0.5);
+    return samples[std::min(i, samples.size() - 1)];
+}
+
+/// The number of heap allocations made so far; only counted in a program that defines
+/// LOKIMQ_BENCH_COUNT_ALLOCS before including this header (which replaces the global operator new).
+inline std::atomic<uint64_t>& allocations() {
+    static std::atomic<uint64_t> count{0};
+    return count;
+}
+
+}}
+
+#ifdef LOKIMQ_BENCH_COUNT_ALLOCS
+void* operator new(size_t size) {
+    lokimq::bench::allocations().fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc{};
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+#endif
+
+// vim:sw=4:et
@@ -0,0 +1,146 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+// Benchmarks bt_value deserialization (which uses an explicit stack with depth/size limits) against
+// a plain recursive-descent parser like the one it replaced, and bt_validate() against both, on a
+// typical control message, deeply nested lists, and hostile `lll...` input.
+
+#define LOKIMQ_BENCH_COUNT_ALLOCS
+#include "bench.h"
+#include "lokimq/bt_serialize.h"
+
+using namespace lokimq;
+using namespace lokimq::bench;
+
+namespace {
+
+// The recursive parser bt_get() used to be: one C++ stack frame per nesting level and no limits.
+void recursive_get(string_view& s, bt_value& val) {
+    if (s.size() < 2)
+        throw bt_deserialize_invalid("Deserialization failed: end of string found where bt-encoded value expected");
+    switch (s[0]) {
+        case 'd': {
+            bt_dict dict;
+            s.remove_prefix(1);
+            while (!s.empty() && s[0] != 'e') {
+                std::string key;
+                detail::bt_deserialize<std::string>{}(s, key);
+                recursive_get(s, dict[std::move(key)]);
+            }
+            if (s.empty())
+                throw bt_deserialize_invalid("Deserialization failed: encountered end of string before dict was finished");
+            s.remove_prefix(1);
+            val = std::move(dict);
+            break;
+        }
+        case 'l': {
+            bt_list list;
+            s.remove_prefix(1);
+            while (!s.empty() && s[0] != 'e') {
+                list.emplace_back();
+                recursive_get(s, list.back());
+            }
+            if (s.empty())
+                throw bt_deserialize_invalid("Deserialization failed: encountered end of string before list was finished");
+            s.remove_prefix(1);
+            val = std::move(list);
+            break;
+        }
+        case 'i':
+            val = detail::bt_deserialize_integer(s).first.i64;
+            break;
+        default: {
+            std::string str;
+            detail::bt_deserialize<std::string>{}(s, str);
+            val = std::move(str);
+        }
+    }
+}
+
+bt_value recursive_get(string_view s) {
+    bt_value val;
+    recursive_get(s, val);
+    return val;
+}
+
+// Heap allocations made by one call of `f`
+template <typename F>
+uint64_t count_allocations(F&& f) {
+    auto before = allocations().load();
+    f();
+    return allocations().load() - before;
+}
+
+void compare_parse(const std::string& name, const std::string& data) {
+    std::printf("%s: %llu allocations recursive, %llu bt_get, %llu bt_validate\n", name.c_str(),
+            static_cast<unsigned long long>(count_allocations([&] { auto v = recursive_get(data); keep(v); })),
+            static_cast<unsigned long long>(count_allocations([&] { auto v = bt_get(data); keep(v); })),
+            static_cast<unsigned long long>(count_allocations([&] { keep(bt_validate(data)); })));
+    auto recursive = run(name + ", recursive", [&] { auto v = recursive_get(data); keep(v); }, data.size());
+    auto iterative = run(name + ", bt_get", [&] { auto v = bt_get(data); keep(v); }, data.size());
+    auto validate = run(name + ", bt_validate", [&] { keep(bt_validate(data)); }, data.size());
+    compare(iterative, recursive);
+    compare(validate, iterative);
+}
+
+}
+
+int main() {
+    compare_parse("control message", bt_serialize(bt_dict{
+            {"command", "sn.data"},
+            {"route", std::string(33, 'r')},
+            {"data", bt_list{{std::string(200, 'x'), std::string(64, 'y')}}},
+            {"hint", "tcp://10.1.2.3:22020"},
+            {"optional", 1},
+            {"keep-alive", 30000}}));
+
+    // 60 levels of `l i1e 2:ab ... e` -- near the default depth limit
+    std::string nested;
+    for (int i = 0; i < 60; i++)
+        nested += "li" + std::to_string(i) + "e2:ab";
+    nested += std::string(60, 'e');
+    compare_parse("60-deep lists", nested);
+
+    // A wide list of small dicts (bounded by max_elements rather than depth)
+    bt_list wide;
+    for (int i = 0; i < 1000; i++)
+        wide.push_back(bt_dict{{"a", i}, {"b", "value"}});
+    compare_parse("1000 small dicts", bt_serialize(wide));
+
+    // 1MB of `l`: rejected at depth 65 by the limited parsers; the recursive parser would recurse a
+    // million levels deep (and, on a worker thread's stack, crash), so it isn't run here.
+    std::string hostile(1 << 20, 'l');
+    run("reject 1MB of 'l', bt_get", [&] {
+        try { auto v = bt_get(hostile); keep(v); std::abort(); } catch (const bt_deserialize_invalid&) {}
+    });
+    run("reject 1MB of 'l', bt_validate", [&] { if (bt_validate(hostile)) std::abort(); });
+}
+
+// vim:sw=4:et
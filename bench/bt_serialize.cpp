@@ -0,0 +1,91 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// Compares bt serialization through an ostringstream (the original path, still used by
+// `os << bt_serializer(val)`) with serializing into an exactly sized buffer via
+// bt_serialized_size() + bt_serialize_to() (which is also what bt_serialize() now does).
+
+#include <map>
+#include <sstream>
+#include <vector>
+#include "bench.h"
+#include "lokimq/bt_serialize.h"
+
+using namespace lokimq;
+using namespace lokimq::bench;
+
+namespace {
+
+template <typename T>
+void compare_serialize(const std::string& name, const T& val) {
+    auto size = bt_serialized_size(val);
+    auto stream = run(name + ", ostringstream", [&] {
+        std::ostringstream os;
+        os << bt_serializer(val);
+        auto s = os.str();
+        keep(s);
+    }, size);
+    auto sized = run(name + ", sized buffer", [&] {
+        std::string s(bt_serialized_size(val), '\0');
+        bt_serialize_to(&s[0], val);
+        keep(s);
+    }, size);
+    std::string buf(size, '\0');
+    run(name + ", reused buffer", [&] {
+        bt_serialize_to(&buf[0], val);
+        keep(buf);
+    }, size);
+    compare(sized, stream);
+}
+
+}
+
+int main() {
+    std::vector<std::string> strings;
+    for (int i = 0; i < 1000; i++)
+        strings.emplace_back(32, static_cast<char>('a' + i % 26));
+    compare_serialize("1000 32-byte strings", strings);
+
+    std::map<std::string, std::vector<int64_t>> int_lists;
+    for (int i = 0; i < 100; i++) {
+        auto& l = int_lists["key" + std::to_string(i)];
+        for (int64_t j = 0; j < 50; j++)
+            l.push_back(j * 1234567 - 1000000);
+    }
+    compare_serialize("100 lists of 50 ints", int_lists);
+
+    // The shape of a proxy SEND control message
+    bt_dict control{
+        {"pubkey", std::string(32, 'P')},
+        {"keep-alive", 30000},
+        {"send", bt_list{{"quorum.vote", std::string(200, 'v')}}}};
+    compare_serialize("SEND control message", control);
+}
+
+// vim:sw=4:et
@@ -0,0 +1,115 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// Benchmarks the bt_tape structural index against bt_dict_consumer/bt_list_consumer and full
+// bt_value deserialization on a multi-megabyte blob shaped like the service node state (a dict with
+// a list of a few thousand service node records).
+
+#include <cassert>
+#include <iterator>
+#include "bench.h"
+#include "lokimq/bt_serialize.h"
+#include "lokimq/bt_tape.h"
+
+using namespace lokimq;
+using namespace lokimq::bench;
+
+namespace {
+
+std::string make_sn_state(int count) {
+    bt_list sns;
+    for (int i = 0; i < count; i++) {
+        bt_list contributors;
+        for (int c = 0; c < 4; c++)
+            contributors.push_back(bt_dict{
+                {"address", std::string(95, static_cast<char>('A' + c))},
+                {"amount", 3750000000000 + c},
+                {"reserved", 3750000000000}});
+        sns.push_back(bt_dict{
+            {"contributors", std::move(contributors)},
+            {"ip", "10.1." + std::to_string(i / 256) + "." + std::to_string(i % 256)},
+            {"last_reward_height", 500000 + i},
+            {"pubkey", std::string(32, static_cast<char>(i))},
+            {"state", bt_dict{{"active", 1}, {"decommission_count", i % 3}, {"last_uptime_proof", 1580000000 + i}}},
+            {"storage_port", 22021},
+            {"version", bt_list{{7, 1, i % 10}}}});
+    }
+    return bt_serialize(bt_dict{{"height", 512345}, {"service_nodes", std::move(sns)}, {"top_block", std::string(32, 'h')}});
+}
+
+// Checks that encoded() of every string on the tape is exactly its "N:" prefix plus the string
+// (which, e.g. for `l3:1234:abcde`, needs more than backing up over digits to find the prefix).
+void check_encoded(const bt_tape& tape) {
+    for (uint32_t i = 0; i < tape.entries().size(); i++) {
+        bt_tape_value v{tape, i};
+        if (!v.is_string())
+            continue;
+        auto s = v.string();
+        auto enc = v.encoded();
+        std::string expected = std::to_string(s.size()) + ":" + std::string{s.data(), s.size()};
+        if (enc != string_view{expected}) {
+            std::fprintf(stderr, "bt_tape_value::encoded() returned the wrong data for entry %u\n", i);
+            std::exit(1);
+        }
+    }
+}
+
+}
+
+int main() {
+    check_encoded(bt_tape{string_view{"l3:1234:abcde"}});
+
+    const int count = 5000, target = 3777;
+    auto blob = make_sn_state(count);
+    std::printf("SN state blob: %zu bytes, %d service nodes\n", blob.size(), count);
+    bt_tape tape{blob};
+    check_encoded(tape);
+
+    run("tape scan", [&] { tape.parse(blob); keep(tape); }, blob.size());
+    run("bt_validate", [&] { keep(bt_validate(blob)); }, blob.size());
+    run("bt_get (full bt_value)", [&] { auto v = bt_get(blob); keep(v); }, blob.size());
+
+    auto consumer = run("lookup sn[" + std::to_string(target) + "].pubkey, consumers", [&] {
+        bt_dict_consumer d{blob};
+        d.skip_until("service_nodes");
+        bt_list_consumer sns{d.consume_list_data().second};
+        for (int i = 0; i < target; i++)
+            sns.skip_value();
+        bt_dict_consumer sn{sns.consume_dict_data()};
+        sn.skip_until("pubkey");
+        keep(sn.consume_string().second);
+    });
+    auto tape_lookup = run("lookup sn[" + std::to_string(target) + "].pubkey, tape", [&] {
+        auto sns = tape.root().at("service_nodes");
+        keep((*std::next(sns.begin(), target)).at("pubkey").string());
+    });
+    compare(tape_lookup, consumer);
+}
+
+// vim:sw=4:et
@@ -0,0 +1,88 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+// Measures where copying std::string message data into a buffer_pool block stops being cheaper
+// than handing the string itself over to zmq (which costs a heap-allocated std::string wrapper,
+// freed along with the data once zmq is done), to choose MAX_POOLED_COPY in lokimq.cpp.  Both
+// paths include building the string (which the caller does either way) and freeing everything, as
+// happens once zmq has sent the message.
+
+#include <cstring>
+#define LOKIMQ_BENCH_COUNT_ALLOCS
+#include "bench.h"
+#include "lokimq/buffer_pool.h"
+
+using namespace lokimq;
+using namespace lokimq::bench;
+
+namespace {
+
+// What create_message(std::string&&) does for data up to MAX_POOLED_COPY, and pooled_buffer_release
+// once the message is sent
+void pooled_copy(std::string data) {
+    void* hint;
+    void* block = buffer_pool::instance().acquire(data.size(), hint);
+    std::memcpy(block, data.data(), data.size());
+    keep(block);
+    buffer_pool::release(block, hint);
+}
+
+// What it does for larger data, and message_buffer_destroy once the message is sent
+void handed_over(std::string data) {
+    auto* buffer = new std::string(std::move(data));
+    keep(buffer->data());
+    delete buffer;
+}
+
+}
+
+int main() {
+    for (size_t size : {64, 256, 512, 1024, 2048, 4096, 16384}) {
+        std::string payload(size, 'x');
+        auto sz = " (" + std::to_string(size) + " bytes)";
+        pooled_copy(payload); // so that the pool's slab allocation isn't counted
+        auto before = allocations().load();
+        pooled_copy(payload);
+        auto pooled_allocs = allocations().load() - before;
+        before = allocations().load();
+        handed_over(payload);
+        auto handed_allocs = allocations().load() - before;
+        std::printf("%zu bytes: %llu allocation(s) per message pooled, %llu handed over\n", size,
+                static_cast<unsigned long long>(pooled_allocs), static_cast<unsigned long long>(handed_allocs));
+        auto pooled = run("pooled copy" + sz, [&] { pooled_copy(payload); }, size);
+        auto handed = run("std::string handover" + sz, [&] { handed_over(payload); }, size);
+        if (pooled.ns_per_op() < handed.ns_per_op())
+            compare(pooled, handed);
+        else
+            compare(handed, pooled);
+    }
+}
+
+// vim:sw=4:et
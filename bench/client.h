@@ -0,0 +1,103 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sodium.h>
+#include "zmq.hpp"
+
+namespace lokimq { namespace bench {
+
+/// A bare zmq DEALER connection to a LokiMQ listener, for benchmarks that need many (or cheap)
+/// client connections.  It speaks just enough of the protocol to send commands and read replies.
+class raw_client {
+public:
+    /// Connects to `addr`.  If `server_pubkey` is non-empty then the connection uses CURVE (with
+    /// the given client keys, or a new random keypair if `privkey` is empty); otherwise it uses the
+    /// NULL mechanism (for listen_local() addresses).
+    raw_client(zmq::context_t& ctx, const std::string& addr, const std::string& server_pubkey = "",
+            std::string pubkey = "", std::string privkey = "")
+        : socket{ctx, zmq::socket_type::dealer} {
+        if (!server_pubkey.empty()) {
+            if (privkey.empty()) {
+                pubkey.resize(crypto_box_PUBLICKEYBYTES);
+                privkey.resize(crypto_box_SECRETKEYBYTES);
+                crypto_box_keypair(reinterpret_cast<unsigned char*>(&pubkey[0]), reinterpret_cast<unsigned char*>(&privkey[0]));
+            }
+            socket.setsockopt(ZMQ_CURVE_SERVERKEY, server_pubkey.data(), server_pubkey.size());
+            socket.setsockopt(ZMQ_CURVE_PUBLICKEY, pubkey.data(), pubkey.size());
+            socket.setsockopt(ZMQ_CURVE_SECRETKEY, privkey.data(), privkey.size());
+        }
+        socket.setsockopt<int>(ZMQ_LINGER, 0);
+        socket.connect(addr);
+    }
+
+    /// Sends a command with optional (raw) data parts
+    void send(const std::string& cmd, const std::vector<std::string>& data = {}) {
+        zmq::message_t c{cmd.data(), cmd.size()};
+        socket.send(c, data.empty() ? zmq::send_flags::none : zmq::send_flags::sndmore);
+        for (size_t i = 0; i < data.size(); i++) {
+            zmq::message_t d{data[i].data(), data[i].size()};
+            socket.send(d, i + 1 < data.size() ? zmq::send_flags::sndmore : zmq::send_flags::none);
+        }
+    }
+
+    /// Waits up to `timeout` for a message and returns its parts (command first), or an empty
+    /// vector on timeout.
+    std::vector<std::string> recv(std::chrono::milliseconds timeout = 5s) {
+        std::vector<std::string> parts;
+        zmq::pollitem_t item{static_cast<void*>(socket), 0, ZMQ_POLLIN, 0};
+        if (zmq::poll(&item, 1, timeout) <= 0)
+            return parts;
+        zmq::message_t msg;
+        do {
+            if (!socket.recv(msg, zmq::recv_flags::none))
+                break;
+            parts.emplace_back(static_cast<const char*>(msg.data()), msg.size());
+        } while (msg.more());
+        return parts;
+    }
+
+    /// Sends HI and waits for the HELLO reply, i.e. for the connection handshake (including
+    /// authentication) to complete.  Returns false on timeout.
+    bool handshake(std::chrono::milliseconds timeout = 5s) {
+        send("HI");
+        auto reply = recv(timeout);
+        return !reply.empty() && reply[0] == "HELLO";
+    }
+
+    zmq::socket_t socket;
+};
+
+}}
+
+// vim:sw=4:et
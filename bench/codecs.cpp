@@ -0,0 +1,138 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+// Benchmarks the vectorized hex buffer functions against the scalar iterator versions, and the
+// base32z and base64 encoders/decoders, at a pubkey-sized and a larger input.  Also checks that the
+// vectorized functions agree with the scalar ones for every length up to 200 bytes (so that each
+// kernel's tail handling is exercised).
+
+#include <iterator>
+#include "bench.h"
+#include "lokimq/base32z.h"
+#include "lokimq/base64.h"
+#include "lokimq/hex.h"
+
+using namespace lokimq;
+using namespace lokimq::bench;
+
+namespace {
+
+std::string random_bytes(size_t size) {
+    std::string s(size, '\0');
+    uint32_t x = 12345;
+    for (auto& c : s) {
+        x = x * 1103515245 + 12345;
+        c = static_cast<char>(x >> 24);
+    }
+    return s;
+}
+
+void fail(const char* what, size_t size) {
+    std::fprintf(stderr, "%s mismatch for %zu bytes\n", what, size);
+    std::exit(1);
+}
+
+void check_hex() {
+    for (size_t size = 0; size <= 200; size++) {
+        auto bytes = random_bytes(size);
+        std::string scalar, vector(2 * size, '\0');
+        lokimq::to_hex(bytes.begin(), bytes.end(), std::back_inserter(scalar));
+        lokimq::to_hex(string_view{bytes}, &vector[0]);
+        if (scalar != vector)
+            fail("to_hex", size);
+
+        // Mixed case, to check that the decoder handles upper case digits
+        for (size_t i = 0; i < vector.size(); i += 3)
+            if (vector[i] >= 'a')
+                vector[i] -= 'a' - 'A';
+        if (!lokimq::is_hex(string_view{vector}) || !lokimq::is_hex(vector.begin(), vector.end()))
+            fail("is_hex", size);
+        std::string decoded(size, '\0');
+        lokimq::from_hex(string_view{vector}, &decoded[0]);
+        if (decoded != bytes)
+            fail("from_hex", size);
+
+        if (size > 0) {
+            vector[size] = 'g';
+            if (lokimq::is_hex(string_view{vector}))
+                fail("is_hex (invalid)", size);
+        }
+    }
+}
+
+void bench_hex(size_t size) {
+    auto bytes = random_bytes(size);
+    auto hex = lokimq::to_hex(bytes);
+    std::string out(2 * size, '\0');
+    auto sz = " (" + std::to_string(size) + " bytes)";
+
+    auto scalar_enc = run("to_hex, iterator" + sz, [&] { lokimq::to_hex(bytes.begin(), bytes.end(), &out[0]); keep(out); }, size);
+    auto vector_enc = run("to_hex, buffer" + sz, [&] { lokimq::to_hex(string_view{bytes}, &out[0]); keep(out); }, size);
+    auto scalar_dec = run("from_hex, iterator" + sz, [&] { lokimq::from_hex(hex.begin(), hex.end(), &out[0]); keep(out); }, size);
+    auto vector_dec = run("from_hex, buffer" + sz, [&] { lokimq::from_hex(string_view{hex}, &out[0]); keep(out); }, size);
+    auto scalar_is = run("is_hex, iterator" + sz, [&] { keep(lokimq::is_hex(hex.begin(), hex.end())); }, size);
+    auto vector_is = run("is_hex, buffer" + sz, [&] { keep(lokimq::is_hex(string_view{hex})); }, size);
+    compare(vector_enc, scalar_enc);
+    compare(vector_dec, scalar_dec);
+    compare(vector_is, scalar_is);
+}
+
+void bench_base32z_base64(size_t size) {
+    auto bytes = random_bytes(size);
+    auto b32z = to_base32z(bytes);
+    auto b64 = to_base64(bytes);
+    if (from_base32z(b32z) != bytes || !is_base32z(b32z))
+        fail("base32z", size);
+    if (from_base64(b64) != bytes || !is_base64(b64))
+        fail("base64", size);
+    std::string out(to_base64_size(size) + to_base32z_size(size), '\0');
+    auto sz = " (" + std::to_string(size) + " bytes)";
+
+    run("to_base32z, string" + sz, [&] { auto s = to_base32z(bytes); keep(s); }, size);
+    run("to_base32z, buffer" + sz, [&] { to_base32z(bytes.begin(), bytes.end(), &out[0]); keep(out); }, size);
+    run("from_base32z, string" + sz, [&] { auto s = from_base32z(b32z); keep(s); }, size);
+    run("from_base32z, buffer" + sz, [&] { from_base32z(b32z.begin(), b32z.end(), &out[0]); keep(out); }, size);
+    run("to_base64, string" + sz, [&] { auto s = to_base64(bytes); keep(s); }, size);
+    run("to_base64, buffer" + sz, [&] { to_base64(bytes.begin(), bytes.end(), &out[0]); keep(out); }, size);
+    run("from_base64, string" + sz, [&] { auto s = from_base64(b64); keep(s); }, size);
+    run("from_base64, buffer" + sz, [&] { from_base64(b64.begin(), b64.end(), &out[0]); keep(out); }, size);
+}
+
+}
+
+int main() {
+    check_hex();
+    for (size_t size : {32, 65536}) {
+        bench_hex(size);
+        bench_base32z_base64(size);
+    }
+}
+
+// vim:sw=4:et
@@ -0,0 +1,97 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// Measures request/reply throughput over ipc to a regular (CURVE) listening address and to a
+// trusted local (NULL mechanism, see listen_local()) address, for a few message sizes.
+
+#include <sodium.h>
+#include "bench.h"
+#include "client.h"
+#include "lokimq/lokimq.h"
+
+using namespace lokimq;
+using namespace lokimq::bench;
+
+namespace {
+
+// Requests we keep in flight; below PEER_QUEUE_SIZE so that none get dropped
+constexpr uint64_t WINDOW = 64;
+
+result throughput(std::string name, raw_client& client, size_t size) {
+    std::vector<std::string> data{std::string(size, 'x')};
+    result r;
+    r.name = std::move(name);
+    r.bytes = size;
+    uint64_t sent = 0;
+    auto start = clock::now();
+    bool sending = true;
+    while (r.iterations < sent || sending) {
+        sending = clock::now() - start < 2s;
+        for (; sending && sent - r.iterations < WINDOW; sent++)
+            client.send("bench.echo", data);
+        auto reply = client.recv(5s);
+        if (reply.empty()) {
+            std::fprintf(stderr, "request timed out\n");
+            std::exit(1);
+        }
+        r.iterations++;
+    }
+    r.seconds = std::chrono::duration<double>(clock::now() - start).count();
+    print(r);
+    return r;
+}
+
+}
+
+int main() {
+    if (sodium_init() < 0)
+        return 1;
+    const std::string curve_addr = "ipc:///tmp/lokimq-bench-curve.sock", local_addr = "ipc:///tmp/lokimq-bench-local.sock";
+    LokiMQ server{"", "", false, {curve_addr},
+        [](const std::string&) { return ""s; },
+        [](string_view, string_view) { return Allow{AuthLevel::none, false}; }};
+    server.listen_local(local_addr, std::string(32, 'L'), Allow{AuthLevel::none, false});
+    server.add_category("bench", Access{AuthLevel::none}, 0, -1);
+    server.add_command("bench", "echo", [](Message& m) { m.reply("bench.pong"); });
+    server.start();
+
+    zmq::context_t ctx;
+    raw_client curve{ctx, curve_addr, server.get_pubkey()}, local{ctx, local_addr};
+    if (!curve.handshake() || !local.handshake()) {
+        std::fprintf(stderr, "handshake failed\n");
+        return 1;
+    }
+    for (size_t size : {64, 4096, 65536}) {
+        auto c = throughput("ipc CURVE, " + std::to_string(size) + "B", curve, size);
+        auto n = throughput("ipc NULL, " + std::to_string(size) + "B", local, size);
+        compare(n, c);
+    }
+}
+
+// vim:sw=4:et
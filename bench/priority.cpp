@@ -0,0 +1,105 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// Measures the round trip latency of commands in a high priority category ("sn") while another
+// connection keeps a low priority category ("rpc") saturated with slow commands, with the two
+// categories at equal priority and then with "sn" at a higher priority.
+
+#include <sodium.h>
+#include <thread>
+#include "bench.h"
+#include "client.h"
+#include "lokimq/lokimq.h"
+
+using namespace lokimq;
+using namespace lokimq::bench;
+
+namespace {
+
+void latency(const std::string& name, int sn_priority, const std::string& addr) {
+    LokiMQ server{"", "", false, {addr},
+        [](const std::string&) { return ""s; },
+        [](string_view, string_view) { return Allow{AuthLevel::none, false}; },
+        [](LogLevel, const char*, int, std::string) {},
+        2 /* general workers */};
+    server.add_category("rpc", Access{AuthLevel::none}, 0, -1, 0);
+    server.add_command("rpc", "slow", [](Message&) { std::this_thread::sleep_for(1ms); });
+    server.add_category("sn", Access{AuthLevel::none}, 0, -1, sn_priority);
+    server.add_command("sn", "ping", [](Message& m) { m.reply("sn.pong"); });
+    server.start();
+
+    zmq::context_t ctx;
+    std::atomic<bool> done{false};
+    // Two workers at 1ms per command handle ~2000/s; send half again as many
+    std::thread flood{[&] {
+        raw_client rpc{ctx, addr, server.get_pubkey()};
+        rpc.handshake();
+        auto next = clock::now();
+        while (!done) {
+            for (int i = 0; i < 3; i++)
+                rpc.send("rpc.slow");
+            next += 1ms;
+            std::this_thread::sleep_until(next);
+        }
+    }};
+
+    raw_client sn{ctx, addr, server.get_pubkey()};
+    sn.handshake();
+    std::this_thread::sleep_for(500ms); // Let the rpc queue build up
+    std::vector<double> samples;
+    auto start = clock::now();
+    while (clock::now() - start < 3s) {
+        auto sent = clock::now();
+        sn.send("sn.ping");
+        auto reply = sn.recv(10s);
+        if (reply.empty() || reply[0] != "sn.pong") {
+            std::fprintf(stderr, "sn.ping timed out\n");
+            std::exit(1);
+        }
+        samples.push_back(std::chrono::duration<double, std::milli>(clock::now() - sent).count());
+        std::this_thread::sleep_for(2ms);
+    }
+    done = true;
+    flood.join();
+
+    auto p50 = percentile(samples, 50), p99 = percentile(samples, 99);
+    std::printf("%-40s %8zu pings  p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n",
+            name.c_str(), samples.size(), p50, p99, samples.back());
+}
+
+}
+
+int main() {
+    if (sodium_init() < 0)
+        return 1;
+    latency("sn.ping, equal priority", 0, "tcp://127.0.0.1:4711");
+    latency("sn.ping, sn priority 10", 10, "tcp://127.0.0.1:4712");
+}
+
+// vim:sw=4:et
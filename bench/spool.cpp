@@ -0,0 +1,125 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+// Benchmarks the spool journal used for strong sends to unreachable peers: appending messages
+// (about the size of an uptime proof) while the peer is down, replaying them once it is back,
+// appending to a full journal (which drops the oldest message each time), and the steady state
+// where compaction reclaims consumed space.  First checks the journal against an in-memory queue
+// over a random sequence of appends and pops.
+
+#include <deque>
+#include <unistd.h>
+#include "bench.h"
+#include "lokimq/spool.h"
+
+using namespace lokimq;
+using namespace lokimq::bench;
+
+namespace {
+
+// A fresh journal file in the temporary directory
+std::string journal_path() {
+    const char* tmp = std::getenv("TMPDIR");
+    std::string path = std::string{tmp ? tmp : "/tmp"} + "/lokimq-bench-" + std::to_string(getpid()) + ".spool";
+    std::remove(path.c_str());
+    return path;
+}
+
+void check_journal(const std::string& path) {
+    spool_journal journal{path, 64 * 1024};
+    std::deque<std::string> expected;
+    auto expires = spool_journal::clock::now() + 1h;
+    uint32_t x = 1;
+    uint64_t n = 0;
+    std::vector<string_view> parts;
+    for (int i = 0; i < 200000; i++) {
+        x = x * 1103515245 + 12345;
+        if ((x >> 16) % 3) {
+            std::string msg((x >> 8) % 900 + 1, static_cast<char>('a' + n % 26));
+            msg += std::to_string(n++);
+            auto dropped = journal.dropped();
+            journal.append({string_view{msg}}, expires);
+            expected.erase(expected.begin(), expected.begin() + (journal.dropped() - dropped));
+            expected.push_back(std::move(msg));
+        } else if (journal.front(parts)) {
+            if (expected.empty() || parts.size() != 1 || parts[0] != string_view{expected.front()}) {
+                std::fprintf(stderr, "spool journal returned the wrong message after %d operations\n", i);
+                std::exit(1);
+            }
+            journal.pop();
+            expected.pop_front();
+        }
+        if (journal.size() != expected.size()) {
+            std::fprintf(stderr, "spool journal has %llu messages after %d operations, expected %zu\n",
+                    static_cast<unsigned long long>(journal.size()), i, expected.size());
+            std::exit(1);
+        }
+    }
+    std::remove(path.c_str());
+}
+
+}
+
+int main() {
+    auto path = journal_path();
+    check_journal(path);
+
+    const size_t capacity = 64 * 1024 * 1024, batch = 10000;
+    std::string command = "quorum.uptime_proof", data(1000, 'p');
+    std::vector<string_view> msg{command, data}, parts;
+    const size_t size = command.size() + data.size();
+    auto expires = spool_journal::clock::now() + 1h;
+
+    {
+        spool_journal journal{path, capacity};
+        run("append " + std::to_string(batch) + " then replay", [&] {
+            for (size_t i = 0; i < batch; i++)
+                journal.append(msg, expires);
+            while (journal.front(parts)) {
+                keep(parts);
+                journal.pop();
+            }
+        }, batch * size);
+
+        // Interleaved appends and pops: the journal fills up and then compacts
+        run("append + pop (compacting)", [&] {
+            journal.append(msg, expires);
+            journal.front(parts);
+            keep(parts);
+            journal.pop();
+        }, size);
+
+        while (journal.append(msg, expires) && journal.dropped() == 0) {}
+        run("append to a full journal (drops oldest)", [&] { journal.append(msg, expires); }, size);
+    }
+    std::remove(path.c_str());
+}
+
+// vim:sw=4:et
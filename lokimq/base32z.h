@@ -0,0 +1,141 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+#include <string>
+#include <iterator>
+#include <cassert>
+
+namespace lokimq {
+
+namespace detail {
+
+/// Compile-time generated lookup tables for base32z conversion.  This is the z-base-32 encoding
+/// used by lokinet addresses (which are the base32z encoding of a 32-byte pubkey).
+struct b32z_table {
+    // Value of each base32z character, or -1 if not a base32z character
+    signed char from_b32z_lut[256];
+    char to_b32z_lut[32];
+    constexpr b32z_table() noexcept : from_b32z_lut{}, to_b32z_lut{
+            'y', 'b', 'n', 'd', 'r', 'f', 'g', '8', 'e', 'j', 'k', 'm', 'c', 'p', 'q', 'x',
+            'o', 't', '1', 'u', 'w', 'i', 's', 'z', 'a', '3', '4', '5', 'h', '7', '6', '9'} {
+        for (int c = 0; c < 256; c++)
+            from_b32z_lut[c] = -1;
+        for (unsigned char b = 0; b < 32; b++)
+            from_b32z_lut[(unsigned char) to_b32z_lut[b]] = (signed char) b;
+    }
+    constexpr char from_b32z(unsigned char c) const noexcept { return from_b32z_lut[c]; }
+    constexpr char to_b32z(unsigned char b) const noexcept { return to_b32z_lut[b]; }
+    constexpr bool is_b32z(unsigned char c) const noexcept { return from_b32z_lut[c] >= 0; }
+} constexpr b32z_lut;
+
+} // namespace detail
+
+/// Returns the number of base32z characters needed to encode `bytes` bytes (there is no padding).
+constexpr size_t to_base32z_size(size_t bytes) { return (bytes * 8 + 4) / 5; }
+
+/// Returns the number of bytes encoded by `chars` base32z characters.
+constexpr size_t from_base32z_size(size_t chars) { return chars * 5 / 8; }
+
+/// Converts bytes into base32z encoded characters, written to `out` (which can be a pointer to a
+/// buffer with room for `to_base32z_size(distance(begin, end))` characters, or any other output
+/// iterator).  Returns the output iterator just past the written characters.
+template <typename InputIt, typename OutputIt>
+OutputIt to_base32z(InputIt begin, InputIt end, OutputIt out) {
+    unsigned int bits = 0; // Bits not yet written (in the low `nbits` bits)
+    int nbits = 0;
+    for (; begin != end; ++begin) {
+        bits = (bits << 8) | static_cast<unsigned char>(*begin);
+        nbits += 8;
+        while (nbits >= 5) {
+            nbits -= 5;
+            *out++ = detail::b32z_lut.to_b32z((bits >> nbits) & 0x1f);
+        }
+    }
+    if (nbits > 0)
+        *out++ = detail::b32z_lut.to_b32z((bits << (5 - nbits)) & 0x1f);
+    return out;
+}
+
+/// Creates a base32z string from an iterable, std::string-like object
+template <typename String>
+std::string to_base32z(const String& s) {
+    std::string b32z(to_base32z_size(s.size()), '\0');
+    to_base32z(s.begin(), s.end(), &b32z[0]);
+    return b32z;
+}
+
+/// Returns true if the range is a valid base32z encoding: all elements are base32z characters, and
+/// the length is one that an encoding produces.
+template <typename It>
+constexpr bool is_base32z(It begin, It end) {
+    size_t count = 0;
+    for (; begin != end; ++begin, ++count) {
+        if (!detail::b32z_lut.is_b32z(*begin))
+            return false;
+    }
+    // Any leftover bits must be padding, i.e. fewer than one character's worth
+    return count * 5 % 8 < 5;
+}
+
+/// Returns true if the string-like value is a valid base32z encoding
+template <typename String>
+constexpr bool is_base32z(const String& s) { return is_base32z(s.begin(), s.end()); }
+
+/// Converts a sequence of base32z characters to bytes, written to `out` (which can be a pointer to
+/// a buffer with room for `from_base32z_size(distance(begin, end))` bytes, or any other output
+/// iterator).  Returns the output iterator just past the written bytes.  Undefined behaviour if
+/// the input is not valid base32z (see `is_base32z()`).  It is permitted for the input and output
+/// ranges to overlap as long as out is no later than begin.
+template <typename InputIt, typename OutputIt>
+OutputIt from_base32z(InputIt begin, InputIt end, OutputIt out) {
+    unsigned int bits = 0;
+    int nbits = 0;
+    for (; begin != end; ++begin) {
+        bits = (bits << 5) | static_cast<unsigned char>(detail::b32z_lut.from_b32z(*begin));
+        nbits += 5;
+        if (nbits >= 8) {
+            nbits -= 8;
+            *out++ = static_cast<char>(bits >> nbits);
+        }
+    }
+    // Any remaining bits are padding
+    return out;
+}
+
+/// Converts base32z characters from a std::string-like object into a std::string of bytes.
+/// Undefined behaviour if the input is not valid base32z.
+template <typename String>
+std::string from_base32z(const String& s) {
+    std::string bytes(from_base32z_size(s.size()), '\0');
+    bytes.resize(from_base32z(s.begin(), s.end(), &bytes[0]) - &bytes[0]);
+    return bytes;
+}
+
+}
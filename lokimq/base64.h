@@ -0,0 +1,167 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+#include <string>
+#include <iterator>
+#include <cassert>
+
+namespace lokimq {
+
+namespace detail {
+
+/// Compile-time generated lookup tables for (standard, RFC 4648) base64 conversion
+struct b64_table {
+    // Value of each base64 character, or -1 if not a base64 character
+    signed char from_b64_lut[256];
+    char to_b64_lut[64];
+    constexpr b64_table() noexcept : from_b64_lut{}, to_b64_lut{} {
+        for (int c = 0; c < 256; c++)
+            from_b64_lut[c] = -1;
+        for (unsigned char c = 0; c < 26; c++) {
+            from_b64_lut[(unsigned char)('A' + c)] =  0 + c;
+            to_b64_lut[  (unsigned char)( 0  + c)] = 'A' + c;
+            from_b64_lut[(unsigned char)('a' + c)] = 26 + c;
+            to_b64_lut[  (unsigned char)(26  + c)] = 'a' + c;
+        }
+        for (unsigned char c = 0; c < 10; c++) {
+            from_b64_lut[(unsigned char)('0' + c)] = 52 + c;
+            to_b64_lut[  (unsigned char)(52  + c)] = '0' + c;
+        }
+        from_b64_lut[(unsigned char) '+'] = 62;
+        to_b64_lut[62] = '+';
+        from_b64_lut[(unsigned char) '/'] = 63;
+        to_b64_lut[63] = '/';
+    }
+    constexpr char from_b64(unsigned char c) const noexcept { return from_b64_lut[c]; }
+    constexpr char to_b64(unsigned char b) const noexcept { return to_b64_lut[b]; }
+    constexpr bool is_b64(unsigned char c) const noexcept { return from_b64_lut[c] >= 0; }
+} constexpr b64_lut;
+
+} // namespace detail
+
+/// Returns the number of base64 characters (including `=` padding) needed to encode `bytes` bytes.
+constexpr size_t to_base64_size(size_t bytes) { return (bytes + 2) / 3 * 4; }
+
+/// Returns the (maximum) number of bytes encoded by `chars` base64 characters: the actual number is
+/// smaller if the characters include padding.
+constexpr size_t from_base64_size(size_t chars) { return chars * 3 / 4; }
+
+/// Converts bytes into base64 encoded characters (with padding), written to `out` (which can be a
+/// pointer to a buffer with room for `to_base64_size(distance(begin, end))` characters, or any
+/// other output iterator).  Returns the output iterator just past the written characters.
+template <typename InputIt, typename OutputIt>
+OutputIt to_base64(InputIt begin, InputIt end, OutputIt out) {
+    unsigned int bits = 0;
+    int nbits = 0;
+    for (; begin != end; ++begin) {
+        bits = (bits << 8) | static_cast<unsigned char>(*begin);
+        nbits += 8;
+        while (nbits >= 6) {
+            nbits -= 6;
+            *out++ = detail::b64_lut.to_b64((bits >> nbits) & 0x3f);
+        }
+    }
+    if (nbits > 0) {
+        *out++ = detail::b64_lut.to_b64((bits << (6 - nbits)) & 0x3f);
+        // 2 leftover bits (from 1 trailing byte) need 2 padding chars; 4 leftover bits need 1
+        *out++ = '=';
+        if (nbits == 2)
+            *out++ = '=';
+    }
+    return out;
+}
+
+/// Creates a base64 string from an iterable, std::string-like object
+template <typename String>
+std::string to_base64(const String& s) {
+    std::string b64(to_base64_size(s.size()), '\0');
+    to_base64(s.begin(), s.end(), &b64[0]);
+    return b64;
+}
+
+/// Returns true if the range is a valid base64 encoding: base64 characters followed by (at most
+/// two) `=` padding characters, with the padding (if present) making the length a multiple of 4.
+/// Unpadded values are also accepted, as long as the length is one that an encoding produces.
+template <typename It>
+constexpr bool is_base64(It begin, It end) {
+    size_t count = 0, padding = 0;
+    for (; begin != end; ++begin) {
+        if (padding > 0 || *begin == '=') {
+            if (*begin != '=' || ++padding > 2)
+                return false;
+        } else if (detail::b64_lut.is_b64(*begin)) {
+            ++count;
+        } else {
+            return false;
+        }
+    }
+    // A single trailing character would only encode 6 bits, which isn't a byte
+    if (count % 4 == 1)
+        return false;
+    return padding == 0 || (count + padding) % 4 == 0;
+}
+
+/// Returns true if the string-like value is a valid base64 encoding
+template <typename String>
+constexpr bool is_base64(const String& s) { return is_base64(s.begin(), s.end()); }
+
+/// Converts a sequence of base64 characters (with or without padding) to bytes, written to `out`
+/// (which can be a pointer to a buffer with room for `from_base64_size(distance(begin, end))`
+/// bytes, or any other output iterator).  Returns the output iterator just past the written bytes.
+/// Undefined behaviour if the input is not valid base64 (see `is_base64()`).  It is permitted for
+/// the input and output ranges to overlap as long as out is no later than begin.
+template <typename InputIt, typename OutputIt>
+OutputIt from_base64(InputIt begin, InputIt end, OutputIt out) {
+    unsigned int bits = 0;
+    int nbits = 0;
+    for (; begin != end; ++begin) {
+        if (*begin == '=')
+            break;
+        bits = (bits << 6) | static_cast<unsigned char>(detail::b64_lut.from_b64(*begin));
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            *out++ = static_cast<char>(bits >> nbits);
+        }
+    }
+    // Any remaining bits are padding
+    return out;
+}
+
+/// Converts base64 characters from a std::string-like object into a std::string of bytes.
+/// Undefined behaviour if the input is not valid base64.
+template <typename String>
+std::string from_base64(const String& s) {
+    std::string bytes(from_base64_size(s.size()), '\0');
+    bytes.resize(from_base64(s.begin(), s.end(), &bytes[0]) - &bytes[0]);
+    return bytes;
+}
+
+}
@@ -0,0 +1,290 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include "bt_serialize.h"
+
+/** \file
+ * Compile-time mapping of a struct to a bt-encoded dict.  For example:
+ *
+ *     namespace myapp {
+ *     struct vote {
+ *         uint64_t height;
+ *         std::string pubkey;
+ *         std::string signature;
+ *         std::vector<int> flags;
+ *     };
+ *     LOKIMQ_BT_FIELDS(vote, ("h", height), ("k", pubkey), ("s", signature), ("f", flags))
+ *     }
+ *
+ * after which a `vote` can be passed to bt_serialize() (and used as a value of lists, dicts, and
+ * send arguments) and deserialized with bt_deserialize(), without going through a bt_dict.  The
+ * macro must be used in the same namespace as the struct (it declares a function that is found via
+ * argument-dependent lookup), and may list up to 32 fields; keys may be given in any order.
+ *
+ * Serialization writes the fields in key order as determined at compile time (so nothing is sorted
+ * at runtime), and deserialization is a single forward pass over the encoded dict that matches its
+ * (sorted) keys against the sorted field table, deserializing values directly into the members.
+ * Keys in the data that aren't fields are skipped; fields missing from the data are left
+ * untouched.  Deserialization throws bt_deserialize_invalid if the dict keys are not in sorted
+ * order (as required for bt-encoded dicts).
+ */
+#define LOKIMQ_BT_FIELDS(Type, ...) \
+    inline constexpr auto lokimq_bt_fields(const Type*) { \
+        return std::make_tuple(LOKIMQ_BT_FIELDS_MAP(Type, __VA_ARGS__)); \
+    }
+
+// Implementation details of LOKIMQ_BT_FIELDS: applies LOKIMQ_BT_FIELDS_FIELD to each ("key", member)
+#define LOKIMQ_BT_FIELDS_CAT(a, b) LOKIMQ_BT_FIELDS_CAT_(a, b)
+#define LOKIMQ_BT_FIELDS_CAT_(a, b) a##b
+#define LOKIMQ_BT_FIELDS_COUNT(...) LOKIMQ_BT_FIELDS_COUNT_(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+#define LOKIMQ_BT_FIELDS_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, N, ...) N
+#define LOKIMQ_BT_FIELDS_MAP(Type, ...) LOKIMQ_BT_FIELDS_CAT(LOKIMQ_BT_FIELDS_MAP_, LOKIMQ_BT_FIELDS_COUNT(__VA_ARGS__))(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_UNPAREN(...) __VA_ARGS__
+#define LOKIMQ_BT_FIELDS_FIELD(Type, f) LOKIMQ_BT_FIELDS_FIELD_(Type, LOKIMQ_BT_FIELDS_UNPAREN f)
+#define LOKIMQ_BT_FIELDS_FIELD_(Type, ...) LOKIMQ_BT_FIELDS_FIELD__(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_FIELD__(Type, key, member) ::lokimq::detail::make_bt_field(key, &Type::member)
+#define LOKIMQ_BT_FIELDS_MAP_1(Type, f) LOKIMQ_BT_FIELDS_FIELD(Type, f)
+#define LOKIMQ_BT_FIELDS_MAP_2(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_1(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_3(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_2(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_4(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_3(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_5(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_4(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_6(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_5(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_7(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_6(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_8(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_7(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_9(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_8(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_10(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_9(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_11(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_10(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_12(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_11(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_13(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_12(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_14(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_13(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_15(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_14(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_16(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_15(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_17(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_16(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_18(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_17(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_19(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_18(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_20(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_19(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_21(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_20(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_22(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_21(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_23(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_22(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_24(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_23(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_25(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_24(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_26(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_25(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_27(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_26(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_28(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_27(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_29(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_28(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_30(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_29(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_31(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_30(Type, __VA_ARGS__)
+#define LOKIMQ_BT_FIELDS_MAP_32(Type, f, ...) LOKIMQ_BT_FIELDS_FIELD(Type, f), LOKIMQ_BT_FIELDS_MAP_31(Type, __VA_ARGS__)
+
+namespace lokimq {
+namespace detail {
+
+/// A field of a LOKIMQ_BT_FIELDS struct: the dict key and the member it maps to.
+template <typename Class, typename Member>
+struct bt_field_def {
+    using member_type = Member;
+    const char* key;
+    size_t key_size;
+    Member Class::* member;
+};
+
+template <typename Class, typename Member, size_t N>
+constexpr bt_field_def<Class, Member> make_bt_field(const char (&key)[N], Member Class::* member) {
+    return {key, N - 1, member};
+}
+
+/// True if T has fields declared with LOKIMQ_BT_FIELDS
+template <typename T, typename = void> struct has_bt_fields : std::false_type {};
+template <typename T>
+struct has_bt_fields<T, void_t<decltype(lokimq_bt_fields(static_cast<const T*>(nullptr)))>> : std::true_type {};
+
+template <typename T>
+constexpr auto bt_fields_of() { return lokimq_bt_fields(static_cast<const T*>(nullptr)); }
+
+template <typename T>
+using bt_fields_tuple = decltype(bt_fields_of<T>());
+
+/// Compares keys the way sorted bt dict keys are ordered (bytewise, as unsigned values)
+constexpr bool bt_key_less(const char* a, size_t a_size, const char* b, size_t b_size) {
+    for (size_t i = 0; i < a_size && i < b_size; i++)
+        if (a[i] != b[i])
+            return static_cast<unsigned char>(a[i]) < static_cast<unsigned char>(b[i]);
+    return a_size < b_size;
+}
+
+/// The order of the fields of a LOKIMQ_BT_FIELDS struct sorted by key: `index[i]` is the position
+/// (in the LOKIMQ_BT_FIELDS declaration) of the field with the i-th smallest key.
+template <size_t N>
+struct bt_field_order { size_t index[N]; };
+
+template <typename Tuple, size_t... I>
+constexpr bt_field_order<sizeof...(I)> bt_sort_fields(const Tuple& fields, std::index_sequence<I...>) {
+    constexpr size_t n = sizeof...(I);
+    const char* keys[n] = {std::get<I>(fields).key...};
+    size_t sizes[n] = {std::get<I>(fields).key_size...};
+    bt_field_order<n> order{{I...}};
+    // Insertion sort: this runs at compile time on a handful of fields
+    for (size_t i = 1; i < n; i++) {
+        for (size_t j = i; j > 0 && bt_key_less(keys[order.index[j]], sizes[order.index[j]], keys[order.index[j-1]], sizes[order.index[j-1]]); j--) {
+            size_t tmp = order.index[j];
+            order.index[j] = order.index[j-1];
+            order.index[j-1] = tmp;
+        }
+    }
+    for (size_t i = 1; i < n; i++)
+        if (!bt_key_less(keys[order.index[i-1]], sizes[order.index[i-1]], keys[order.index[i]], sizes[order.index[i]]))
+            throw std::logic_error{"LOKIMQ_BT_FIELDS keys must be unique"}; // (a compile-time error)
+    return order;
+}
+
+template <typename T>
+constexpr auto bt_fields_order() {
+    return bt_sort_fields(bt_fields_of<T>(), std::make_index_sequence<std::tuple_size<bt_fields_tuple<T>>::value>{});
+}
+
+template <typename T, typename Seq>
+struct bt_fields_impl;
+
+/// Serialization and deserialization of a LOKIMQ_BT_FIELDS struct; `I...` are 0, ..., N-1.
+template <typename T, size_t... I>
+struct bt_fields_impl<T, std::index_sequence<I...>> {
+    /// The position (in the declaration) of the field with the `S`th smallest key
+    template <size_t S>
+    static constexpr size_t sorted() { return bt_fields_order<T>().index[S]; }
+
+    template <size_t F>
+    using member_type = typename std::tuple_element<F, bt_fields_tuple<T>>::type::member_type;
+
+    template <size_t F>
+    static constexpr string_view key() {
+        return {std::get<F>(bt_fields_of<T>()).key, std::get<F>(bt_fields_of<T>()).key_size};
+    }
+
+    template <size_t F>
+    static const member_type<F>& get(const T& val) { return val.*(std::get<F>(bt_fields_of<T>()).member); }
+    template <size_t F>
+    static member_type<F>& get(T& val) { return val.*(std::get<F>(bt_fields_of<T>()).member); }
+
+    template <size_t F>
+    static void serialize_field(std::ostream& os, const T& val) {
+        bt_serialize<string_view>{}(os, key<F>());
+        bt_serialize<member_type<F>>{}(os, get<F>(val));
+    }
+
+    template <size_t F>
+    static size_t field_size(const T& val) {
+        return bt_serialize<string_view>{}.size(key<F>()) + bt_serialize<member_type<F>>{}.size(get<F>(val));
+    }
+
+    template <size_t F>
+    static char* write_field(char* out, const T& val) {
+        out = bt_serialize<string_view>{}.write(out, key<F>());
+        return bt_serialize<member_type<F>>{}.write(out, get<F>(val));
+    }
+
+    template <size_t F>
+    static void deserialize_field(string_view& s, T& val) {
+        bt_deserialize<member_type<F>>{}(s, get<F>(val));
+    }
+
+    static void serialize(std::ostream& os, const T& val) {
+        os << 'd';
+        (void) std::initializer_list<int>{(serialize_field<sorted<I>()>(os, val), 0)...};
+        os << 'e';
+    }
+
+    static size_t size(const T& val) {
+        size_t size = 2;
+        (void) std::initializer_list<int>{(size += field_size<I>(val), 0)...};
+        return size;
+    }
+
+    static char* write(char* out, const T& val) {
+        *out++ = 'd';
+        (void) std::initializer_list<int>{(out = write_field<sorted<I>()>(out, val), 0)...};
+        *out++ = 'e';
+        return out;
+    }
+
+    static void deserialize(string_view& s, T& val) {
+        // The keys and deserializers of the fields, in key order
+        static constexpr string_view keys[] = {key<sorted<I>()>()...};
+        static constexpr void (*deserializers[])(string_view&, T&) = {&deserialize_field<sorted<I>()>...};
+        constexpr size_t n = sizeof...(I);
+
+        if (s.size() < 2) throw bt_deserialize_invalid("Deserialization failed: end of string found where dict expected");
+        if (s[0] != 'd') throw bt_deserialize_invalid_type("Deserialization failed: expected 'd', found '"s + s[0] + "'"s);
+        s.remove_prefix(1);
+
+        size_t next = 0; // The next field (in key order) that we might find
+        string_view prev;
+        bool first = true;
+        while (!s.empty() && s[0] != 'e') {
+            string_view k;
+            bt_deserialize<string_view>{}(s, k);
+            if (!first && !(prev < k))
+                throw bt_deserialize_invalid("Deserialization failed: dict keys are not in sorted order");
+            prev = k;
+            first = false;
+
+            while (next < n && keys[next] < k)
+                next++;
+            if (next < n && keys[next] == k)
+                deserializers[next++](s, val);
+            else
+                bt_skip_value(s);
+        }
+        if (s.empty())
+            throw bt_deserialize_invalid("Deserialization failed: encountered end of string before dict was finished");
+        s.remove_prefix(1); // Consume the 'e'
+    }
+};
+
+template <typename T>
+using bt_fields_impl_t = bt_fields_impl<T, std::make_index_sequence<std::tuple_size<bt_fields_tuple<T>>::value>>;
+
+template <typename T>
+struct bt_serialize<T, std::enable_if_t<has_bt_fields<T>::value>> {
+    void operator()(std::ostream& os, const T& val) { bt_fields_impl_t<T>::serialize(os, val); }
+    size_t size(const T& val) { return bt_fields_impl_t<T>::size(val); }
+    char* write(char* out, const T& val) { return bt_fields_impl_t<T>::write(out, val); }
+};
+
+template <typename T>
+struct bt_deserialize<T, std::enable_if_t<has_bt_fields<T>::value>> {
+    void operator()(string_view& s, T& val) { bt_fields_impl_t<T>::deserialize(s, val); }
+};
+
+} // namespace detail
+} // namespace lokimq
@@ -0,0 +1,229 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#include "bt_push_parser.h"
+#include <algorithm>
+#include <limits>
+
+namespace lokimq {
+
+namespace {
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+}
+
+bt_push_parser::bt_push_parser(bt_push_handler& handler, size_t max_depth, size_t max_key_size)
+    : handler_{handler}, max_depth_{max_depth}, max_key_size_{max_key_size} {}
+
+void bt_push_parser::reset() {
+    state_ = state::value;
+    stack_.clear();
+    number_ = 0;
+    negative_ = false;
+    reading_key_ = false;
+    key_.clear();
+    offset_ = 0;
+}
+
+void bt_push_parser::fail(const std::string& msg) const {
+    throw bt_deserialize_invalid{"Invalid bt data at offset " + std::to_string(offset_) + ": " + msg};
+}
+
+void bt_push_parser::feed(string_view chunk) {
+    while (!chunk.empty()) {
+        char c = chunk[0];
+        switch (state_) {
+            case state::done:
+                fail("found data after the end of the value");
+
+            case state::value:
+                begin_value(c);
+                break;
+
+            case state::list_value:
+                if (c == 'e') {
+                    stack_.pop_back();
+                    handler_.list_end();
+                    value_done();
+                } else {
+                    begin_value(c);
+                }
+                break;
+
+            case state::dict_key:
+                if (c == 'e') {
+                    stack_.pop_back();
+                    handler_.dict_end();
+                    value_done();
+                } else if (is_digit(c)) {
+                    reading_key_ = true;
+                    number_ = c - '0';
+                    state_ = state::string_length;
+                } else {
+                    fail("expected a dict key or 'e', found '"s + c + "'");
+                }
+                break;
+
+            case state::integer_sign:
+                if (c == '-') {
+                    negative_ = true;
+                    state_ = state::integer_first;
+                    break;
+                }
+                // Otherwise this is the first digit
+                // fall through
+            case state::integer_first:
+                if (!is_digit(c))
+                    fail("expected 0-9 in integer, found '"s + c + "'");
+                add_digit(c);
+                state_ = state::integer_digits;
+                break;
+
+            case state::integer_digits:
+                if (is_digit(c)) {
+                    add_digit(c);
+                } else if (c == 'e') {
+                    if (negative_) {
+                        if (number_ > uint64_t{1} << 63)
+                            fail("integer value is too small for a 64-bit int");
+                        handler_.integer(number_ == uint64_t{1} << 63
+                                ? std::numeric_limits<int64_t>::min() : -static_cast<int64_t>(number_));
+                    } else if (number_ > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+                        handler_.uinteger(number_);
+                    } else {
+                        handler_.integer(static_cast<int64_t>(number_));
+                    }
+                    value_done();
+                } else {
+                    fail("expected 0-9 or 'e' in integer, found '"s + c + "'");
+                }
+                break;
+
+            case state::string_length:
+                if (is_digit(c))
+                    add_digit(c);
+                else if (c == ':')
+                    string_started();
+                else
+                    fail("expected 0-9 or ':' in string length, found '"s + c + "'");
+                break;
+
+            case state::string_data: {
+                // Take as much of the string as this chunk has in one go
+                size_t n = static_cast<size_t>(std::min<uint64_t>(number_, chunk.size()));
+                string_view fragment{chunk.data(), n};
+                if (reading_key_)
+                    key_.append(fragment.data(), fragment.size());
+                else
+                    handler_.string_data(fragment);
+                number_ -= n;
+                chunk.remove_prefix(n);
+                offset_ += n;
+                if (number_ == 0)
+                    string_finished();
+                continue;
+            }
+        }
+        chunk.remove_prefix(1);
+        offset_++;
+    }
+}
+
+void bt_push_parser::begin_value(char c) {
+    switch (c) {
+        case 'i':
+            number_ = 0;
+            negative_ = false;
+            state_ = state::integer_sign;
+            break;
+        case 'l':
+        case 'd':
+            if (stack_.size() >= max_depth_)
+                fail("lists/dicts are nested too deeply");
+            stack_.push_back(c);
+            if (c == 'l') {
+                handler_.list_begin();
+                state_ = state::list_value;
+            } else {
+                handler_.dict_begin();
+                state_ = state::dict_key;
+            }
+            break;
+        default:
+            if (!is_digit(c))
+                fail("expected one of [0-9idl], found '"s + c + "'");
+            reading_key_ = false;
+            number_ = c - '0';
+            state_ = state::string_length;
+    }
+}
+
+void bt_push_parser::value_done() {
+    if (stack_.empty())
+        state_ = state::done;
+    else
+        state_ = stack_.back() == 'l' ? state::list_value : state::dict_key;
+}
+
+void bt_push_parser::string_started() {
+    if (reading_key_) {
+        if (number_ > max_key_size_)
+            fail("dict key is too long");
+        key_.clear();
+    } else {
+        if (number_ > std::numeric_limits<size_t>::max())
+            fail("string is too long");
+        handler_.string_begin(static_cast<size_t>(number_));
+    }
+    state_ = state::string_data;
+    if (number_ == 0)
+        string_finished();
+}
+
+void bt_push_parser::string_finished() {
+    if (reading_key_) {
+        reading_key_ = false;
+        handler_.key(key_);
+        state_ = state::value;
+    } else {
+        handler_.string_end();
+        value_done();
+    }
+}
+
+void bt_push_parser::add_digit(char c) {
+    uint64_t d = c - '0';
+    if (number_ > (std::numeric_limits<uint64_t>::max() - d) / 10)
+        fail("integer value is too large for a 64-bit int");
+    number_ = number_ * 10 + d;
+}
+
+} // namespace lokimq
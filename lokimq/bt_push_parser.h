@@ -0,0 +1,161 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "bt_serialize.h"
+
+namespace lokimq {
+
+/** \file
+ * An incremental ("push") parser for bt-encoded data that arrives in pieces, such as a large
+ * value received over several messages or read from disk in blocks.  bt_deserialize(), the
+ * consumers, and bt_tape all need the whole encoded value in memory at once; this parser instead
+ * accepts the data in arbitrary chunks (split at any byte) and reports what it finds to a handler
+ * as it goes, using a fixed amount of memory (apart from the container stack, which is bounded by
+ * the maximum depth, and dict keys, which are bounded by the maximum key size).
+ *
+ *     struct my_handler : lokimq::bt_push_handler {
+ *         void key(string_view k) override { ... }
+ *         void string_data(string_view fragment) override { ... }
+ *         ...
+ *     } handler;
+ *     lokimq::bt_push_parser parser{handler};
+ *     while (auto chunk = read_more())
+ *         parser.feed(chunk);
+ *     if (!parser.finished()) throw std::runtime_error{"truncated data"};
+ *
+ * Events are reported in encoding order.  String values are reported as string_begin (with the
+ * full length), then zero or more string_data calls with consecutive fragments (as they arrive),
+ * then string_end.  Dict keys are (always small) strings that are collected and reported whole via
+ * key(); each key is followed by the events of its value.
+ *
+ * Malformed data makes feed() throw bt_deserialize_invalid; after that the parser must be reset()
+ * before it can be used again.  Dict key order is not checked (a handler that cares can compare
+ * each key with the previous one).
+ */
+
+/// Receives the events of a bt_push_parser.  Every method does nothing by default.
+class bt_push_handler {
+public:
+    virtual ~bt_push_handler() = default;
+
+    /// Called at the start of a string value of `length` bytes
+    virtual void string_begin(size_t /*length*/) {}
+    /// Called with the next fragment of the current string value.  The fragment points into the
+    /// data given to feed() and is only valid during the call.
+    virtual void string_data(string_view /*fragment*/) {}
+    /// Called after the last byte of the current string value
+    virtual void string_end() {}
+    /// Called with an integer value
+    virtual void integer(int64_t /*value*/) {}
+    /// Called instead of integer() for an integer value too large for an int64_t
+    virtual void uinteger(uint64_t /*value*/) {}
+    /// Called at the start of a list
+    virtual void list_begin() {}
+    /// Called at the end of a list
+    virtual void list_end() {}
+    /// Called at the start of a dict
+    virtual void dict_begin() {}
+    /// Called with each dict key (before the events of the key's value).  Only valid during the
+    /// call.
+    virtual void key(string_view /*key*/) {}
+    /// Called at the end of a dict
+    virtual void dict_end() {}
+};
+
+/// Incremental parser of a single bt-encoded value; see above.
+class bt_push_parser {
+public:
+    /// Creates a parser reporting to `handler`, which must outlive the parser.  `max_depth` limits
+    /// the nesting of lists and dicts, and `max_key_size` the length of dict keys; data exceeding
+    /// either is rejected as invalid.
+    explicit bt_push_parser(bt_push_handler& handler, size_t max_depth = 64, size_t max_key_size = 4096);
+
+    /// Parses the next chunk of data.  The chunk may end anywhere, including in the middle of an
+    /// integer or string length: parsing continues where it left off on the next call.  Throws
+    /// bt_deserialize_invalid if the data is not valid, or if there is data after the end of the
+    /// value.
+    void feed(string_view chunk);
+
+    /// Returns true once a complete value has been parsed
+    bool finished() const { return state_ == state::done; }
+
+    /// Resets the parser to parse a new value
+    void reset();
+
+private:
+    enum class state : uint8_t {
+        value,           // expecting a value (top-level, or a dict value)
+        list_value,      // expecting a list element or the end of the list
+        dict_key,        // expecting a dict key or the end of the dict
+        integer_sign,    // after the 'i': expecting '-' or a digit
+        integer_first,   // after the '-': expecting a digit
+        integer_digits,  // expecting more digits or the closing 'e'
+        string_length,   // expecting more length digits or the ':'
+        string_data,     // inside a string value or key
+        done,            // finished parsing
+    };
+
+    bt_push_handler& handler_;
+    size_t max_depth_, max_key_size_;
+    state state_ = state::value;
+    /// The lists ('l') and dicts ('d') we are inside of, innermost last
+    std::vector<char> stack_;
+    /// Integer value or string length accumulated so far
+    uint64_t number_ = 0;
+    bool negative_ = false;
+    /// True if the string currently being read is a dict key
+    bool reading_key_ = false;
+    /// The dict key being collected
+    std::string key_;
+    /// The number of bytes parsed so far (for error messages)
+    uint64_t offset_ = 0;
+
+    // Throws bt_deserialize_invalid with the current offset and the given message
+    [[noreturn]] void fail(const std::string& msg) const;
+
+    // Starts a new value with leading byte `c`
+    void begin_value(char c);
+    // Updates the state after a value has been completed
+    void value_done();
+    // Called when a string length (for a string or key) has been read
+    void string_started();
+    // Called once all the bytes of a string or key have been read
+    void string_finished();
+    // Accumulates a digit into number_; throws on overflow
+    void add_digit(char c);
+};
+
+}
+
+// vim:sw=4:et
@@ -27,6 +27,7 @@
 // THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "bt_serialize.h"
+#include "small_vector.h"
 
 namespace lokimq {
 namespace detail {
@@ -103,38 +104,216 @@ template struct bt_deserialize<int64_t>;
 template struct bt_deserialize<uint64_t>;
 
 void bt_deserialize<bt_value, void>::operator()(string_view& s, bt_value& val) {
-    if (s.size() < 2) throw bt_deserialize_invalid("Deserialization failed: end of string found where bt-encoded value expected");
-
-    switch (s[0]) {
-        case 'd': {
-            bt_dict dict;
-            bt_deserialize<bt_dict>{}(s, dict);
-            val = std::move(dict);
-            break;
+    // Lists and dicts currently being filled, innermost last.  We use this explicit stack rather
+    // than recursing into nested lists/dicts so that deeply nested data can't exhaust the stack; it
+    // only allocates for data nested more than 16 deep.
+    struct container { bt_list* list; bt_dict* dict; };
+    small_vector<container, 16> stack;
+    size_t elements = 0;
+
+    bt_value* target = &val; // Where the next value goes
+    while (target) {
+        if (++elements > limits.max_elements)
+            throw bt_deserialize_invalid("Deserialization failed: too many values");
+        if (s.size() < 2) throw bt_deserialize_invalid("Deserialization failed: end of string found where bt-encoded value expected");
+
+        switch (s[0]) {
+            case 'd':
+            case 'l': {
+                if (stack.size() >= limits.max_depth)
+                    throw bt_deserialize_invalid("Deserialization failed: lists/dicts are nested too deeply");
+                if (s[0] == 'd') {
+                    *target = bt_dict{};
+                    stack.push_back({nullptr, &mapbox::util::get<bt_dict>(*target)});
+                } else {
+                    *target = bt_list{};
+                    stack.push_back({&mapbox::util::get<bt_list>(*target), nullptr});
+                }
+                s.remove_prefix(1);
+                break;
+            }
+            case 'i': {
+                auto read = bt_deserialize_integer(s);
+                *target = read.first.i64; // We only store an i64, but can get a u64 out of it via get<uint64_t>(val)
+                break;
+            }
+            case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9': {
+                std::string str;
+                bt_deserialize<std::string>{}(s, str);
+                *target = std::move(str);
+                break;
+            }
+            default:
+                throw bt_deserialize_invalid("Deserialize failed: encountered invalid value '"s + s[0] + "'; expected one of [0-9idl]");
         }
-        case 'l': {
-            bt_list list;
-            bt_deserialize<bt_list>{}(s, list);
-            val = std::move(list);
-            break;
+
+        // Close any finished lists/dicts, then add a slot for the next value (if any)
+        target = nullptr;
+        while (!stack.empty()) {
+            if (s.empty())
+                throw bt_deserialize_invalid("Deserialization failed: encountered end of string before list/dict was finished");
+            auto& top = stack.back();
+            if (s[0] == 'e') {
+                s.remove_prefix(1);
+                stack.pop_back();
+            } else if (top.list) {
+                top.list->emplace_back();
+                target = &top.list->back();
+                break;
+            } else {
+                std::string key;
+                bt_deserialize<std::string>{}(s, key);
+                target = &(*top.dict)[std::move(key)];
+                break;
+            }
         }
-        case 'i': {
-            auto read = bt_deserialize_integer(s);
-            val = read.first.i64; // We only store an i64, but can get a u64 out of it via get<uint64_t>(val)
-            break;
+    }
+}
+
+void bt_deserialize<bt_list, void>::operator()(string_view& s, bt_list& val) {
+    if (s.empty() || s[0] != 'l') throw bt_deserialize_invalid_type("Deserialization failed: expected a list");
+    bt_value v;
+    bt_deserialize<bt_value>{limits}(s, v);
+    val = std::move(mapbox::util::get<bt_list>(v));
+}
+
+void bt_deserialize<bt_dict, void>::operator()(string_view& s, bt_dict& val) {
+    if (s.empty() || s[0] != 'd') throw bt_deserialize_invalid_type("Deserialization failed: expected a dict");
+    bt_value v;
+    bt_deserialize<bt_value>{limits}(s, v);
+    val = std::move(mapbox::util::get<bt_dict>(v));
+}
+
+void bt_skip_value(string_view& s) {
+    size_t depth = 0; // Number of lists/dicts we are inside of
+    do {
+        if (s.empty())
+            throw bt_deserialize_invalid("Deserialization failed: end of string found where bt-encoded value expected");
+        switch (s[0]) {
+            case 'd': case 'l':
+                depth++;
+                s.remove_prefix(1);
+                break;
+            case 'e':
+                if (depth == 0)
+                    throw bt_deserialize_invalid("Deserialization failed: found 'e' where bt-encoded value expected");
+                depth--;
+                s.remove_prefix(1);
+                break;
+            case 'i':
+                bt_deserialize_integer(s);
+                break;
+            default: {
+                string_view str;
+                bt_deserialize<string_view>{}(s, str);
+            }
         }
-        case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9': {
-            std::string str;
-            bt_deserialize<std::string>{}(s, str);
-            val = std::move(str);
-            break;
+    } while (depth > 0);
+}
+
+} // namespace detail
+
+namespace {
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+// Validates a canonical string (no leading zeros in the length) at `p`, advancing `p` past it and
+// setting `str` to the string value.
+bool validate_string(const char*& p, const char* end, string_view& str) {
+    if (p == end || !is_digit(*p) || (*p == '0' && end - p > 1 && is_digit(p[1])))
+        return false;
+    uint64_t len = 0;
+    for (; p != end && is_digit(*p); ++p) {
+        if (len > (std::numeric_limits<uint64_t>::max() - 9) / 10)
+            return false;
+        len = len * 10 + (*p - '0');
+    }
+    if (p == end || *p++ != ':' || static_cast<uint64_t>(end - p) < len)
+        return false;
+    str = {p, static_cast<size_t>(len)};
+    p += len;
+    return true;
+}
+
+// Validates a canonical integer (no leading zeros, no -0, in the range of an int64_t or uint64_t)
+// starting at the `i` at `p`, advancing `p` past the closing `e`.
+bool validate_integer(const char*& p, const char* end) {
+    ++p; // the 'i'
+    bool negative = p != end && *p == '-';
+    if (negative) ++p;
+    if (p == end || !is_digit(*p))
+        return false;
+    if (*p == '0') {
+        ++p;
+        if (negative) // -0 (or a leading zero)
+            return false;
+    } else {
+        uint64_t val = 0;
+        for (; p != end && is_digit(*p); ++p) {
+            uint64_t digit = *p - '0';
+            if (val > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+                return false;
+            val = val * 10 + digit;
         }
-        default:
-            throw bt_deserialize_invalid("Deserialize failed: encountered invalid value '"s + s[0] + "'; expected one of [0-9idl]");
+        if (negative && val > uint64_t{1} << 63)
+            return false;
     }
+    return p != end && *p++ == 'e';
 }
 
-} // namespace detail
+}
+
+bool bt_validate(string_view data, const bt_limits& limits) {
+    // A list or dict we are inside of.  We use a local array for the (common) case of a limited
+    // depth so that validating doesn't allocate.
+    struct container { bool dict; bool has_key; string_view last_key; };
+    container local[64];
+    std::vector<container> heap;
+    container* stack = local;
+    if (limits.max_depth > 64) {
+        heap.resize(limits.max_depth);
+        stack = heap.data();
+    }
+
+    const char* p = data.data();
+    const char* const end = p + data.size();
+    size_t depth = 0, elements = 0;
+    while (true) {
+        if (depth > 0) {
+            if (p == end)
+                return false;
+            auto& top = stack[depth - 1];
+            if (*p == 'e') {
+                ++p;
+                if (--depth == 0)
+                    return p == end;
+                continue;
+            }
+            if (top.dict) {
+                string_view key;
+                if (!validate_string(p, end, key) || (top.has_key && !(top.last_key < key)))
+                    return false;
+                top.last_key = key;
+                top.has_key = true;
+            }
+        }
+
+        if (p == end || ++elements > limits.max_elements)
+            return false;
+        if (*p == 'l' || *p == 'd') {
+            if (depth >= limits.max_depth)
+                return false;
+            stack[depth++] = {*p == 'd', false, {}};
+            ++p;
+            continue;
+        }
+        string_view str;
+        if (!(*p == 'i' ? validate_integer(p, end) : validate_string(p, end, str)))
+            return false;
+        if (depth == 0)
+            return p == end;
+    }
+}
 
 
 bt_list_consumer::bt_list_consumer(string_view data_) : data{std::move(data_)} {
@@ -205,6 +384,14 @@ bt_dict_consumer::bt_dict_consumer(string_view data_) {
     data.remove_prefix(1);
 }
 
+std::pair<string_view, string_view> bt_dict_consumer::consume_string() {
+    if (!is_string()) throw bt_deserialize_invalid_type{"next bt dict value is not a string"};
+    std::pair<string_view, string_view> ret;
+    ret.second = bt_list_consumer::consume_string();
+    ret.first = flush_key();
+    return ret;
+}
+
 bool bt_dict_consumer::consume_key() {
     if (key_.data())
         return true;
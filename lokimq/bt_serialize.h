@@ -36,6 +36,7 @@
 #include <algorithm>
 #include <functional>
 #include <cstring>
+#include <limits>
 #include <ostream>
 #include <sstream>
 #include "string_view.h"
@@ -102,6 +103,18 @@ class bt_dict : public std::unordered_map<std::string, bt_value> {
     using std::unordered_map<std::string, bt_value>::unordered_map;
 };
 
+/// Limits on the structure of bt-encoded data accepted by bt_get() (and deserialization into
+/// bt_value, bt_list, and bt_dict) and bt_validate(), so that hostile data can't make us do an
+/// unbounded amount of work or build enormous values out of tiny (e.g. `lllll...` or `lelelele...`)
+/// input.
+struct bt_limits {
+    /// The maximum nesting depth of lists and dicts
+    size_t max_depth = 64;
+    /// The maximum total number of values (including the top-level value and the values inside
+    /// every list and dict, but not dict keys)
+    size_t max_elements = std::numeric_limits<size_t>::max();
+};
+
 #ifdef __cpp_lib_void_t
 using std::void_t;
 #else
@@ -131,21 +144,93 @@ inline void bt_need_more(const string_view &s) {
 
 union maybe_signed_int64_t { int64_t i64; uint64_t u64; };
 
+/// Returns the number of decimal digits needed to write `val`.
+inline size_t bt_digits(uint64_t val) {
+    // Four digits per step (rather than one comparison per digit): this runs for every integer and
+    // string length in both the size and the write pass.
+    size_t digits = 1;
+    while (true) {
+        if (val < 10) return digits;
+        if (val < 100) return digits + 1;
+        if (val < 1000) return digits + 2;
+        if (val < 10000) return digits + 3;
+        val /= 10000;
+        digits += 4;
+    }
+}
+
+/// Writes the `digits` decimal digits of `val` (as returned by bt_digits) to `out`, returning a
+/// pointer just past the last digit written.
+inline char* bt_write_digits(char* out, uint64_t val, size_t digits) {
+    static constexpr char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char* end = out + digits;
+    char* p = end;
+    while (val >= 100) {
+        auto i = (val % 100) * 2;
+        val /= 100;
+        *--p = pairs[i + 1];
+        *--p = pairs[i];
+    }
+    if (val >= 10) {
+        *--p = pairs[val * 2 + 1];
+        *--p = pairs[val * 2];
+    } else {
+        *--p = static_cast<char>('0' + val);
+    }
+    return end;
+}
+
+/// Returns the number of characters needed to write an integer value (including a '-', if negative)
+inline size_t bt_int_chars(uint64_t val) { return bt_digits(val); }
+inline size_t bt_int_chars(int64_t val) {
+    return val < 0 ? 1 + bt_digits(uint64_t{0} - static_cast<uint64_t>(val)) : bt_digits(static_cast<uint64_t>(val));
+}
+
+/// Writes an integer value (without the surrounding i...e) to `out`, returning a pointer just past
+/// it.
+inline char* bt_write_int(char* out, uint64_t val) { return bt_write_digits(out, val, bt_digits(val)); }
+inline char* bt_write_int(char* out, int64_t val) {
+    if (val >= 0)
+        return bt_write_int(out, static_cast<uint64_t>(val));
+    *out++ = '-';
+    return bt_write_int(out, uint64_t{0} - static_cast<uint64_t>(val));
+}
+
 /// Deserializes a signed or unsigned 64-bit integer from an input stream.  Sets the second bool to
 /// true iff the value is int64_t because a negative value was read.  Throws an exception if the
 /// read value doesn't fit in a int64_t (if negative) or a uint64_t (if positive).  Removes consumed
 /// characters from the string_view.
 std::pair<maybe_signed_int64_t, bool> bt_deserialize_integer(string_view& s);
 
+/// Skips over the next bt-encoded value in `s` (without fully validating it), removing it from the
+/// string_view.  Throws bt_deserialize_invalid if there isn't a complete value.
+void bt_skip_value(string_view& s);
+
 /// Integer specializations
+///
+/// Besides writing to an output stream, each bt_serialize specialization can return the exact size
+/// of the serialized value (`size()`) and write it to a buffer of that size (`write()`, which
+/// returns a pointer just past the written value); this is what `bt_serialize()` uses to serialize
+/// into a string with a single allocation.
 template <typename T>
 struct bt_serialize<T, std::enable_if_t<std::is_integral<T>::value>> {
     static_assert(sizeof(T) <= sizeof(uint64_t), "Serialization of integers larger than uint64_t is not supported");
+    using int_type = std::conditional_t<std::is_signed<T>::value, int64_t, uint64_t>;
     void operator()(std::ostream &os, const T &val) {
         // Cast 1-byte types to a larger type to avoid iostream interpreting them as single characters
         using output_type = std::conditional_t<(sizeof(T) > 1), T, std::conditional_t<std::is_signed<T>::value, int, unsigned>>;
         os << 'i' << static_cast<output_type>(val) << 'e';
     }
+    size_t size(const T &val) { return 2 + bt_int_chars(static_cast<int_type>(val)); }
+    char* write(char* out, const T &val) {
+        *out++ = 'i';
+        out = bt_write_int(out, static_cast<int_type>(val));
+        *out++ = 'e';
+        return out;
+    }
 };
 
 template <typename T>
@@ -183,6 +268,13 @@ extern template struct bt_deserialize<uint64_t>;
 template <>
 struct bt_serialize<string_view> {
     void operator()(std::ostream &os, const string_view &val) { os << val.size(); os.put(':'); os.write(val.data(), val.size()); }
+    size_t size(const string_view &val) { return bt_digits(val.size()) + 1 + val.size(); }
+    char* write(char* out, const string_view &val) {
+        out = bt_write_int(out, uint64_t{val.size()});
+        *out++ = ':';
+        std::memcpy(out, val.data(), val.size());
+        return out + val.size();
+    }
 };
 template <>
 struct bt_deserialize<string_view> {
@@ -193,6 +285,8 @@ struct bt_deserialize<string_view> {
 template <>
 struct bt_serialize<std::string> {
     void operator()(std::ostream &os, const std::string &val) { bt_serialize<string_view>{}(os, val); }
+    size_t size(const std::string &val) { return bt_serialize<string_view>{}.size(val); }
+    char* write(char* out, const std::string &val) { return bt_serialize<string_view>{}.write(out, val); }
 };
 template <>
 struct bt_deserialize<std::string> {
@@ -203,10 +297,14 @@ struct bt_deserialize<std::string> {
 template <>
 struct bt_serialize<char *> {
     void operator()(std::ostream &os, const char *str) { bt_serialize<string_view>{}(os, {str, std::strlen(str)}); }
+    size_t size(const char *str) { return bt_serialize<string_view>{}.size({str, std::strlen(str)}); }
+    char* write(char* out, const char *str) { return bt_serialize<string_view>{}.write(out, {str, std::strlen(str)}); }
 };
 template <size_t N>
 struct bt_serialize<char[N]> {
     void operator()(std::ostream &os, const char *str) { bt_serialize<string_view>{}(os, {str, N-1}); }
+    size_t size(const char *) { return bt_digits(N-1) + 1 + (N-1); }
+    char* write(char* out, const char *str) { return bt_serialize<string_view>{}.write(out, {str, N-1}); }
 };
 
 /// Partial dict validity; we don't check the second type for serializability, that will be handled
@@ -237,26 +335,63 @@ struct is_bt_output_dict_container<T, std::enable_if_t<
 : std::true_type {};
 
 
+/// True if iterating through a dict-like container already gives its keys in sorted order (e.g.
+/// a std::map<std::string, T>), so that we don't have to sort them ourselves when serializing.
+template <typename T, typename = void> struct is_bt_sorted_dict : std::false_type {};
+template <typename T>
+struct is_bt_sorted_dict<T, std::enable_if_t<
+    std::is_same<typename T::key_compare, std::less<std::string>>::value ||
+    std::is_same<typename T::key_compare, std::less<>>::value>>
+: std::true_type {};
+
+/// Calls `f(pair)` for each key-value pair of a dict-like container in sorted key order.
+template <typename T, typename F, std::enable_if_t<is_bt_sorted_dict<T>::value, int> = 0>
+void bt_for_each_sorted(const T &dict, F&& f) {
+    for (const auto &pair : dict)
+        f(pair);
+}
+template <typename T, typename F, std::enable_if_t<!is_bt_sorted_dict<T>::value, int> = 0>
+void bt_for_each_sorted(const T &dict, F&& f) {
+    using pair_ptr = const typename T::value_type*;
+    std::vector<pair_ptr> pairs;
+    pairs.reserve(dict.size());
+    for (const auto &pair : dict)
+        pairs.push_back(&pair);
+    std::sort(pairs.begin(), pairs.end(), [](pair_ptr a, pair_ptr b) { return a->first < b->first; });
+    for (auto* pair : pairs)
+        f(*pair);
+}
+
 /// Specialization for a dict-like container (such as an unordered_map).  We accept anything for a
 /// dict that is const iterable over something that looks like a pair with std::string for first
 /// value type.  The value (i.e. second element of the pair) also must be serializable.
 template <typename T>
 struct bt_serialize<T, std::enable_if_t<is_bt_input_dict_container<T>::value>> {
     using second_type = typename T::value_type::second_type;
-    using ref_pair = std::reference_wrapper<const typename T::value_type>;
     void operator()(std::ostream &os, const T &dict) {
         os << 'd';
-        std::vector<ref_pair> pairs;
-        pairs.reserve(dict.size());
-        for (const auto &pair : dict)
-            pairs.emplace(pairs.end(), pair);
-        std::sort(pairs.begin(), pairs.end(), [](ref_pair a, ref_pair b) { return a.get().first < b.get().first; });
-        for (auto &ref : pairs) {
-            bt_serialize<std::string>{}(os, ref.get().first);
-            bt_serialize<second_type>{}(os, ref.get().second);
-        }
+        bt_for_each_sorted(dict, [&os](const typename T::value_type &pair) {
+            bt_serialize<std::string>{}(os, pair.first);
+            bt_serialize<second_type>{}(os, pair.second);
+        });
         os << 'e';
     }
+    size_t size(const T &dict) {
+        // The size doesn't depend on the order, so no need to sort here
+        size_t size = 2;
+        for (const auto &pair : dict)
+            size += bt_serialize<std::string>{}.size(pair.first) + bt_serialize<second_type>{}.size(pair.second);
+        return size;
+    }
+    char* write(char* out, const T &dict) {
+        *out++ = 'd';
+        bt_for_each_sorted(dict, [&out](const typename T::value_type &pair) {
+            out = bt_serialize<std::string>{}.write(out, pair.first);
+            out = bt_serialize<second_type>{}.write(out, pair.second);
+        });
+        *out++ = 'e';
+        return out;
+    }
 };
 
 template <typename T>
@@ -307,12 +442,26 @@ struct is_bt_output_list_container<T, std::enable_if_t<
 /// List specialization
 template <typename T>
 struct bt_serialize<T, std::enable_if_t<is_bt_input_list_container<T>::value>> {
+    using value_type = std::remove_cv_t<typename T::value_type>;
     void operator()(std::ostream& os, const T& list) {
         os << 'l';
         for (const auto &v : list)
-            bt_serialize<std::remove_cv_t<typename T::value_type>>{}(os, v);
+            bt_serialize<value_type>{}(os, v);
         os << 'e';
     }
+    size_t size(const T& list) {
+        size_t size = 2;
+        for (const auto &v : list)
+            size += bt_serialize<value_type>{}.size(v);
+        return size;
+    }
+    char* write(char* out, const T& list) {
+        *out++ = 'l';
+        for (const auto &v : list)
+            out = bt_serialize<value_type>{}.write(out, v);
+        *out++ = 'e';
+        return out;
+    }
 };
 template <typename T>
 struct bt_deserialize<T, std::enable_if_t<is_bt_output_list_container<T>::value>> {
@@ -346,6 +495,25 @@ public:
     }
 };
 
+/// variant visitor; returns the serialized size of whatever is contained
+struct bt_size_visitor {
+    using result_type = size_t;
+    template <typename T> size_t operator()(const T &val) const {
+        return bt_serialize<T>{}.size(val);
+    }
+};
+
+/// variant visitor; writes whatever is contained to a buffer
+class bt_write_visitor {
+    char* out;
+public:
+    using result_type = char*;
+    bt_write_visitor(char* out) : out{out} {}
+    template <typename T> char* operator()(const T &val) const {
+        return bt_serialize<T>{}.write(out, val);
+    }
+};
+
 template <typename T>
 using is_bt_deserializable = std::integral_constant<bool,
     std::is_same<T, std::string>::value || std::is_integral<T>::value ||
@@ -391,16 +559,37 @@ struct bt_deserialize_try_variant_impl<std::enable_if_t<!is_bt_deserializable<T>
     }
 };
 
+/// Deserializes into a generic bt_value.  Nested lists and dicts are handled iteratively (not
+/// recursively), subject to the limits.
 template <>
 struct bt_deserialize<bt_value, void> {
+    bt_limits limits;
     void operator()(string_view& s, bt_value& val);
 };
 
+/// bt_list and bt_dict are deserialized with the (non-recursive, limited) bt_value deserializer
+template <>
+struct bt_deserialize<bt_list, void> {
+    bt_limits limits;
+    void operator()(string_view& s, bt_list& val);
+};
+template <>
+struct bt_deserialize<bt_dict, void> {
+    bt_limits limits;
+    void operator()(string_view& s, bt_dict& val);
+};
+
 template <typename... Ts>
 struct bt_serialize<mapbox::util::variant<Ts...>> {
     void operator()(std::ostream& os, const mapbox::util::variant<Ts...>& val) {
         mapbox::util::apply_visitor(bt_serialize_visitor{os}, val);
     }
+    size_t size(const mapbox::util::variant<Ts...>& val) {
+        return mapbox::util::apply_visitor(bt_size_visitor{}, val);
+    }
+    char* write(char* out, const mapbox::util::variant<Ts...>& val) {
+        return mapbox::util::apply_visitor(bt_write_visitor{out}, val);
+    }
 };
 
 template <typename... Ts>
@@ -416,7 +605,13 @@ struct bt_deserialize<mapbox::util::variant<Ts...>> {
 template <typename... Ts>
 struct bt_serialize<std::variant<Ts...>> {
     void operator()(std::ostream &os, const std::variant<Ts...>& val) {
-        mapbox::util::apply_visitor(bt_serialize_visitor{os}, val);
+        std::visit(bt_serialize_visitor{os}, val);
+    }
+    size_t size(const std::variant<Ts...>& val) {
+        return std::visit(bt_size_visitor{}, val);
+    }
+    char* write(char* out, const std::variant<Ts...>& val) {
+        return std::visit(bt_write_visitor{out}, val);
     }
 };
 
@@ -433,9 +628,10 @@ struct bt_stream_serializer {
     const T &val;
     explicit bt_stream_serializer(const T &val) : val{val} {}
     operator std::string() const {
-        std::ostringstream oss;
-        oss << *this;
-        return oss.str();
+        bt_serialize<T> serializer;
+        std::string result(serializer.size(val), '\0');
+        serializer.write(&result[0], val);
+        return result;
     }
 };
 template <typename T>
@@ -463,8 +659,8 @@ std::ostream &operator<<(std::ostream &os, const bt_stream_serializer<T> &s) {
 /// responsibility to ensure the serializer is not used past the end of the lifetime of the value
 /// being serialized.
 ///
-/// Also note that serializing directly to an output stream is more efficient as no intermediate
-/// string containing the entire serialization has to be constructed.
+/// Also note that serializing directly to an output stream avoids constructing an intermediate
+/// string containing the entire serialization.
 ///
 template <typename T>
 detail::bt_stream_serializer<T> bt_serializer(const T &val) { return detail::bt_stream_serializer<T>{val}; }
@@ -481,6 +677,20 @@ detail::bt_stream_serializer<T> bt_serializer(const T &val) { return detail::bt_
 template <typename T>
 std::string bt_serialize(const T &val) { return bt_serializer(val); }
 
+/// Returns the exact size of the serialization of `val`; used with `bt_serialize_to()` to serialize
+/// into a preallocated buffer.
+template <typename T>
+size_t bt_serialized_size(const T &val) { return detail::bt_serialize<T>{}.size(val); }
+
+/// Serializes `val` into the buffer at `out`, which must have room for (at least)
+/// `bt_serialized_size(val)` bytes.  Returns a pointer just past the end of the written value.
+///
+///     zmq::message_t msg{bt_serialized_size(data)};
+///     bt_serialize_to(msg.data<char>(), data);
+///
+template <typename T>
+char* bt_serialize_to(char* out, const T &val) { return detail::bt_serialize<T>{}.write(out, val); }
+
 /// Deserializes the given string view directly into `val`.  Usage:
 ///
 ///     std::string encoded = "i42e";
@@ -515,10 +725,20 @@ T bt_deserialize(string_view s) {
 ///     int v = get_int<int>(val); // fails unless the encoded value was actually an integer that
 ///                                // fits into an `int`
 ///
-inline bt_value bt_get(string_view s) {
-    return bt_deserialize<bt_value>(s);
+/// Throws bt_deserialize_invalid if the data exceeds the given limits.
+inline bt_value bt_get(string_view s, const bt_limits& limits = {}) {
+    bt_value val;
+    detail::bt_deserialize<bt_value>{limits}(s, val);
+    return val;
 }
 
+/// Returns true if `data` is exactly one valid bt-encoded value (with nothing after it), within the
+/// given limits, and in canonical form: dict keys are strictly sorted, and integers and string
+/// lengths have no leading zeros (and integers are not `-0`).  This is much faster than
+/// deserializing the data and doesn't allocate (as long as `limits.max_depth` is at most 64), so it
+/// is suitable for rejecting bad data before doing anything else with it.
+bool bt_validate(string_view data, const bt_limits& limits = {});
+
 /// Helper functions to extract a value of some integral type from a bt_value which contains an
 /// integer.  Does range checking, throwing std::overflow_error if the stored value is outside the
 /// range of the target type.
@@ -0,0 +1,308 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "bt_tape.h"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace lokimq {
+
+namespace {
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+#ifdef __SSE2__
+unsigned lowest_bit(unsigned mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    unsigned i = 0;
+    for (; !(mask & 1); mask >>= 1) i++;
+    return i;
+#endif
+}
+#endif
+
+/// Returns the number of ASCII digits at the beginning of [p, end).  Digit runs (string lengths
+/// and integers) are the only part of the encoding that has to be scanned byte by byte, so when
+/// available we check 16 bytes at a time.
+size_t digit_run(const char* p, const char* end) {
+    size_t n = 0;
+#ifdef __SSE2__
+    if (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        // Shift '0'...'9' to the bottom of the signed char range (-128...-119) so that a single
+        // signed comparison picks out everything else.
+        __m128i shifted = _mm_add_epi8(chunk, _mm_set1_epi8(static_cast<char>(0x80 - '0')));
+        __m128i nondigit = _mm_cmpgt_epi8(shifted, _mm_set1_epi8(-128 + 9));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(nondigit));
+        if (mask)
+            return lowest_bit(mask);
+        // 16+ digits: only possible for very large integers (or invalid data); finish the slow way
+        n = 16;
+    }
+#endif
+    while (p + n < end && is_digit(p[n]))
+        n++;
+    return n;
+}
+
+/// Parses a run of `n` digits as an unsigned value; returns false on overflow.
+bool parse_digits(const char* p, size_t n, uint64_t& val) {
+    if (n > 20)
+        return false;
+    val = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t next = val * 10 + static_cast<uint64_t>(p[i] - '0');
+        if (i == 19 && (val > std::numeric_limits<uint64_t>::max() / 10 || next < val * 10))
+            return false;
+        val = next;
+    }
+    return true;
+}
+
+[[noreturn]] void invalid(const char* msg, size_t offset) {
+    throw bt_deserialize_invalid{"Invalid bt data at offset " + std::to_string(offset) + ": " + msg};
+}
+
+} // anonymous namespace
+
+bt_tape::bt_tape(string_view data) {
+    parse(data);
+}
+
+void bt_tape::parse(string_view data) {
+    data_ = data;
+    entries_.clear();
+    keys_.clear();
+    stack_.clear();
+    pending_keys_.clear();
+    try {
+        scan();
+    } catch (...) {
+        data_ = {};
+        entries_.clear();
+        keys_.clear();
+        throw;
+    }
+}
+
+void bt_tape::scan() {
+    if (data_.size() >= std::numeric_limits<uint32_t>::max())
+        throw bt_deserialize_invalid{"bt data is too large to index"};
+
+    const char* const begin = data_.data();
+    const char* const end = begin + data_.size();
+    const char* p = begin;
+
+    // Explicit stack of the lists/dicts we are currently inside of (so that deeply nested data
+    // doesn't use up the call stack)
+    auto& stack = stack_;
+    auto& pending_keys = pending_keys_;
+
+    do {
+        if (p == end)
+            invalid("unexpected end of data", p - begin);
+        const size_t offset = p - begin;
+        const char c = *p;
+
+        if (c == 'e') {
+            if (stack.empty())
+                invalid("unexpected 'e'", offset);
+            auto& top = stack.back();
+            if (top.dict && !top.want_key)
+                invalid("dict key is not followed by a value", offset);
+            auto& e = entries_[top.index];
+            p++;
+            e.length = static_cast<uint32_t>(p - begin - e.offset);
+            e.end = static_cast<uint32_t>(entries_.size());
+            e.count = top.count;
+            if (top.dict) {
+                e.keys = static_cast<uint32_t>(keys_.size());
+                keys_.insert(keys_.end(), pending_keys.begin() + top.first_key, pending_keys.end());
+                pending_keys.resize(top.first_key);
+            }
+            stack.pop_back();
+            continue;
+        }
+
+        const auto index = static_cast<uint32_t>(entries_.size());
+        bool is_key = false;
+        if (!stack.empty()) {
+            auto& top = stack.back();
+            if (top.dict && top.want_key) {
+                if (!is_digit(c))
+                    invalid("dict key is not a string", offset);
+                is_key = true;
+                top.want_key = false;
+                top.count++;
+            } else if (top.dict) {
+                top.want_key = true;
+            } else {
+                top.count++;
+            }
+        }
+
+        if (c == 'i') {
+            const char* q = p + 1;
+            bool negative = q < end && *q == '-';
+            if (negative) q++;
+            size_t n = digit_run(q, end);
+            uint64_t val;
+            if (n == 0)
+                invalid("expected digits after 'i'", q - begin);
+            if (!parse_digits(q, n, val) || (negative && val > (uint64_t{1} << 63)))
+                invalid("integer value is out of range", offset);
+            q += n;
+            if (q == end || *q != 'e')
+                invalid("expected 'e' after integer digits", q - begin);
+            q++;
+            entries_.push_back({bt_type::integer, static_cast<uint32_t>(offset), static_cast<uint32_t>(q - p), index + 1, 0, 0});
+            p = q;
+        } else if (c == 'l' || c == 'd') {
+            entries_.push_back({c == 'l' ? bt_type::list : bt_type::dict, static_cast<uint32_t>(offset), 0, 0, 0, 0});
+            stack.push_back({index, 0, pending_keys.size(), c == 'd', true});
+            p++;
+        } else if (is_digit(c)) {
+            size_t n = digit_run(p, end);
+            uint64_t len;
+            if (!parse_digits(p, n, len))
+                invalid("string length is out of range", offset);
+            const char* str = p + n;
+            if (str == end || *str != ':')
+                invalid("expected ':' after string length", str - begin);
+            str++;
+            if (len > static_cast<uint64_t>(end - str))
+                invalid("string extends past the end of the data", offset);
+            if (is_key) {
+                auto& top = stack.back();
+                if (pending_keys.size() > top.first_key) {
+                    auto& prev = entries_[pending_keys.back()];
+                    if (!(string_view{begin + prev.offset, prev.length} < string_view{str, static_cast<size_t>(len)}))
+                        invalid("dict keys are not in sorted order", offset);
+                }
+                pending_keys.push_back(index);
+            }
+            entries_.push_back({bt_type::string, static_cast<uint32_t>(str - begin), static_cast<uint32_t>(len), index + 1, 0, static_cast<uint32_t>(str - p)});
+            p = str + len;
+        } else {
+            invalid("expected one of [0-9idle]", offset);
+        }
+    } while (!stack.empty());
+
+    if (p != end)
+        invalid("unexpected data after the end of the value", p - begin);
+}
+
+const bt_tape_entry& bt_tape_value::dict_entry() const {
+    auto& e = entry();
+    if (e.type != bt_type::dict) throw bt_deserialize_invalid_type{"bt value is not a dict"};
+    return e;
+}
+
+string_view bt_tape_value::encoded() const {
+    auto& e = entry();
+    const char* start = tape_->data_.data() + e.offset;
+    size_t length = e.length;
+    if (e.type == bt_type::string) {
+        // Include the "N:" prefix.  (We can't find it by backing up over digits: the bytes before
+        // it may be digits too, e.g. the end of a preceding "3:123" string.)
+        start -= e.count;
+        length += e.count;
+        assert(e.count >= 2 && start[e.count - 1] == ':' && is_digit(start[0]));
+    }
+    return {start, length};
+}
+
+size_t bt_tape_value::size() const {
+    auto& e = entry();
+    if (e.type != bt_type::list && e.type != bt_type::dict)
+        throw bt_deserialize_invalid_type{"bt value is not a list or dict"};
+    return e.count;
+}
+
+uint32_t bt_tape_value::find_key(string_view key) const {
+    auto& e = dict_entry();
+    auto& entries = tape_->entries_;
+    const char* data = tape_->data_.data();
+    auto first = tape_->keys_.begin() + e.keys, last = first + e.count;
+    auto it = std::lower_bound(first, last, key, [&](uint32_t k, string_view find) {
+        return string_view{data + entries[k].offset, entries[k].length} < find;
+    });
+    if (it != last && string_view{data + entries[*it].offset, entries[*it].length} == key)
+        return static_cast<uint32_t>(it - tape_->keys_.begin());
+    return e.keys + e.count;
+}
+
+bool bt_tape_value::contains(string_view key) const {
+    if (!is_dict())
+        return false;
+    auto& e = entry();
+    return find_key(key) != e.keys + e.count;
+}
+
+bt_tape_value bt_tape_value::at(string_view key) const {
+    auto& e = dict_entry();
+    auto pos = find_key(key);
+    if (pos == e.keys + e.count)
+        throw std::out_of_range{"key not found in bt dict"};
+    // The value immediately follows its key on the tape
+    return {*tape_, tape_->keys_[pos] + 1};
+}
+
+string_view bt_tape_value::key(size_t i) const {
+    auto& e = dict_entry();
+    if (i >= e.count) throw std::out_of_range{"bt dict key index out of range"};
+    auto& k = tape_->entries_[tape_->keys_[e.keys + i]];
+    return {tape_->data_.data() + k.offset, k.length};
+}
+
+bt_tape_value bt_tape_value::value(size_t i) const {
+    auto& e = dict_entry();
+    if (i >= e.count) throw std::out_of_range{"bt dict key index out of range"};
+    return {*tape_, tape_->keys_[e.keys + i] + 1};
+}
+
+bt_tape_value::iterator bt_tape_value::begin() const {
+    if (!is_list()) throw bt_deserialize_invalid_type{"bt value is not a list"};
+    return {tape_, index_ + 1};
+}
+
+bt_tape_value::iterator bt_tape_value::end() const {
+    if (!is_list()) throw bt_deserialize_invalid_type{"bt value is not a list"};
+    return {tape_, entry().end};
+}
+
+} // namespace lokimq
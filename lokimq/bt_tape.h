@@ -0,0 +1,277 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <vector>
+#include "bt_serialize.h"
+
+namespace lokimq {
+
+/** \file
+ * A structural index ("tape") of bt-encoded data: a single pass over the data validates it and
+ * records the position of every value in a flat array, after which values can be accessed without
+ * parsing again.  Skipping over a list or dict (however large or deeply nested) takes constant
+ * time, and dict values are found by binary search over the (sorted) keys, so this is much faster
+ * than bt_list_consumer/bt_dict_consumer for large, nested data of which only parts are needed, or
+ * that needs to be accessed more than once.  Like the consumers, nothing is copied: the tape refers
+ * to the original data, which must remain valid for as long as the tape is used.
+ *
+ *     bt_tape tape{data};
+ *     auto root = tape.root();
+ *     auto height = root.at("height").integer<uint64_t>();
+ *     for (auto v : root.at("votes"))
+ *         process_vote(v.at("k").string(), v.at("s").string());
+ *
+ * Construction throws bt_deserialize_invalid if the data is not a single, valid bt-encoded value.
+ * Dict keys are required to be in (strictly) sorted order, as they must be for correctly encoded
+ * dicts.
+ */
+
+/// The type of a bt-encoded value
+enum class bt_type : uint8_t { string, integer, list, dict };
+
+/// A single value on the tape
+struct bt_tape_entry {
+    bt_type type;
+    /// For strings, the offset of the first byte of the string value (i.e. after the `N:` prefix);
+    /// for other types the offset of the value's opening `i`, `l`, or `d`.
+    uint32_t offset;
+    /// For strings, the length of the string value; for other types the length of the entire
+    /// encoded value (including the opening `i`/`l`/`d` and the closing `e`).
+    uint32_t length;
+    /// The tape index just past this value (and, for lists and dicts, everything inside it).
+    uint32_t end;
+    /// For dicts, the position in the tape's key index of this dict's first key
+    uint32_t keys;
+    /// For lists, the number of elements; for dicts, the number of key-value pairs; for strings, the
+    /// length of the `N:` prefix.
+    uint32_t count;
+};
+
+class bt_tape_value;
+
+/// The structural index of a bt-encoded value; see above.
+class bt_tape {
+    friend class bt_tape_value;
+
+    string_view data_;
+    std::vector<bt_tape_entry> entries_;
+    /// Tape indices of dict keys: each dict's keys are stored contiguously (in sorted order)
+    /// starting at the dict entry's `keys` position.
+    std::vector<uint32_t> keys_;
+
+    /// A list or dict that we are inside of during scanning
+    struct open_container {
+        uint32_t index; // tape index of the list/dict
+        uint32_t count; // number of elements (for a dict: number of keys) so far
+        size_t first_key; // for a dict: where this dict's keys start in `pending_keys_`
+        bool dict;
+        bool want_key; // for a dict: true if the next value is a key
+    };
+    // Scratch space used during scanning (kept so that rescanning doesn't reallocate): the explicit
+    // stack of open containers, and the keys of open dicts (which get moved into keys_ when the
+    // dict is closed).
+    std::vector<open_container> stack_;
+    std::vector<uint32_t> pending_keys_;
+
+    void scan();
+
+public:
+    /// Constructs an empty tape; `parse()` must be called before accessing any values.
+    bt_tape() = default;
+
+    /// Scans the given data, which must be a single bt-encoded value (and must stay valid for the
+    /// lifetime of the tape).  Throws bt_deserialize_invalid if the data is not valid.
+    explicit bt_tape(string_view data);
+
+    /// Replaces the tape with a scan of new data.  The tape's memory is reused, so rescanning data
+    /// of similar size doesn't allocate at all.  Throws bt_deserialize_invalid (and leaves the tape
+    /// empty) if the data is not valid.
+    void parse(string_view data);
+
+    /// The data that was scanned
+    string_view data() const { return data_; }
+
+    /// The tape entries, in encoding order: each list value is followed by its elements; each dict
+    /// value by its keys and values (alternating).
+    const std::vector<bt_tape_entry>& entries() const { return entries_; }
+
+    /// Returns the top-level value
+    bt_tape_value root() const;
+};
+
+/// A lightweight reference to a value on a bt_tape.  The tape (and the data it indexes) must outlive
+/// the value.
+class bt_tape_value {
+    const bt_tape* tape_ = nullptr;
+    uint32_t index_ = 0;
+
+    const bt_tape_entry& entry() const { return tape_->entries_[index_]; }
+    const bt_tape_entry& dict_entry() const;
+    /// Returns the position in tape_->keys_ of `key` in this dict, or keys+count if not found.
+    uint32_t find_key(string_view key) const;
+
+public:
+    bt_tape_value() = default;
+    bt_tape_value(const bt_tape& tape, uint32_t index) : tape_{&tape}, index_{index} {}
+
+    /// The index of this value on the tape
+    uint32_t index() const { return index_; }
+
+    bt_type type() const { return entry().type; }
+    bool is_string() const { return type() == bt_type::string; }
+    bool is_integer() const { return type() == bt_type::integer; }
+    bool is_list() const { return type() == bt_type::list; }
+    bool is_dict() const { return type() == bt_type::dict; }
+
+    /// Returns the string value.  Throws bt_deserialize_invalid_type if not a string.
+    string_view string() const {
+        auto& e = entry();
+        if (e.type != bt_type::string) throw bt_deserialize_invalid_type{"bt value is not a string"};
+        return {tape_->data_.data() + e.offset, e.length};
+    }
+
+    /// Returns the integer value.  Throws bt_deserialize_invalid_type if not an integer, and
+    /// bt_deserialize_invalid if the value does not fit in an `IntType`.
+    template <typename IntType>
+    IntType integer() const {
+        auto& e = entry();
+        if (e.type != bt_type::integer) throw bt_deserialize_invalid_type{"bt value is not an integer"};
+        string_view encoded{tape_->data_.data() + e.offset, e.length};
+        IntType val;
+        detail::bt_deserialize<IntType>{}(encoded, val);
+        return val;
+    }
+
+    /// Returns the entire encoded value (e.g. to pass along or deserialize in full).
+    string_view encoded() const;
+
+    /// For a list, the number of elements; for a dict, the number of key-value pairs.  Throws
+    /// bt_deserialize_invalid_type for other types.
+    size_t size() const;
+
+    /// Returns true if this is a dict containing the given key.  O(log n).
+    bool contains(string_view key) const;
+
+    /// Returns the value of the given key in this dict.  Throws bt_deserialize_invalid_type if not
+    /// a dict and std::out_of_range if the key is not present.  O(log n).
+    bt_tape_value at(string_view key) const;
+
+    /// Returns the `i`th key (in sorted order) of this dict.  O(1).
+    string_view key(size_t i) const;
+
+    /// Returns the value of the `i`th key (in sorted order) of this dict.  O(1).
+    bt_tape_value value(size_t i) const;
+
+    /// Forward iterator over the elements of a list
+    class iterator {
+        const bt_tape* tape_;
+        uint32_t index_;
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = bt_tape_value;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = bt_tape_value;
+
+        iterator(const bt_tape* tape, uint32_t index) : tape_{tape}, index_{index} {}
+        bt_tape_value operator*() const { return {*tape_, index_}; }
+        iterator& operator++() { index_ = tape_->entries()[index_].end; return *this; }
+        iterator operator++(int) { auto copy = *this; ++*this; return copy; }
+        bool operator==(const iterator& it) const { return index_ == it.index_; }
+        bool operator!=(const iterator& it) const { return index_ != it.index_; }
+    };
+
+    /// Iteration over the elements of a list (skipping each element, however large, is O(1)).
+    /// Throws bt_deserialize_invalid_type if not a list; use `size()`, `key()` and `value()` to
+    /// iterate through a dict.
+    iterator begin() const;
+    iterator end() const;
+};
+
+inline bt_tape_value bt_tape::root() const { return {*this, 0}; }
+
+/// Extracts an integer value from a bt_tape_value, like `get_int()` does for a bt_value.
+template <typename IntType, std::enable_if_t<std::is_integral<IntType>::value, int> = 0>
+IntType get_int(const bt_tape_value& v) { return v.integer<IntType>(); }
+
+/// A parsed bt-encoded value: an alternative to `bt_get()`/bt_value for reading (rather than
+/// building) bt-encoded data.  Instead of allocating a std::string for every string value, a list
+/// node for every list element, and a hash table for every dict, this keeps the encoded data and
+/// a flat index into it (see bt_tape): string values are string_views into the data, and dict
+/// lookups are binary searches over the encoded (sorted) keys.  A document can be reused for
+/// parsing more data, reusing its memory.
+///
+///     bt_document doc{std::move(encoded)};
+///     auto pubkey = doc.at("pubkey").string();
+///     auto keep_alive = get_int<int>(doc.at("keep-alive"));
+///     if (doc.contains("optional")) { ... }
+///
+class bt_document {
+    std::string owned_;
+    bt_tape tape_;
+
+public:
+    bt_document() = default;
+
+    /// Parses data which must stay valid as long as the document is used
+    explicit bt_document(string_view data) { parse(data); }
+
+    /// Parses data which the document takes ownership of
+    explicit bt_document(std::string&& data) { parse(std::move(data)); }
+
+    // Non-copyable and non-movable as the tape refers to the owned data (which moving a
+    // std::string can relocate).
+    bt_document(const bt_document&) = delete;
+    bt_document& operator=(const bt_document&) = delete;
+
+    /// Replaces the document with new data which must stay valid as long as the document is used.
+    /// Throws bt_deserialize_invalid if the data is not valid bt-encoded data.
+    void parse(string_view data) { owned_.clear(); tape_.parse(data); }
+
+    /// Replaces the document with new data which the document takes ownership of.  Throws
+    /// bt_deserialize_invalid if the data is not valid bt-encoded data.
+    void parse(std::string&& data) { owned_ = std::move(data); tape_.parse(owned_); }
+
+    /// The top-level value
+    bt_tape_value root() const { return tape_.root(); }
+
+    /// Shortcuts for accessing the values of a document containing a dict; these are equivalent to
+    /// calling the same method on `root()`.
+    bt_tape_value at(string_view key) const { return root().at(key); }
+    bool contains(string_view key) const { return root().contains(key); }
+    size_t count(string_view key) const { return contains(key) ? 1 : 0; }
+};
+
+} // namespace lokimq
+
+// vim:sw=4:et
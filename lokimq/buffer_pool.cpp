@@ -0,0 +1,135 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "buffer_pool.h"
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace lokimq {
+
+constexpr size_t buffer_pool::BLOCK_SIZES[];
+
+namespace {
+
+// Slabs are this big, unless the block size is bigger (or we use huge pages)
+constexpr size_t SLAB_SIZE = 256 * 1024;
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+}
+
+buffer_pool& buffer_pool::instance() {
+    static buffer_pool* pool = new buffer_pool{};
+    return *pool;
+}
+
+buffer_pool::buffer_pool() {
+    for (size_t i = 0; i < CLASSES; i++) {
+        classes_[i].block_size = BLOCK_SIZES[i];
+        classes_[i].stats.block_size = BLOCK_SIZES[i];
+    }
+}
+
+void buffer_pool::use_huge_pages(bool enable) {
+    huge_pages_ = enable;
+}
+
+void* buffer_pool::acquire(size_t size, void*& hint) {
+    if (size > MAX_BLOCK_SIZE)
+        return nullptr;
+    size_t i = 0;
+    while (BLOCK_SIZES[i] < size)
+        i++;
+    auto& cls = classes_[i];
+    hint = &cls;
+
+    std::lock_guard<std::mutex> lock{cls.mutex};
+    if (!cls.free_list)
+        grow(cls);
+    void* block = cls.free_list;
+    cls.free_list = *static_cast<void**>(block);
+    cls.stats.acquired++;
+    if (++cls.stats.in_use > cls.stats.peak_in_use)
+        cls.stats.peak_in_use = cls.stats.in_use;
+    return block;
+}
+
+void buffer_pool::release(void* block, void* hint) {
+    auto& cls = *static_cast<size_class*>(hint);
+    std::lock_guard<std::mutex> lock{cls.mutex};
+    *static_cast<void**>(block) = cls.free_list;
+    cls.free_list = block;
+    cls.stats.in_use--;
+}
+
+void buffer_pool::grow(size_class& cls) {
+    size_t slab_size = huge_pages_ ? HUGE_PAGE_SIZE : SLAB_SIZE;
+    if (slab_size < cls.block_size)
+        slab_size = cls.block_size;
+
+    char* slab = nullptr;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    if (huge_pages_) {
+        void* p = mmap(nullptr, slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            slab = static_cast<char*>(p);
+            cls.stats.huge_slabs++;
+        }
+    }
+#endif
+    if (!slab) {
+        slab = static_cast<char*>(std::malloc(slab_size));
+        if (!slab)
+            throw std::bad_alloc{};
+    }
+    cls.stats.slabs++;
+
+    size_t count = slab_size / cls.block_size;
+    for (size_t i = count; i > 0; i--) {
+        char* block = slab + (i - 1) * cls.block_size;
+        *reinterpret_cast<void**>(block) = cls.free_list;
+        cls.free_list = block;
+    }
+    cls.stats.blocks += count;
+}
+
+std::vector<buffer_pool::class_stats> buffer_pool::stats() {
+    std::vector<class_stats> result;
+    result.reserve(CLASSES);
+    for (auto& cls : classes_) {
+        std::lock_guard<std::mutex> lock{cls.mutex};
+        result.push_back(cls.stats);
+    }
+    return result;
+}
+
+} // namespace lokimq
@@ -0,0 +1,119 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace lokimq {
+
+/** \file
+ * A pool of reusable, size-classed buffers for the data of outgoing zmq messages.  Without it
+ * every message frame we build needs a fresh heap allocation for its data (plus, for frames built
+ * in a std::string, another for the std::string that owns the data until zmq is done with it);
+ * with it, frames are built (or copied) directly into a pooled buffer which zmq's free callback
+ * returns to the pool once the message has been sent.
+ *
+ * Buffers are carved out of large slabs (optionally backed by huge pages) that are never freed:
+ * the pool grows to the peak number of buffers in use and stays there.  Each size class has its
+ * own lock, held only to pop or push a free list entry, so the pool can be used from any thread
+ * (zmq calls the free callback from its I/O threads).
+ */
+class buffer_pool {
+public:
+    /// The block sizes of the size classes.  Data larger than the largest class isn't pooled.
+    static constexpr size_t BLOCK_SIZES[] = {64, 256, 1024, 4096, 16384, 65536};
+    static constexpr size_t CLASSES = sizeof(BLOCK_SIZES) / sizeof(BLOCK_SIZES[0]);
+    static constexpr size_t MAX_BLOCK_SIZE = BLOCK_SIZES[CLASSES - 1];
+
+    /// Occupancy metrics of a single size class
+    struct class_stats {
+        /// The size of the blocks in this class
+        size_t block_size;
+        /// The number of blocks carved out of slabs so far (in use or free)
+        size_t blocks;
+        /// The number of blocks currently in use
+        size_t in_use;
+        /// The highest number of blocks that have been in use at once
+        size_t peak_in_use;
+        /// The total number of times a block has been acquired
+        uint64_t acquired;
+        /// The number of slabs allocated for this class (and the number of those that are backed
+        /// by huge pages)
+        size_t slabs, huge_slabs;
+    };
+
+    /// The (process-wide) pool.  It is never destroyed, so that messages freed by zmq during
+    /// shutdown can still be returned to it.
+    static buffer_pool& instance();
+
+    /// Returns a block of at least `size` bytes, or nullptr if `size` is larger than
+    /// MAX_BLOCK_SIZE.  `hint` is set to the value that must be passed to `release()` with it.
+    void* acquire(size_t size, void*& hint);
+
+    /// Returns a block to the pool.  The signature matches zmq's free function, so this can be
+    /// given directly to a zmq::message_t constructed on a pooled block.
+    static void release(void* block, void* hint);
+
+    /// If enabled, new slabs are allocated as (2MiB) huge pages, when the system has them
+    /// available.  Off by default.
+    void use_huge_pages(bool enable);
+
+    /// Returns the current metrics of each size class
+    std::vector<class_stats> stats();
+
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+private:
+    buffer_pool();
+
+    struct size_class {
+        std::mutex mutex;
+        size_t block_size = 0;
+        /// Free blocks, linked through their first bytes
+        void* free_list = nullptr;
+        class_stats stats{};
+    };
+
+    // Allocates a new slab for `cls` and puts its blocks on the free list; called with the lock
+    // held.
+    void grow(size_class& cls);
+
+    size_class classes_[CLASSES];
+    std::atomic<bool> huge_pages_{false};
+};
+
+}
+
+// vim:sw=4:et
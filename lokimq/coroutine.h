@@ -0,0 +1,242 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+// Optional C++20 coroutine support for command handlers.  Everything here is only available when
+// the compiler supports coroutines (LOKIMQ_COROUTINES is defined if so); the rest of LokiMQ only
+// requires C++14.
+//
+// A coroutine command is added with the usual `add_command` but with a callback returning a
+// `lokimq::task`:
+//
+//     lmq.add_command("sn", "lookup", [&](lokimq::Message& m) -> lokimq::task {
+//         auto reply = m.defer();
+//         auto data = m.take_parts();
+//         // m is no longer valid after the first co_await
+//         auto result = co_await lokimq::run_job(lmq, [data] { return expensive_lookup(data->data[0]); });
+//         co_await lokimq::sleep_for(lmq, 100ms);
+//         reply.reply("sn.lookup_result", result);
+//     });
+//
+// Whenever the coroutine suspends the worker thread is released for other work; the coroutine is
+// resumed on a worker thread (not necessarily the same one) once the awaited event happens.
+
+#include "lokimq.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define LOKIMQ_COROUTINES 1
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace lokimq {
+
+namespace detail {
+
+/// Gives the coroutine types below access to LokiMQ's internal job queue and logging.
+struct coroutine_access {
+    static void resume(LokiMQ& lmq, std::coroutine_handle<> h, std::chrono::milliseconds delay = 0ms) {
+        lmq.queue_job([h] { h.resume(); }, delay);
+    }
+    static void queue(LokiMQ& lmq, std::function<void()> job) {
+        lmq.queue_job(std::move(job));
+    }
+    template <typename... T>
+    static void log(LokiMQ& lmq, LogLevel lvl, const char* file, int line, const T&... stuff) {
+        lmq.log_(lvl, file, line, stuff...);
+    }
+};
+
+} // namespace detail
+
+/// The return type of a coroutine command callback.  The coroutine starts running (in the worker
+/// thread that received the command) when the callback is invoked and owns itself from then on:
+/// it is destroyed when it finishes.  Exceptions escaping the coroutine are logged.
+///
+/// Note that a suspended coroutine is only resumed by the event it is waiting on: a coroutine
+/// waiting on something that never happens (or still suspended when LokiMQ is destroyed) is
+/// leaked.
+class task {
+public:
+    struct promise_type {
+        LokiMQ* lmq = nullptr;
+
+        task get_return_object() { return task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        // Suspended initially so that `start()` can set `lmq` before anything runs
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {
+            try {
+                throw;
+            } catch (const std::exception& e) {
+                detail::coroutine_access::log(*lmq, LogLevel::warn, __FILE__, __LINE__,
+                        "coroutine command raised an exception: ", e.what());
+            } catch (...) {
+                detail::coroutine_access::log(*lmq, LogLevel::warn, __FILE__, __LINE__,
+                        "coroutine command raised a non-standard exception");
+            }
+        }
+    };
+
+    task(task&& t) noexcept : handle{std::exchange(t.handle, nullptr)} {}
+    task& operator=(task&& t) noexcept { std::swap(handle, t.handle); return *this; }
+    ~task() { if (handle) handle.destroy(); } // Only if never started
+
+    /// Starts running the coroutine; called by LokiMQ when the command is invoked.
+    void start(LokiMQ& lmq) {
+        auto h = std::exchange(handle, nullptr);
+        h.promise().lmq = &lmq;
+        h.resume();
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) : handle{h} {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+/// `co_await on_worker(lmq)` releases the current worker and continues on the next available
+/// worker.  Useful to let other queued work run in the middle of a long task.
+struct on_worker {
+    LokiMQ& lmq;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { detail::coroutine_access::resume(lmq, h); }
+    void await_resume() const noexcept {}
+};
+
+/// `co_await sleep_for(lmq, 250ms)` suspends the coroutine, without holding a worker, for (at
+/// least) the given time.
+struct sleep_for {
+    LokiMQ& lmq;
+    std::chrono::milliseconds delay;
+    bool await_ready() const noexcept { return delay <= 0ms; }
+    void await_suspend(std::coroutine_handle<> h) { detail::coroutine_access::resume(lmq, h, delay); }
+    void await_resume() const noexcept {}
+};
+
+/// Awaitable returned by `run_job()`.
+template <typename F, typename R = std::invoke_result_t<F&>>
+class job_awaiter {
+public:
+    job_awaiter(LokiMQ& lmq, F f) : lmq{lmq}, f{std::move(f)} {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        // The awaiter lives in the suspended coroutine's frame, so `this` stays valid until we
+        // resume it.
+        detail::coroutine_access::queue(lmq, [this, h] {
+            try {
+                if constexpr (std::is_void_v<R>) f();
+                else result.emplace(f());
+            } catch (...) {
+                error = std::current_exception();
+            }
+            h.resume();
+        });
+    }
+    R await_resume() {
+        if (error)
+            std::rethrow_exception(error);
+        if constexpr (!std::is_void_v<R>)
+            return std::move(*result);
+    }
+
+private:
+    LokiMQ& lmq;
+    F f;
+    std::conditional_t<std::is_void_v<R>, bool, std::optional<R>> result{};
+    std::exception_ptr error;
+};
+
+/// `co_await run_job(lmq, f)` runs `f()` as a job on a worker thread and evaluates to its result
+/// (or rethrows its exception).  The coroutine continues on the worker that ran the job.
+template <typename F>
+job_awaiter<F> run_job(LokiMQ& lmq, F f) { return {lmq, std::move(f)}; }
+
+/// A value provided later from any thread that a coroutine can `co_await`.  This is the building
+/// block for awaiting requests: for example a handler that sends a sub-request to another SN can
+/// store a completion (keyed by a request id it includes in the request), `co_await` it, and have
+/// the command that receives the response call `set()`.  Copies share the same value; only one
+/// coroutine may await it, and the value may only be set once.
+template <typename T>
+class completion {
+public:
+    explicit completion(LokiMQ& lmq) : state{std::make_shared<shared_state>(lmq)} {}
+
+    /// Sets the value, resuming the waiting coroutine (if any) on a worker.  Returns false (and
+    /// does nothing) if the value was already set.
+    bool set(T value) {
+        std::coroutine_handle<> h;
+        {
+            std::lock_guard<std::mutex> lock{state->mutex};
+            if (state->value)
+                return false;
+            state->value.emplace(std::move(value));
+            h = std::exchange(state->waiting, nullptr);
+        }
+        if (h)
+            detail::coroutine_access::resume(state->lmq, h);
+        return true;
+    }
+
+    bool await_ready() const {
+        std::lock_guard<std::mutex> lock{state->mutex};
+        return state->value.has_value();
+    }
+    bool await_suspend(std::coroutine_handle<> h) {
+        std::lock_guard<std::mutex> lock{state->mutex};
+        if (state->value)
+            return false; // Set between await_ready and now: don't suspend
+        state->waiting = h;
+        return true;
+    }
+    T await_resume() {
+        std::lock_guard<std::mutex> lock{state->mutex};
+        return std::move(*state->value);
+    }
+
+private:
+    struct shared_state {
+        explicit shared_state(LokiMQ& lmq) : lmq{lmq} {}
+        LokiMQ& lmq;
+        std::mutex mutex;
+        std::optional<T> value;
+        std::coroutine_handle<> waiting;
+    };
+    std::shared_ptr<shared_state> state;
+};
+
+}
+
+#endif
+
+// vim:sw=4:et
@@ -0,0 +1,228 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "hex.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define LOKIMQ_HEX_X86 1
+#include <immintrin.h>
+#endif
+
+namespace lokimq {
+
+namespace {
+
+// Scalar versions; also used for whatever is left over after the vectorized loops
+char* to_hex_scalar(const unsigned char* in, size_t n, char* out) {
+    for (; n > 0; n--, in++) {
+        *out++ = detail::hex_lut.to_hex(*in >> 4);
+        *out++ = detail::hex_lut.to_hex(*in & 0x0f);
+    }
+    return out;
+}
+
+char* from_hex_scalar(const char* in, size_t n, char* out) {
+    for (; n >= 2; n -= 2, in += 2)
+        *out++ = from_hex_pair(in[0], in[1]);
+    return out;
+}
+
+bool is_hex_scalar(const char* in, size_t n) {
+    for (; n > 0; n--, in++)
+        if (!detail::hex_lut.is_hex(*in))
+            return false;
+    return true;
+}
+
+#ifdef LOKIMQ_HEX_X86
+
+// The vectorized versions are compiled for the instruction set they need (via the target
+// attribute) and only called if the CPU we're running on supports it.
+
+// Converts hex digits to their values, setting `valid` to 0xff for each byte that was a hex digit.
+__attribute__((target("ssse3")))
+__m128i hex_values(__m128i v, __m128i& valid) {
+    __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i letter = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+    valid = _mm_or_si128(is_digit, is_letter);
+    return _mm_or_si128(
+            _mm_and_si128(is_digit, digit),
+            _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+__attribute__((target("ssse3")))
+char* to_hex_ssse3(const unsigned char* in, size_t n, char* out) {
+    const __m128i lut = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    for (; n >= 16; n -= 16, in += 16, out += 32) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, nibble));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    return to_hex_scalar(in, n, out);
+}
+
+__attribute__((target("ssse3")))
+char* from_hex_ssse3(const char* in, size_t n, char* out) {
+    // Multiplies the first digit of each pair by 16 and adds the second
+    const __m128i combine = _mm_set1_epi16(0x0110);
+    __m128i valid;
+    for (; n >= 32; n -= 32, in += 32, out += 16) {
+        // Both loads happen before the store, so decoding in place works.
+        __m128i a = hex_values(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)), valid);
+        __m128i b = hex_values(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 16)), valid);
+        a = _mm_maddubs_epi16(a, combine);
+        b = _mm_maddubs_epi16(b, combine);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(a, b));
+    }
+    return from_hex_scalar(in, n, out);
+}
+
+__attribute__((target("ssse3")))
+bool is_hex_ssse3(const char* in, size_t n) {
+    __m128i valid;
+    for (; n >= 16; n -= 16, in += 16) {
+        hex_values(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)), valid);
+        if (_mm_movemask_epi8(valid) != 0xffff)
+            return false;
+    }
+    return is_hex_scalar(in, n);
+}
+
+__attribute__((target("avx2")))
+__m256i hex_values(__m256i v, __m256i& valid) {
+    __m256i digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+    __m256i letter = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter);
+    valid = _mm256_or_si256(is_digit, is_letter);
+    return _mm256_or_si256(
+            _mm256_and_si256(is_digit, digit),
+            _mm256_and_si256(is_letter, _mm256_add_epi8(letter, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+char* to_hex_avx2(const unsigned char* in, size_t n, char* out) {
+    const __m256i lut = _mm256_setr_epi8(
+            '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+            '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    for (; n >= 32; n -= 32, in += 32, out += 64) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble));
+        // unpack works within each 128-bit lane, so `a` holds bytes 0-7 and 16-23, `b` 8-15 and
+        // 24-31; put the lanes back in order:
+        __m256i a = _mm256_unpacklo_epi8(hi, lo), b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    return to_hex_ssse3(in, n, out);
+}
+
+__attribute__((target("avx2")))
+char* from_hex_avx2(const char* in, size_t n, char* out) {
+    const __m256i combine = _mm256_set1_epi16(0x0110);
+    __m256i valid;
+    for (; n >= 64; n -= 64, in += 64, out += 32) {
+        __m256i a = hex_values(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in)), valid);
+        __m256i b = hex_values(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 32)), valid);
+        a = _mm256_maddubs_epi16(a, combine);
+        b = _mm256_maddubs_epi16(b, combine);
+        // pack also works per lane, giving us a0 b0 a1 b1; reorder to a0 a1 b0 b1:
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+    }
+    return from_hex_ssse3(in, n, out);
+}
+
+__attribute__((target("avx2")))
+bool is_hex_avx2(const char* in, size_t n) {
+    __m256i valid;
+    for (; n >= 32; n -= 32, in += 32) {
+        hex_values(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in)), valid);
+        if (_mm256_movemask_epi8(valid) != -1)
+            return false;
+    }
+    return is_hex_ssse3(in, n);
+}
+
+#endif
+
+// The implementations to use, chosen the first time they are needed based on the CPU.
+struct hex_impl {
+    char* (*to_hex)(const unsigned char* in, size_t n, char* out);
+    char* (*from_hex)(const char* in, size_t n, char* out);
+    bool (*is_hex)(const char* in, size_t n);
+};
+
+const hex_impl& hex_dispatch() {
+    static const hex_impl impl = []() -> hex_impl {
+#ifdef LOKIMQ_HEX_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return {to_hex_avx2, from_hex_avx2, is_hex_avx2};
+        if (__builtin_cpu_supports("ssse3"))
+            return {to_hex_ssse3, from_hex_ssse3, is_hex_ssse3};
+#endif
+        return {to_hex_scalar, from_hex_scalar, is_hex_scalar};
+    }();
+    return impl;
+}
+
+// Below this size the vectorized versions wouldn't do anything but call the scalar version
+constexpr size_t MIN_VECTOR_BYTES = 16;
+
+} // anonymous namespace
+
+char* to_hex(string_view bytes, char* out) {
+    auto* in = reinterpret_cast<const unsigned char*>(bytes.data());
+    if (bytes.size() < MIN_VECTOR_BYTES)
+        return to_hex_scalar(in, bytes.size(), out);
+    return hex_dispatch().to_hex(in, bytes.size(), out);
+}
+
+char* from_hex(string_view hex, char* out) {
+    assert(hex.size() % 2 == 0);
+    if (hex.size() < 2 * MIN_VECTOR_BYTES)
+        return from_hex_scalar(hex.data(), hex.size(), out);
+    return hex_dispatch().from_hex(hex.data(), hex.size(), out);
+}
+
+bool is_hex(string_view s) {
+    if (s.size() < MIN_VECTOR_BYTES)
+        return is_hex_scalar(s.data(), s.size());
+    return hex_dispatch().is_hex(s.data(), s.size());
+}
+
+} // namespace lokimq
@@ -31,6 +31,8 @@
 #include <array>
 #include <iterator>
 #include <cassert>
+#include <type_traits>
+#include "string_view.h"
 
 namespace lokimq {
 
@@ -53,10 +55,42 @@ struct hex_table {
     }
     constexpr char from_hex(unsigned char c) const noexcept { return from_hex_lut[c]; }
     constexpr char to_hex(unsigned char b) const noexcept { return to_hex_lut[b]; }
+    // Not a lookup in from_hex_lut: 0 there means both '0' and "not a hex digit"
+    constexpr bool is_hex(unsigned char c) const noexcept {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    }
 } constexpr hex_lut;
 
+/// True if String has contiguous storage of 1-byte values (std::string, string_view,
+/// std::array<unsigned char, N>, etc.), so that the vectorized buffer functions can be used on it.
+template <typename String, typename = void>
+struct is_contiguous_bytes : std::false_type {};
+template <typename String>
+struct is_contiguous_bytes<String, std::enable_if_t<
+        sizeof(*std::declval<const String&>().data()) == 1 &&
+        std::is_integral<std::remove_cv_t<std::remove_reference_t<decltype(*std::declval<const String&>().data())>>>::value>>
+    : std::true_type {};
+
+template <typename String>
+string_view as_bytes(const String& s) { return {reinterpret_cast<const char*>(s.data()), s.size()}; }
+
 } // namespace detail
 
+/// Writes the hex encoding of `bytes` into `out`, which must have room for `2*bytes.size()`
+/// characters, and returns a pointer just past the written characters.  This is vectorized (using
+/// AVX2 or SSSE3, if the CPU supports them) and so much faster than the iterator version for
+/// anything longer than a few bytes.
+char* to_hex(string_view bytes, char* out);
+
+/// Writes the bytes of the hex string `hex` into `out`, which must have room for `hex.size()/2`
+/// bytes, and returns a pointer just past the written bytes.  Undefined behaviour if any characters
+/// are not in [0-9a-fA-F] or if the length is not even (use `is_hex()` first if the input isn't
+/// trusted).  `out` may be `hex.data()` to decode in place.  Vectorized, like the above.
+char* from_hex(string_view hex, char* out);
+
+/// Returns true if all characters of `s` are hex digits.  Vectorized, like the above.
+bool is_hex(string_view s);
+
 /// Creates hex digits from a character sequence.
 template <typename InputIt, typename OutputIt>
 void to_hex(InputIt begin, InputIt end, OutputIt out) {
@@ -68,7 +102,7 @@ void to_hex(InputIt begin, InputIt end, OutputIt out) {
 }
 
 /// Creates a hex string from an iterable, std::string-like object
-template <typename String>
+template <typename String, std::enable_if_t<!detail::is_contiguous_bytes<String>::value, int> = 0>
 std::string to_hex(const String& s) {
     std::string hex;
     hex.reserve(s.size() * 2);
@@ -76,20 +110,34 @@ std::string to_hex(const String& s) {
     return hex;
 }
 
+/// Creates a hex string from a std::string-like object with contiguous storage (using the
+/// vectorized encoder)
+template <typename String, std::enable_if_t<detail::is_contiguous_bytes<String>::value, int> = 0>
+std::string to_hex(const String& s) {
+    std::string hex(s.size() * 2, '\0');
+    to_hex(detail::as_bytes(s), &hex[0]);
+    return hex;
+}
+
 /// Returns true if all elements in the range are hex characters
 template <typename It>
 constexpr bool is_hex(It begin, It end) {
     for (; begin != end; ++begin) {
-        if (detail::hex_lut.from_hex(*begin) == 0 && *begin != '0')
+        if (!detail::hex_lut.is_hex(*begin))
             return false;
     }
     return true;
 }
 
 /// Returns true if all elements in the string-like value are hex characters
-template <typename String>
+template <typename String, std::enable_if_t<!detail::is_contiguous_bytes<String>::value, int> = 0>
 constexpr bool is_hex(const String& s) { return is_hex(s.begin(), s.end()); }
 
+/// Same as above, for a std::string-like object with contiguous storage (using the vectorized
+/// check).
+template <typename String, std::enable_if_t<detail::is_contiguous_bytes<String>::value, int> = 0>
+bool is_hex(const String& s) { return is_hex(detail::as_bytes(s)); }
+
 /// Convert a hex digit into its numeric (0-15) value
 constexpr char from_hex_digit(unsigned char x) noexcept {
     return detail::hex_lut.from_hex(x);
@@ -114,7 +162,7 @@ void from_hex(InputIt begin, InputIt end, OutputIt out) {
 
 /// Converts hex digits from a std::string-like object into a std::string of bytes.  Undefined
 /// behaviour if any characters are not in [0-9a-fA-F] or if the input sequence length is not even.
-template <typename String>
+template <typename String, std::enable_if_t<!detail::is_contiguous_bytes<String>::value, int> = 0>
 std::string from_hex(const String& s) {
     std::string bytes;
     bytes.reserve(s.size() / 2);
@@ -122,4 +170,14 @@ std::string from_hex(const String& s) {
     return bytes;
 }
 
+/// Same as above, for a std::string-like object with contiguous storage (using the vectorized
+/// decoder).
+template <typename String, std::enable_if_t<detail::is_contiguous_bytes<String>::value, int> = 0>
+std::string from_hex(const String& s) {
+    assert(s.size() % 2 == 0);
+    std::string bytes(s.size() / 2, '\0');
+    from_hex(detail::as_bytes(s), &bytes[0]);
+    return bytes;
+}
+
 }
@@ -1,11 +1,21 @@
 #include <queue>
 #include <map>
 #include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <dirent.h>
+#include <sys/stat.h>
 extern "C" {
 #include <sodium.h>
 }
+#ifdef LOKIMQ_ZSTD
+#include <zstd.h>
+#endif
 #include "lokimq.h"
 #include "hex.h"
+#include "buffer_pool.h"
 
 namespace lokimq {
 
@@ -21,6 +31,14 @@ constexpr char ZMQ_ADDR_ZAP[] = "inproc://zeromq.zap.01";
 // This is the domain used for listening service nodes.
 constexpr const char AUTH_DOMAIN_SN[] = "loki.sn";
 
+// Prefix of the domains used for local (non-CURVE) listening addresses: the full domain has the
+// index of the address in `local_binds` appended.
+constexpr const char AUTH_DOMAIN_LOCAL[] = "loki.local.";
+
+// ZMTP metadata property we set on our sockets to advertise that we accept compressed parts.
+constexpr const char COMPRESSION_PROPERTY[] = "X-Compress";
+constexpr const char COMPRESSION_METADATA[] = "X-Compress:zstd";
+
 
 
 namespace {
@@ -30,17 +48,54 @@ extern "C" void message_buffer_destroy(void*, void* hint) {
     delete reinterpret_cast<std::string*>(hint);
 }
 
-/// Creates a message without needing to reallocate the provided string data
-zmq::message_t create_message(std::string &&data) {
-    auto *buffer = new std::string(std::move(data));
-    return zmq::message_t{&(*buffer)[0], buffer->size(), message_buffer_destroy, buffer};
-};
+/// zmq free function for messages built in a buffer_pool block
+extern "C" void pooled_buffer_release(void* data, void* hint) {
+    buffer_pool::release(data, hint);
+}
+
+// zmq stores messages up to this size inside the message itself (without allocating), so there's no
+// point in using a pooled buffer for them.
+constexpr size_t ZMQ_INLINE_SIZE = 33;
+
+// std::string data up to this size is copied into a pooled buffer (saving the allocation of the
+// std::string wrapper needed to hand the string itself over to zmq); larger strings are handed over
+// without copying.  The copy is only about break-even up to this size, and increasingly slower
+// above it (see bench/buffer_pool.cpp).
+constexpr size_t MAX_POOLED_COPY = 256;
+
+/// Creates a message of `size` bytes (to be filled in through `data`), using a pooled buffer when
+/// the size is suitable.
+zmq::message_t create_message_buffer(size_t size, char*& data) {
+    void* hint;
+    if (size > ZMQ_INLINE_SIZE) {
+        if (void* block = buffer_pool::instance().acquire(size, hint)) {
+            data = static_cast<char*>(block);
+            return zmq::message_t{block, size, pooled_buffer_release, hint};
+        }
+    }
+    zmq::message_t msg{size};
+    data = msg.data<char>();
+    return msg;
+}
 
 /// Create a message copying from a string_view
 zmq::message_t create_message(string_view data) {
-    return zmq::message_t{data.begin(), data.end()};
+    char* out;
+    auto msg = create_message_buffer(data.size(), out);
+    if (!data.empty())
+        std::memcpy(out, data.data(), data.size());
+    return msg;
 }
 
+/// Creates a message without needing to reallocate the provided string data (unless it is small
+/// enough to copy into a pooled buffer instead)
+zmq::message_t create_message(std::string &&data) {
+    if (data.size() <= MAX_POOLED_COPY)
+        return create_message(string_view{data});
+    auto *buffer = new std::string(std::move(data));
+    return zmq::message_t{&(*buffer)[0], buffer->size(), message_buffer_destroy, buffer};
+};
+
 /*
 /// Create a message that references the existing data.  In order to use this safely you need to be
 /// sure that the referenced data lasts sufficiently long, which can be tricky.
@@ -49,9 +104,15 @@ zmq::message_t create_message_reference(string_view data) {
 }
 */
 
-/// Creates a message by bt-serializing the given value (string, number, list, or dict)
+/// Creates a message by bt-serializing the given value (string, number, list, or dict) directly
+/// into the message data
 template <typename T>
-zmq::message_t create_bt_message(T&& data) { return create_message(bt_serialize(std::forward<T>(data))); }
+zmq::message_t create_bt_message(const T& data) {
+    char* out;
+    auto msg = create_message_buffer(bt_serialized_size(data), out);
+    bt_serialize_to(out, data);
+    return msg;
+}
 
 /// Sends a control message to a specific destination by prefixing the worker name (or identity)
 /// then appending the command and optional data (if non-empty).  (This is needed when sending the control message
@@ -93,6 +154,26 @@ void send_message_parts(zmq::socket_t &sock, Container &&c) {
     send_message_parts(sock, c.begin(), c.end());
 }
 
+// Like send_message_parts, but doesn't block if the socket can't currently queue the message (i.e.
+// the peer's high-water mark has been reached): returns false, having sent nothing, instead.  Once
+// the first part of a message is accepted zmq always accepts the rest.
+template <typename It>
+bool try_send_message_parts(zmq::socket_t &sock, It begin, It end) {
+    bool first = true;
+    while (begin != end) {
+        zmq::message_t &msg = *begin++;
+        auto flags = begin == end ? zmq::send_flags::none : zmq::send_flags::sndmore;
+        if (first) {
+            if (!sock.send(msg, flags | zmq::send_flags::dontwait))
+                return false;
+            first = false;
+        } else {
+            sock.send(msg, flags);
+        }
+    }
+    return true;
+}
+
 void send_routed_message(zmq::socket_t &socket, std::string route, std::string msg, std::string data = {}) {
     std::array<zmq::message_t, 3> msgs{{create_message(std::move(route)), create_message(std::move(msg))}};
     if (!data.empty())
@@ -145,16 +226,117 @@ void check_not_started(const std::thread& proxy_thread) {
         throw std::logic_error("Cannot add categories/commands/aliases after calling `start()`");
 }
 
-// Extracts and builds the "send" part of a message for proxy_send/proxy_reply
-std::list<zmq::message_t> build_send_parts(bt_dict &data, const std::string &route) {
-    std::list<zmq::message_t> parts;
+#ifdef LOKIMQ_ZSTD
+/// Compresses `data` into `out`, returning true if compression made it smaller, false otherwise.
+bool compress_part(string_view data, std::string& out) {
+    out.resize(ZSTD_compressBound(data.size()));
+    size_t len = ZSTD_compress(&out[0], out.size(), data.data(), data.size(), 1 /* fastest */);
+    if (ZSTD_isError(len) || len >= data.size())
+        return false;
+    out.resize(len);
+    return true;
+}
+#endif
+
+/// Decompresses a compressed message part into `out`.  Throws if the data isn't valid or would
+/// decompress to more than `max_size` bytes.
+void decompress_part(string_view data, std::string& out, int64_t max_size) {
+#ifdef LOKIMQ_ZSTD
+    auto size = ZSTD_getFrameContentSize(data.data(), data.size());
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+        throw std::runtime_error{"invalid compressed message part"};
+    if (max_size >= 0 && size > static_cast<uint64_t>(max_size))
+        throw std::runtime_error{"compressed message part is too large (" + std::to_string(size) + " bytes)"};
+    out.resize(size);
+    auto len = ZSTD_decompress(&out[0], out.size(), data.data(), data.size());
+    if (ZSTD_isError(len) || len != size)
+        throw std::runtime_error{"compressed message part decompression failed"};
+#else
+    (void) data; (void) out; (void) max_size;
+    throw std::runtime_error{"received a compressed message part, but compression is not supported"};
+#endif
+}
+
+/// Returns true if the peer that sent the message advertised compression support.
+bool peer_accepts_compression(const zmq::message_t& msg) {
+    try { return string_view{msg.gets(COMPRESSION_PROPERTY)} == "zstd"; } catch (...) {}
+    return false;
+}
+
+/// Sets the socket metadata that tells peers we accept compressed message parts.
+void advertise_compression(zmq::socket_t& sock) {
+#if defined(LOKIMQ_ZSTD) && ZMQ_VERSION >= ZMQ_MAKE_VERSION (4, 3, 0)
+    sock.setsockopt(ZMQ_METADATA, COMPRESSION_METADATA, sizeof(COMPRESSION_METADATA)-1);
+#else
+    (void) sock;
+#endif
+}
+
+/// Splits per-message flags off of a received command.  The command frame may contain a '\0'
+/// followed by a bt-encoded dict of flags; if present the flags are removed from `command` and
+/// returned.
+std::string split_command_flags(std::string& command) {
+    std::string flags;
+    auto pos = command.find('\0');
+    if (pos != std::string::npos) {
+        flags = command.substr(pos + 1);
+        command.resize(pos);
+    }
+    return flags;
+}
+
+/// Parses the decimal stream id argument of a STREAM* builtin command
+uint64_t parse_stream_id(string_view id) {
+    uint64_t result = detail::extract_unsigned(id);
+    if (!id.empty())
+        throw std::runtime_error{"invalid stream id"};
+    return result;
+}
+
+// Extracts and builds the "send" part of a message for proxy_send/proxy_reply.  Parts that the
+// sending thread compressed (see detail::compress_send_parts) are sent as they are, with a `z` flag
+// (see split_command_flags) indicating which parts, if `compress` is true (i.e. the peer accepts
+// compression); otherwise they are decompressed here.  A "ttl" value (from send_option::ttl)
+// becomes a `t` flag.
+message_frames build_send_parts(const bt_document &data, const std::string &route, bool compress = false) {
+    message_frames parts;
     if (!route.empty())
         parts.push_back(create_message(route));
-    for (auto &s : data.at("send").get<bt_list>())
-        parts.push_back(create_message(std::move(s.get<std::string>())));
+    auto send = data.at("send");
+    auto it = send.begin();
+    std::string cmd{(*it).string()};
+    bt_dict flags;
+    string_view compressed;
+    if (data.contains("compressed"))
+        compressed = data.at("compressed").string();
+    // The data parts are copied straight from the control message
+    size_t i = 0;
+    for (++it; it != send.end(); ++it, ++i) {
+        if (!compress && i / 8 < compressed.size() && (compressed[i / 8] >> (i % 8)) & 1) {
+            std::string part;
+            decompress_part((*it).string(), part, -1);
+            parts.push_back(create_message(std::move(part)));
+        } else {
+            parts.push_back(create_message((*it).string()));
+        }
+    }
+    if (compress && !compressed.empty())
+        flags["z"] = std::string{compressed};
+    if (data.contains("ttl"))
+        flags["t"] = get_int<int64_t>(data.at("ttl"));
+    if (!flags.empty()) {
+        cmd += '\0';
+        cmd += bt_serialize(flags);
+    }
+    parts.insert(route.empty() ? parts.begin() : std::next(parts.begin()), create_message(std::move(cmd)));
     return parts;
 }
 
+// The journal file used to spool messages for `pubkey`
+std::string spool_path(const std::string &dir, const std::string &pubkey) {
+    return dir + '/' + to_hex(pubkey) + ".spool";
+}
+
 std::string to_string(AuthLevel a) {
     switch (a) {
         case AuthLevel::denied: return "denied";
@@ -172,9 +354,10 @@ void extract_pubkey(zmq::message_t& msg, std::string& pubkey, bool& service_node
     // pubkey.
     if (pubkey_hex.size() != 66 || (pubkey_hex[0] != 'S' && pubkey_hex[0] != 'C') || pubkey_hex[1] != ':')
         throw std::logic_error("bad user-id");
-    assert(is_hex(pubkey_hex.begin() + 2, pubkey_hex.end()));
-    pubkey.reserve(32);
-    from_hex(pubkey_hex.begin() + 2, pubkey_hex.end(), std::back_inserter(pubkey));
+    string_view hex{pubkey_hex.data() + 2, 64};
+    assert(is_hex(hex));
+    pubkey.resize(32);
+    from_hex(hex, &pubkey[0]);
     service_node = pubkey_hex[0] == 'S';
 }
 
@@ -201,6 +384,31 @@ void send_control(zmq::socket_t& sock, string_view cmd, std::string data) {
     }
 }
 
+void compress_send_parts(bt_dict& control_data, size_t threshold) {
+#ifdef LOKIMQ_ZSTD
+    if (threshold == 0)
+        return;
+    auto& parts = mapbox::util::get<bt_list>(control_data["send"]);
+    std::string compressed, out;
+    size_t i = 0;
+    for (auto it = std::next(parts.begin()); it != parts.end(); ++it, ++i) {
+        if (!it->is<std::string>())
+            continue;
+        auto& part = mapbox::util::get<std::string>(*it);
+        if (part.size() >= threshold && compress_part(part, out)) {
+            part.swap(out);
+            compressed.resize(std::max(compressed.size(), i / 8 + 1));
+            compressed[i / 8] |= static_cast<char>(1 << (i % 8));
+        }
+    }
+    if (!compressed.empty())
+        control_data["compressed"] = std::move(compressed);
+#else
+    (void) control_data;
+    (void) threshold;
+#endif
+}
+
 } // namespace detail
 
 
@@ -222,7 +430,7 @@ LogLevel LokiMQ::log_level() const {
 }
 
 
-void LokiMQ::add_category(std::string name, Access access_level, unsigned int reserved_threads, int max_queue) {
+void LokiMQ::add_category(std::string name, Access access_level, unsigned int reserved_threads, int max_queue, int priority) {
     check_not_started(proxy_thread);
 
     if (name.size() > MAX_CATEGORY_LENGTH)
@@ -235,7 +443,7 @@ void LokiMQ::add_category(std::string name, Access access_level, unsigned int re
     if (it != categories.end())
         throw std::runtime_error("Unable to add category `" + name + "': that category already exists");
 
-    categories.emplace(std::move(name), category{access_level, reserved_threads, max_queue});
+    categories.emplace(std::move(name), category{access_level, reserved_threads, max_queue, priority});
 }
 
 void LokiMQ::add_command(const std::string& category, std::string name, CommandCallback callback) {
@@ -257,6 +465,39 @@ void LokiMQ::add_command(const std::string& category, std::string name, CommandC
         throw std::runtime_error("Cannot add command `" + fullname + "': that command already exists");
 }
 
+void LokiMQ::add_stream_command(const std::string& category, std::string name, CommandCallback callback, bool assemble) {
+    std::string cmd = name;
+    add_command(category, std::move(name), std::move(callback));
+    if (assemble)
+        categories.at(category).assembled_streams.insert(std::move(cmd));
+}
+
+void LokiMQ::set_max_queue_age(const std::string& category, std::chrono::milliseconds max_age) {
+    check_not_started(proxy_thread);
+
+    auto catit = categories.find(category);
+    if (catit == categories.end())
+        throw std::runtime_error("Cannot set the maximum queue age of unknown category `" + category + "'");
+    catit->second.max_age = max_age;
+}
+
+void LokiMQ::listen_local(std::string bind, LocalAllowFunc allow) {
+    check_not_started(proxy_thread);
+
+    if (!allow)
+        throw std::invalid_argument("Cannot listen on local address `" + bind + "': no allow callback given");
+    local_binds.emplace_back(std::move(bind), std::move(allow));
+}
+
+void LokiMQ::listen_local(std::string bind, std::string pubkey, Allow allow) {
+    if (pubkey.size() != 32)
+        throw std::invalid_argument("Cannot listen on local address `" + bind + "': invalid pubkey");
+    listen_local(std::move(bind), [pubkey = std::move(pubkey), allow](string_view, std::string& pk) {
+        pk = pubkey;
+        return allow;
+    });
+}
+
 void LokiMQ::add_command_alias(std::string from, std::string to) {
     check_not_started(proxy_thread);
 
@@ -334,7 +575,7 @@ LokiMQ::LokiMQ(
         unsigned int general_workers)
     : object_id{next_id++}, pubkey{std::move(pubkey_)}, privkey{std::move(privkey_)}, local_service_node{service_node},
         bind{std::move(bind_)}, peer_lookup{std::move(lookup)}, allow_connection{std::move(allow)}, logger{logger},
-        poll_remote_offset{poll_internal_size + (bind.empty() ? 0 : 1)}, general_workers{general_workers} {
+        general_workers{general_workers} {
 
     LMQ_LOG(trace, "Constructing listening LokiMQ, id=", object_id, ", this=", this);
 
@@ -372,7 +613,7 @@ void LokiMQ::start() {
     if (proxy_thread.get_id() != std::thread::id{})
         throw std::logic_error("Cannot call start() multiple times!");
 
-    LMQ_LOG(info, "Initializing LokiMQ ", bind.empty() ? "remote-only" : "listener", " with pubkey ", to_hex(pubkey));
+    LMQ_LOG(info, "Initializing LokiMQ ", bind.empty() && local_binds.empty() ? "remote-only" : "listener", " with pubkey ", to_hex(pubkey));
 
     // We bind `command` here so that the `get_control_socket()` below is always connecting to a
     // bound socket, but we do nothing else here: the proxy thread is responsible for everything
@@ -386,7 +627,7 @@ void LokiMQ::start() {
     LMQ_LOG(trace, "Sent START command");
 
     zmq::message_t ready_msg;
-    std::vector<zmq::message_t> parts;
+    message_frames parts;
     try { recv_message_parts(control, std::back_inserter(parts)); }
     catch (const zmq::error_t &e) { throw std::runtime_error("Failure reading from LokiMQ::Proxy thread: "s + e.what()); }
 
@@ -396,6 +637,33 @@ void LokiMQ::start() {
 }
 
 
+std::shared_ptr<const MessageParts> Message::take_parts() {
+    if (taken || !parts)
+        return taken;
+    taken = std::make_shared<MessageParts>();
+    auto& t = *taken;
+    t.parts.reserve(parts->size());
+    t.data.reserve(parts->size());
+    // Sized up front because t.data views into these strings (which could move, if short, if the
+    // vector reallocated)
+    if (!compressed->empty())
+        t.decompressed.resize(parts->size());
+    for (size_t i = 0; i < parts->size(); i++) {
+        // Move the messages out one at a time (rather than swapping vectors) so that the worker's
+        // vector keeps its capacity for the next job.
+        t.parts.push_back(std::move((*parts)[i]));
+        if (i / 8 < compressed->size() && ((*compressed)[i / 8] >> (i % 8)) & 1) {
+            t.decompressed[i] = std::move((*decompressed)[i]);
+            t.data.emplace_back(t.decompressed[i]);
+        } else {
+            // Note that we have to view the moved message: small messages store their data inline
+            t.data.emplace_back(t.parts[i].data<char>(), t.parts[i].size());
+        }
+    }
+    data = t.data;
+    return taken;
+}
+
 void LokiMQ::worker_thread(unsigned int index) {
     std::string worker_id = "w" + std::to_string(index);
     zmq::socket_t sock{context, zmq::socket_type::dealer};
@@ -408,19 +676,43 @@ void LokiMQ::worker_thread(unsigned int index) {
     sock.connect(SN_ADDR_WORKERS);
 
     Message message{*this};
-    std::vector<zmq::message_t> parts;
+    message_frames parts;
+    std::vector<std::string> decompressed; // Reused buffers for decompressed message parts
     run_info& run = workers[index]; // This is our first job, and will be updated later with subsequent jobs
 
     while (true) {
         try {
-            message.pubkey = {run.pubkey.data(), 32};
-            message.service_node = run.service_node;
-            message.data.clear();
-            for (auto& m : run.message_parts)
-                message.data.emplace_back(m.data<char>(), m.size());
+            if (run.job) {
+                LMQ_LOG(trace, "worker thread ", worker_id, " running internal job");
+                run.job();
+            } else {
+                message.pubkey = {run.pubkey.data(), 32};
+                message.service_node = run.service_node;
+                message.route = run.route;
+                message.deadline = run.deadline;
+                message.stream = run.stream;
+                message.parts = &run.message_parts;
+                message.decompressed = &decompressed;
+                message.compressed = &run.compressed;
+                message.taken.reset();
+                message.data.clear();
+                // Size the buffers before viewing any of them: growing the vector later could move
+                // (short, inline) strings that message.data already points into.
+                if (!run.compressed.empty() && decompressed.size() < run.message_parts.size())
+                    decompressed.resize(run.message_parts.size());
+                for (size_t i = 0; i < run.message_parts.size(); i++) {
+                    auto& m = run.message_parts[i];
+                    if (i / 8 < run.compressed.size() && (run.compressed[i / 8] >> (i % 8)) & 1) {
+                        decompress_part(view(m), decompressed[i], MAX_DECOMPRESSED_SIZE);
+                        message.data.emplace_back(decompressed[i]);
+                    } else {
+                        message.data.emplace_back(m.data<char>(), m.size());
+                    }
+                }
 
-            LMQ_LOG(trace, "worker thread ", worker_id, " invoking ", run.command, " callback with ", message.data.size(), " message parts");
-            (*run.callback)(message);
+                LMQ_LOG(trace, "worker thread ", worker_id, " invoking ", run.command, " callback with ", message.data.size(), " message parts");
+                (*run.callback)(message);
+            }
 
             /*
              * FIXME: BYE should be handled by the proxy thread, not the worker.
@@ -518,6 +810,7 @@ void LokiMQ::proxy_quit() {
         proxy_shutting_down = true; // To prevent threads from opening new control sockets
     }
     workers_socket.close();
+    zap_auth.close();
     int linger = std::chrono::milliseconds{CLOSE_LINGER}.count();
     if (listener.connected()) {
         listener.setsockopt(ZMQ_LINGER, linger);
@@ -588,6 +881,8 @@ LokiMQ::proxy_connect(const std::string &remote, const std::string &connect_hint
     socket.setsockopt(ZMQ_CURVE_SECRETKEY, privkey.data(), privkey.size());
     socket.setsockopt(ZMQ_HANDSHAKE_IVL, SN_HANDSHAKE_TIME);
     socket.setsockopt<int64_t>(ZMQ_MAXMSGSIZE, SN_ZMQ_MAX_MSG_SIZE);
+    if (COMPRESS_THRESHOLD > 0)
+        advertise_compression(socket);
 #if ZMQ_VERSION >= ZMQ_MAKE_VERSION (4, 3, 0)
     socket.setsockopt(ZMQ_ROUTING_ID, pubkey.data(), pubkey.size());
 #else
@@ -595,54 +890,83 @@ LokiMQ::proxy_connect(const std::string &remote, const std::string &connect_hint
 #endif
     socket.connect(addr);
     peer.idle_expiry = keep_alive;
+    peer.established = false;
+    // Queued until the connection completes; the HELLO reply tells us when the handshake is done.
+    send_direct_message(socket, "HI");
 
     add_pollitem(socket);
     peer.outgoing = remotes.size();
     remotes.emplace_back(remote, std::move(socket));
-    peer.service_node = true;
+    peer.service_node = sn_set_managed ? active_service_nodes.count(remote) > 0 : true;
     peer.activity();
 
     result.first = &remotes.back().second;
     return result;
 }
 
-std::pair<zmq::socket_t *, std::string> LokiMQ::proxy_connect(bt_dict &&data) {
-    auto remote_pubkey = data.at("pubkey").get<std::string>();
+std::pair<zmq::socket_t *, std::string> LokiMQ::proxy_connect(const bt_document &data) {
+    std::string remote_pubkey{data.at("pubkey").string()};
     std::chrono::milliseconds keep_alive{get_int<int>(data.at("keep-alive"))};
     std::string hint;
-    auto hint_it = data.find("hint");
-    if (hint_it != data.end())
-        hint = data.at("hint").get<std::string>();
+    if (data.contains("hint"))
+        hint = std::string{data.at("hint").string()};
 
     bool optional = data.count("optional"), incoming = data.count("incoming");
 
     return proxy_connect(remote_pubkey, hint, optional, incoming, keep_alive);
 }
 
-void LokiMQ::proxy_send(bt_dict &&data) {
-    const auto &remote_pubkey = data.at("pubkey").get<std::string>();
+void LokiMQ::proxy_send(const bt_document &data) {
+    std::string remote_pubkey{data.at("pubkey").string()};
     std::string hint;
-    auto hint_it = data.find("hint");
-    if (hint_it != data.end())
-        hint = hint_it->second.get<std::string>();
+    if (data.contains("hint"))
+        hint = std::string{data.at("hint").string()};
 
-    auto idle_it = data.find("keep-alive");
-    std::chrono::milliseconds keep_alive = idle_it != data.end()
-        ? std::chrono::milliseconds{get_int<uint64_t>(idle_it->second)}
+    std::chrono::milliseconds keep_alive = data.contains("keep-alive")
+        ? std::chrono::milliseconds{get_int<uint64_t>(data.at("keep-alive"))}
         : DEFAULT_SEND_KEEP_ALIVE;
 
     bool optional = data.count("optional"), incoming = data.count("incoming");
 
+    if (remote_pubkey == pubkey)
+        return proxy_send_self(data);
+
+    // Strong sends get spooled (if enabled) rather than dropped when the remote can't take them
+    // right now; if there are already spooled messages then this one has to wait behind them.
+    bool spool = !optional && !incoming && !SPOOL_DIR.empty();
+    if (spool) {
+        auto it = spools.find(remote_pubkey);
+        if (it != spools.end() && !proxy_drain_spool(it, hint))
+            return proxy_spool(remote_pubkey, data);
+    }
+
     auto sock_route = proxy_connect(remote_pubkey, hint, optional, incoming, keep_alive);
     if (!sock_route.first) {
         if (optional)
             LMQ_LOG(debug, "Not sending: send is optional and no connection to ", to_hex(remote_pubkey), " is currently established");
-        else
+        else if (spool) {
+            LMQ_LOG(debug, "No connection to ", to_hex(remote_pubkey), " could be established; spooling message");
+            proxy_spool(remote_pubkey, data);
+        } else
             LMQ_LOG(error, "Unable to send to ", to_hex(remote_pubkey), ": no connection could be established");
         return;
     }
+    if (spool && !proxy_route_established(sock_route.first, remote_pubkey)) {
+        // zmq would queue the message for a remote that may never come up (and lose it if we
+        // exit), so spool it until the handshake completes (the HELLO reply drains the spool).
+        LMQ_LOG(debug, "Connection to ", to_hex(remote_pubkey), " is not yet established; spooling message");
+        return proxy_spool(remote_pubkey, data);
+    }
     try {
-        send_message_parts(*sock_route.first, build_send_parts(data, sock_route.second));
+        auto peer = peers.find(remote_pubkey);
+        bool compress = peer != peers.end() && peer->second.compress;
+        auto parts = build_send_parts(data, sock_route.second, compress);
+        if (!spool)
+            send_message_parts(*sock_route.first, parts);
+        else if (!try_send_message_parts(*sock_route.first, parts.begin(), parts.end())) {
+            LMQ_LOG(debug, "Send queue to ", to_hex(remote_pubkey), " is full; spooling message");
+            proxy_spool(remote_pubkey, data);
+        }
     } catch (const zmq::error_t &e) {
         if (e.num() == EHOSTUNREACH && sock_route.first == &listener && !sock_route.second.empty()) {
             // We *tried* to route via the incoming connection but it is no longer valid.  Drop it,
@@ -650,14 +974,173 @@ void LokiMQ::proxy_send(bt_dict &&data) {
             auto &peer = peers[remote_pubkey];
             peer.incoming.clear(); // Don't worry about cleaning the map entry if outgoing is also < 0: that will happen at the next idle cleanup
             LMQ_LOG(debug, "Could not route back to SN ", to_hex(remote_pubkey), " via listening socket; trying via new outgoing connection");
-            return proxy_send(std::move(data));
+            return proxy_send(data);
         }
         LMQ_LOG(warn, "Unable to send message to remote SN ", to_hex(remote_pubkey), ": ", e.what());
     }
 }
 
-void LokiMQ::proxy_reply(bt_dict &&data) {
-    const auto &route = data.at("route").get<std::string>();
+void LokiMQ::proxy_open_spools() {
+    if (mkdir(SPOOL_DIR.c_str(), 0700) != 0 && errno != EEXIST) {
+        LMQ_LOG(error, "Unable to create spool directory ", SPOOL_DIR, ": ", std::strerror(errno));
+        return;
+    }
+    DIR *dir = opendir(SPOOL_DIR.c_str());
+    if (!dir) {
+        LMQ_LOG(error, "Unable to read spool directory ", SPOOL_DIR, ": ", std::strerror(errno));
+        return;
+    }
+    while (auto *ent = readdir(dir)) {
+        string_view name{ent->d_name};
+        if (name.size() != 64 + 6)
+            continue;
+        string_view hex{name.data(), 64}, suffix{name.data() + 64, 6};
+        if (suffix != ".spool" || !is_hex(hex))
+            continue;
+        auto remote = from_hex(hex);
+        auto path = spool_path(SPOOL_DIR, remote);
+        try {
+            auto journal = std::make_unique<spool_journal>(path, SPOOL_MAX_SIZE);
+            if (journal->empty()) {
+                journal.reset();
+                std::remove(path.c_str());
+                continue;
+            }
+            LMQ_LOG(info, "Resuming spool of ", journal->size(), " message(s) for ", to_hex(remote));
+            spools.emplace(std::move(remote), std::move(journal));
+        } catch (const std::exception &e) {
+            LMQ_LOG(error, "Unable to open spool journal: ", e.what());
+        }
+    }
+    closedir(dir);
+}
+
+void LokiMQ::proxy_spool(const std::string &pubkey, const bt_document &data) {
+    auto it = spools.find(pubkey);
+    if (it == spools.end()) {
+        try {
+            it = spools.emplace(pubkey, std::make_unique<spool_journal>(spool_path(SPOOL_DIR, pubkey), SPOOL_MAX_SIZE)).first;
+        } catch (const std::exception &e) {
+            LMQ_LOG(error, "Unable to spool message for ", to_hex(pubkey), ": ", e.what());
+            return;
+        }
+    }
+
+    // Spooled messages are stored uncompressed because we don't know whether the connection we
+    // eventually deliver them over will support compression.
+    auto frames = build_send_parts(data, ""s);
+    std::vector<string_view> parts;
+    parts.reserve(frames.size());
+    for (auto &f : frames)
+        parts.push_back(view(f));
+
+    auto max_age = SPOOL_MAX_AGE;
+    if (data.contains("ttl"))
+        max_age = std::min(max_age, std::chrono::milliseconds{get_int<int64_t>(data.at("ttl"))});
+    auto &journal = *it->second;
+    auto dropped = journal.dropped();
+    if (!journal.append(parts, spool_journal::clock::now() + max_age))
+        LMQ_LOG(warn, "Unable to spool message for ", to_hex(pubkey), ": message is larger than SPOOL_MAX_SIZE");
+    else if (journal.dropped() > dropped)
+        LMQ_LOG(warn, "Spool for ", to_hex(pubkey), " is full; dropped ", journal.dropped() - dropped, " oldest message(s)");
+}
+
+bool LokiMQ::proxy_drain_spool(decltype(spools)::iterator it, const std::string &connect_hint) {
+    const auto &remote = it->first;
+    auto &journal = *it->second;
+    std::vector<string_view> parts;
+    if (journal.front(parts)) {
+        auto sock_route = proxy_connect(remote, connect_hint, false, false, DEFAULT_SEND_KEEP_ALIVE);
+        if (!sock_route.first || !proxy_route_established(sock_route.first, remote))
+            return false;
+        size_t sent = 0;
+        try {
+            do {
+                message_frames msgs;
+                if (!sock_route.second.empty())
+                    msgs.push_back(create_message(sock_route.second));
+                for (auto &part : parts)
+                    msgs.push_back(create_message(part));
+                if (!try_send_message_parts(*sock_route.first, msgs.begin(), msgs.end())) {
+                    LMQ_LOG(debug, "Sent ", sent, " spooled message(s) to ", to_hex(remote), "; ", journal.size(), " remain spooled");
+                    return false;
+                }
+                journal.pop();
+                sent++;
+            } while (journal.front(parts));
+        } catch (const zmq::error_t &e) {
+            if (e.num() == EHOSTUNREACH && sock_route.first == &listener)
+                // The incoming route is gone; drop it so that the next attempt reconnects
+                peers[remote].incoming.clear();
+            LMQ_LOG(debug, "Unable to send spooled messages to ", to_hex(remote), ": ", e.what());
+            return false;
+        }
+        LMQ_LOG(info, "Sent all ", sent, " spooled message(s) to ", to_hex(remote));
+    }
+
+    auto path = journal.path();
+    spools.erase(it);
+    std::remove(path.c_str());
+    return true;
+}
+
+bool LokiMQ::proxy_route_established(const zmq::socket_t* sock, const std::string &pubkey) {
+    if (sock == &listener)
+        return true;
+    auto it = peers.find(pubkey);
+    return it != peers.end() && it->second.established;
+}
+
+void LokiMQ::proxy_process_spools() {
+    for (auto it = spools.begin(); it != spools.end(); ) {
+        auto next = std::next(it);
+        proxy_drain_spool(it);
+        it = next;
+    }
+    last_spool_attempt = std::chrono::steady_clock::now();
+}
+
+void LokiMQ::proxy_send_self(const bt_document &data) {
+    auto send = data.at("send");
+    auto it = send.begin();
+    category::pending_command cmd;
+    cmd.command = std::string{(*it).string()};
+    auto cat_call = get_command(cmd.command);
+    if (!cat_call.first) {
+        LMQ_LOG(warn, "Unable to send ", cmd.command, " to ourself: unknown command");
+        return;
+    }
+    auto& category = *cat_call.first;
+    if (category.access.local_sn && !local_service_node) {
+        LMQ_LOG(warn, "Unable to send ", cmd.command, " to ourself: that command is only available in service node mode");
+        return;
+    }
+    if (category.access.remote_sn && !local_service_node) {
+        LMQ_LOG(warn, "Unable to send ", cmd.command, " to ourself: we are not a service node");
+        return;
+    }
+
+    // We are always allowed to invoke our own commands; replies (which go to our own pubkey) come
+    // back through here as well.
+    LMQ_LOG(trace, "Invoking ", cmd.command, " sent to ourself without a connection");
+    cmd.pubkey = pubkey;
+    cmd.service_node = local_service_node;
+    cmd.callback = cat_call.second;
+    cmd.deadline = std::chrono::steady_clock::time_point::max();
+    if (data.contains("ttl"))
+        cmd.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds{get_int<int64_t>(data.at("ttl"))};
+    cmd.parts.reserve(send.size() - 1);
+    for (++it; it != send.end(); ++it)
+        cmd.parts.push_back(create_message((*it).string()));
+    // Any parts compressed by the sending thread get decompressed by the worker
+    if (data.contains("compressed"))
+        cmd.compressed = std::string{data.at("compressed").string()};
+
+    proxy_queue_command(category, std::move(cmd));
+}
+
+void LokiMQ::proxy_reply(const bt_document &data) {
+    std::string route{data.at("route").string()};
     assert(!route.empty());
     if (!listener.connected()) {
         LMQ_LOG(error, "Internal error: proxy_reply called but that shouldn't be possible as we have no listener!");
@@ -665,9 +1148,21 @@ void LokiMQ::proxy_reply(bt_dict &&data) {
     }
 
     try {
-        send_message_parts(listener, build_send_parts(data, route));
+        // The route of an incoming connection is the remote's pubkey
+        auto peer = peers.find(route);
+        bool compress = peer != peers.end() && peer->second.compress;
+        send_message_parts(listener, build_send_parts(data, route, compress));
     } catch (const zmq::error_t &err) {
-        if (err.num() == EHOSTUNREACH) {
+        if (err.num() == EHOSTUNREACH && data.count("pubkey") && !data.count("optional")) {
+            // A deferred reply to a SN that has since disconnected: fall back to a regular send
+            // (which will reconnect).
+            std::string remote{data.at("pubkey").string()};
+            auto peer = peers.find(remote);
+            if (peer != peers.end() && peer->second.incoming == route)
+                peer->second.incoming.clear();
+            LMQ_LOG(debug, "Could not route reply back to SN ", to_hex(remote), " via listening socket; trying via new outgoing connection");
+            return proxy_send(data);
+        } else if (err.num() == EHOSTUNREACH) {
             LMQ_LOG(info, "Unable to send reply to incoming non-SN request: remote is no longer connected");
         } else {
             LMQ_LOG(warn, "Unable to send reply to incoming non-SN request: ", err.what());
@@ -675,14 +1170,14 @@ void LokiMQ::proxy_reply(bt_dict &&data) {
     }
 }
 
-void LokiMQ::proxy_control_message(std::vector<zmq::message_t> parts) {
-    if (parts.size() < 2 || parts.size() > 3)
+void LokiMQ::proxy_control_message(message_frames parts) {
+    // STREAM_DATA is the one control message with a 4th part: the (raw) stream chunk
+    if (parts.size() < 2 || parts.size() > 4 || (parts.size() == 4 && view(parts[1]) != "STREAM_DATA"))
         throw std::logic_error("Expected 2-3 message parts for a proxy control message");
     auto route = view(parts[0]), cmd = view(parts[1]);
-    bt_dict data;
-    if (parts.size() > 2) {
-        bt_deserialize(view(parts[2]), data);
-    }
+    // The data views into parts[2], which stays alive until we return
+    auto& data = control_data;
+    data.parse(parts.size() > 2 ? view(parts[2]) : string_view{"de"});
     LMQ_LOG(trace, "control message: ", cmd);
     if (cmd == "START") {
         // Command send by the owning thread during startup; we send back a simple READY reply to
@@ -697,15 +1192,27 @@ void LokiMQ::proxy_control_message(std::vector<zmq::message_t> parts) {
             route_control(workers_socket, workers[route].routing_id, "QUIT");
         idle_workers.clear();
     } else if (cmd == "CONNECT") {
-        proxy_connect(std::move(data));
+        proxy_connect(data);
     } else if (cmd == "DISCONNECT") {
-        proxy_disconnect(data.at("pubkey").get<std::string>());
+        proxy_disconnect(std::string{data.at("pubkey").string()});
     } else if (cmd == "SEND") {
-        LMQ_LOG(trace, "proxying message to ", to_hex(data.at("pubkey").get<std::string>()));
-        proxy_send(std::move(data));
+        LMQ_LOG(trace, "proxying message to ", to_hex(data.at("pubkey").string()));
+        proxy_send(data);
     } else if (cmd == "REPLY") {
         LMQ_LOG(trace, "proxying reply to non-SN incoming message");
-        proxy_reply(std::move(data));
+        proxy_reply(data);
+    } else if (cmd == "STREAM_OPEN") {
+        proxy_stream_open(data);
+    } else if (cmd == "STREAM_DATA" && parts.size() == 4) {
+        proxy_stream_data(data, parts[3]);
+    } else if (cmd == "JOB") {
+        proxy_queue_job(data);
+    } else if (cmd == "AUTH_CACHE") {
+        proxy_auth_cache_invalidate(data);
+    } else if (cmd == "PERSIST") {
+        proxy_set_persistent(data);
+    } else if (cmd == "UPDATE_SNS") {
+        proxy_update_service_nodes(data);
     } else {
         throw std::runtime_error("Proxy received invalid control command: " + std::string{cmd} +
                 " (" + std::to_string(parts.size()) + ")");
@@ -727,6 +1234,10 @@ auto LokiMQ::proxy_close_outgoing(decltype(peers)::iterator it) -> decltype(it)
                 --p.second.outgoing;
 
         info.outgoing = -1;
+        if (!info.established)
+            // Closed before the handshake finished: it failed as far as persistent groups care
+            proxy_handshake_done(peer.first);
+        info.established = false;
     }
 
     if (info.incoming.empty())
@@ -748,8 +1259,12 @@ void LokiMQ::proxy_disconnect(const std::string &remote) {
 void LokiMQ::proxy_expire_idle_peers() {
     for (auto it = peers.begin(); it != peers.end(); ) {
         auto &info = it->second;
+        if (info.persistent > 0) { // Persistent group members never expire
+            ++it;
+            continue;
+        }
         if (info.outgoing >= 0) {
-            auto idle = info.last_activity - std::chrono::steady_clock::now();
+            auto idle = std::chrono::steady_clock::now() - info.last_activity;
             if (idle <= info.idle_expiry) {
                 ++it;
                 continue;
@@ -763,8 +1278,458 @@ void LokiMQ::proxy_expire_idle_peers() {
     }
 }
 
+void LokiMQ::proxy_set_persistent(const bt_document& data) {
+    std::string name{data.at("group").string()};
+    std::chrono::milliseconds keep_alive{get_int<int64_t>(data.at("keep-alive"))};
+    std::unique_ptr<ReadyCallback> on_ready;
+    if (data.contains("ready"))
+        on_ready.reset(reinterpret_cast<ReadyCallback*>(get_int<uintptr_t>(data.at("ready"))));
+
+    std::unordered_set<std::string, pk_hash> members;
+    for (auto pk : data.at("pubkeys"))
+        members.insert(std::string{pk.string()});
+
+    auto& group = peer_groups[name];
+
+    // Release any members that were dropped from the group; their connections now expire normally
+    // once idle (if they aren't also in some other group).
+    for (auto& pk : group.members) {
+        if (members.count(pk))
+            continue;
+        auto it = peers.find(pk);
+        if (it != peers.end() && it->second.persistent > 0 && --it->second.persistent == 0)
+            it->second.activity(); // Start the idle timer from when it left the group
+    }
+
+    group.pending.clear();
+    group.on_ready = on_ready ? std::move(*on_ready) : nullptr;
+    group.ready_deadline = std::chrono::steady_clock::now() + SN_HANDSHAKE_TIME;
+
+    LMQ_LOG(debug, "Updating persistent peer group ", name, " with ", members.size(), " members");
+    for (auto& pk : members) {
+        auto& peer = peers[pk];
+        if (!group.members.count(pk))
+            ++peer.persistent;
+
+        // This returns immediately: zmq connects and handshakes in the background, so the new
+        // connections all proceed in parallel.
+        auto sock = proxy_connect(pk, ""s, false, false, keep_alive);
+        if (!sock.first) {
+            LMQ_LOG(warn, "Unable to connect to persistent group ", name, " member ", to_hex(pk));
+            continue;
+        }
+        if (!peer.established && peer.incoming.empty())
+            group.pending.insert(pk);
+    }
+    group.members = std::move(members);
+
+    proxy_check_group_ready(group);
+    if (group.members.empty())
+        peer_groups.erase(name);
+}
+
+void LokiMQ::proxy_update_service_nodes(const bt_document& data) {
+    size_t changed = 0;
+    if (!sn_set_managed) {
+        // The first update: until now SN status came from the AllowFunc, so every existing peer has
+        // to be rechecked against the (full) list rather than just the ones it names.
+        sn_set_managed = true;
+        for (auto pk : data.at("added"))
+            active_service_nodes.emplace(pk.string());
+        for (auto pk : data.at("removed"))
+            active_service_nodes.erase(std::string{pk.string()});
+        for (auto& p : peers) {
+            bool sn = active_service_nodes.count(p.first) > 0;
+            if (p.second.service_node != sn) {
+                p.second.service_node = sn;
+                changed++;
+            }
+        }
+    } else {
+        for (auto pk : data.at("added")) {
+            std::string pubkey{pk.string()};
+            auto it = peers.find(pubkey);
+            if (it != peers.end() && !it->second.service_node) {
+                it->second.service_node = true;
+                changed++;
+            }
+            active_service_nodes.insert(std::move(pubkey));
+        }
+        for (auto pk : data.at("removed")) {
+            std::string pubkey{pk.string()};
+            auto it = peers.find(pubkey);
+            if (it != peers.end() && it->second.service_node) {
+                it->second.service_node = false;
+                changed++;
+            }
+            active_service_nodes.erase(pubkey);
+        }
+    }
+    LMQ_LOG(debug, "Updated active service node list (", active_service_nodes.size(), " SNs); ",
+            changed, " connected peer(s) changed SN status");
+}
+
+void LokiMQ::proxy_handshake_done(const std::string& pubkey) {
+    for (auto& g : peer_groups)
+        if (g.second.pending.erase(pubkey))
+            proxy_check_group_ready(g.second);
+}
+
+void LokiMQ::proxy_expire_group_handshakes() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto& g : peer_groups) {
+        auto& group = g.second;
+        if (!group.on_ready || group.pending.empty() || now < group.ready_deadline)
+            continue;
+        LMQ_LOG(warn, "Persistent peer group ", g.first, ": ", group.pending.size(),
+                " member(s) did not complete their handshake in time");
+        group.pending.clear();
+        proxy_check_group_ready(group);
+    }
+}
+
+void LokiMQ::proxy_check_group_ready(peer_group& group) {
+    if (!group.pending.empty() || !group.on_ready)
+        return;
+    auto on_ready = std::move(group.on_ready);
+    group.on_ready = nullptr;
+    try {
+        on_ready();
+    } catch (const std::exception& e) {
+        LMQ_LOG(warn, "Persistent peer group ready callback raised an exception: ", e.what());
+    }
+}
+
+void LokiMQ::proxy_stream_open(const bt_document& data) {
+    std::unique_ptr<StreamProducer> producer{reinterpret_cast<StreamProducer*>(
+            static_cast<uintptr_t>(get_int<int64_t>(data.at("producer"))))};
+    std::string remote{data.at("pubkey").string()};
+    std::string cmd{data.at("command").string()};
+    bool optional = data.count("optional");
+
+    if (!optional && !proxy_connect(remote, "", false, false, DEFAULT_SEND_KEEP_ALIVE).first) {
+        LMQ_LOG(error, "Unable to open stream to ", to_hex(remote), ": no connection could be established");
+        return;
+    }
+
+    uint64_t id = next_stream_id++;
+    if (!proxy_send_builtin(remote, {"STREAM", std::to_string(id), cmd})) {
+        if (optional)
+            LMQ_LOG(debug, "Not opening stream: stream is optional and no connection to ", to_hex(remote), " is currently established");
+        else
+            LMQ_LOG(error, "Unable to open stream to ", to_hex(remote), ": send failed");
+        return;
+    }
+    LMQ_LOG(debug, "Opened stream ", id, " to ", to_hex(remote), " for ", cmd);
+
+    auto& s = outgoing_streams[id];
+    s.pubkey = remote;
+    s.optional = optional;
+    s.producer = std::move(producer);
+    s.last_activity = std::chrono::steady_clock::now();
+    // Nothing gets produced until the remote accepts the stream by granting us some credit.
+}
+
+void LokiMQ::proxy_stream_data(const bt_document& data, zmq::message_t& chunk) {
+    uint64_t id = get_int<uint64_t>(data.at("id"));
+    auto it = outgoing_streams.find(id);
+    if (it == outgoing_streams.end())
+        return; // Expired or cancelled while the producer was running
+    auto& s = it->second;
+    s.producing = false;
+    if (data.count("error")) {
+        proxy_send_builtin(s.pubkey, {"STREAM_ABORT", std::to_string(id)});
+        outgoing_streams.erase(it);
+        return;
+    }
+    s.queued.push(chunk.to_string());
+    s.finished = data.count("end");
+    s.last_activity = std::chrono::steady_clock::now();
+    proxy_stream_send(id, s);
+}
+
+bool LokiMQ::proxy_stream_send(uint64_t id, outgoing_stream& s) {
+    auto sid = std::to_string(id);
+    for (; s.credits > 0 && !s.queued.empty(); --s.credits) {
+        bool last = s.finished && s.queued.size() == 1;
+        if (!proxy_send_builtin(s.pubkey, {last ? "STREAM_LAST" : "STREAM_DATA", sid, std::move(s.queued.front())})) {
+            LMQ_LOG(warn, "Dropping stream ", id, " to ", to_hex(s.pubkey), ": connection lost");
+            outgoing_streams.erase(id);
+            return false;
+        }
+        s.queued.pop();
+    }
+    if (s.finished && s.queued.empty()) {
+        LMQ_LOG(debug, "Finished sending stream ", id, " to ", to_hex(s.pubkey));
+        outgoing_streams.erase(id);
+        return false;
+    }
+    return true;
+}
+
+void LokiMQ::proxy_stream_builtin(size_t conn_index, const std::string& pubkey, string_view cmd,
+        message_frames& parts, size_t first_arg) {
+    if (parts.size() < first_arg + 1)
+        throw std::runtime_error{"missing stream id"};
+    auto sid = parts[first_arg].to_string();
+    uint64_t id = parse_stream_id(sid);
+    auto now = std::chrono::steady_clock::now();
+
+    if (cmd == "STREAM_CREDIT" || cmd == "STREAM_CANCEL") {
+        // Sent by the receiver of one of our outgoing streams
+        auto it = outgoing_streams.find(id);
+        if (it == outgoing_streams.end() || it->second.pubkey != pubkey)
+            return;
+        auto& s = it->second;
+        if (cmd == "STREAM_CANCEL") {
+            LMQ_LOG(debug, "Stream ", id, " cancelled by ", to_hex(pubkey));
+            outgoing_streams.erase(it);
+            return;
+        }
+        if (parts.size() < first_arg + 2)
+            throw std::runtime_error{"missing credit amount"};
+        s.credits += detail::extract_unsigned(view(parts[first_arg + 1]));
+        s.last_activity = now;
+        proxy_stream_send(id, s);
+        return;
+    }
+
+    std::string key = pubkey + sid;
+    if (cmd == "STREAM") {
+        if (parts.size() < first_arg + 2)
+            throw std::runtime_error{"missing stream command"};
+        std::string command = parts[first_arg + 1].to_string();
+        auto cat_call = get_command(command);
+        if (!cat_call.first || !proxy_check_auth(pubkey, conn_index, proxy_lookup_peer(pubkey, false), command, *cat_call.first, parts.back())) {
+            proxy_send_builtin(pubkey, {"STREAM_CANCEL", sid});
+            return;
+        }
+        if (incoming_streams.count(key))
+            throw std::runtime_error{"duplicate stream id " + sid};
+        auto& s = incoming_streams[key];
+        s.pubkey = pubkey;
+        s.id = id;
+        s.cat = cat_call.first;
+        s.callback = cat_call.second;
+        s.assemble = cat_call.first->assembled_streams.count(command.substr(command.find('.') + 1)) > 0;
+        s.command = std::move(command);
+        s.last_activity = now;
+        LMQ_LOG(debug, "Accepted ", s.assemble ? "assembled " : "", "stream ", id, " from ", to_hex(pubkey), " for ", s.command);
+        s.credit = STREAM_WINDOW;
+        proxy_send_builtin(pubkey, {"STREAM_CREDIT", sid, std::to_string(STREAM_WINDOW)});
+        return;
+    }
+
+    auto it = incoming_streams.find(key);
+    if (it == incoming_streams.end()) {
+        if (cmd != "STREAM_ABORT")
+            proxy_send_builtin(pubkey, {"STREAM_CANCEL", sid});
+        return;
+    }
+    auto& s = it->second;
+    if (cmd == "STREAM_ABORT") {
+        LMQ_LOG(debug, "Stream ", id, " from ", to_hex(pubkey), " aborted by the sender");
+        if (s.busy)
+            s.cat = nullptr; // Still running; just stop handing out chunks until the worker is done
+        else
+            incoming_streams.erase(it);
+        return;
+    }
+    if (cmd != "STREAM_DATA" && cmd != "STREAM_LAST")
+        throw std::runtime_error{"unknown stream command"};
+    if (parts.size() < first_arg + 2)
+        throw std::runtime_error{"missing stream data"};
+    if (s.ended)
+        throw std::runtime_error{"data received after end of stream"};
+
+    // Chunks are handled here, as they are read, rather than going through the peer's inbound queue
+    // so these limits are all that bounds the memory a sender can make us hold.
+    auto& chunk = parts[first_arg + 1];
+    const char* error = nullptr;
+    if (s.credit == 0)
+        error = "stream chunk sent without credit";
+    else if (s.assemble && s.size + static_cast<int64_t>(chunk.size()) > MAX_STREAM_SIZE)
+        error = "stream exceeds MAX_STREAM_SIZE";
+    if (error) {
+        LMQ_LOG(warn, "Cancelling stream ", id, " from ", to_hex(pubkey), ": ", error);
+        proxy_send_builtin(pubkey, {"STREAM_CANCEL", sid, error});
+        if (s.busy) {
+            // A worker still has a chunk; stop handing out chunks until it is done (see STREAM_ABORT)
+            s.cat = nullptr;
+            s.chunks = {};
+        } else {
+            incoming_streams.erase(it);
+        }
+        return;
+    }
+    --s.credit;
+    if (s.assemble)
+        s.size += chunk.size();
+    s.chunks.push(std::move(chunk));
+    s.ended = cmd == "STREAM_LAST";
+    s.last_activity = now;
+    // An assembled stream just accumulates (up to MAX_STREAM_SIZE) so we can grant more credit
+    // right away; otherwise credit is granted as chunks get handed off to workers (in
+    // proxy_process_streams).
+    if (s.assemble && !s.ended) {
+        ++s.credit;
+        proxy_send_builtin(pubkey, {"STREAM_CREDIT", sid, "1"});
+    }
+}
+
+void LokiMQ::proxy_process_streams() {
+    for (auto& os : outgoing_streams) {
+        auto& s = os.second;
+        if (s.producing || s.finished || s.queued.size() >= s.credits)
+            continue;
+        if (!proxy_can_work(nullptr))
+            break;
+        s.producing = true;
+        auto& run = get_idle_worker();
+        run.cat = nullptr;
+        run.stream_key.clear();
+        run.job = [this, id = os.first, producer = s.producer] {
+            std::string chunk;
+            bt_dict result{{"id", static_cast<int64_t>(id)}};
+            try {
+                if (!(*producer)(chunk))
+                    result["end"] = 1;
+            } catch (const std::exception& e) {
+                LMQ_LOG(warn, "Stream ", id, " producer raised an exception: ", e.what());
+                result["error"] = 1;
+                chunk.clear();
+            }
+            auto& control = get_control_socket();
+            auto c = create_message("STREAM_DATA"s), d = create_bt_message(std::move(result)), m = create_message(std::move(chunk));
+            control.send(c, zmq::send_flags::sndmore);
+            control.send(d, zmq::send_flags::sndmore);
+            control.send(m, zmq::send_flags::none);
+        };
+        proxy_run_worker(run);
+    }
+
+    for (auto it = incoming_streams.begin(); it != incoming_streams.end(); ) {
+        auto& s = it->second;
+        if (!s.cat) { // Aborted
+            if (s.busy) ++it;
+            else it = incoming_streams.erase(it);
+            continue;
+        }
+        if (s.busy || s.chunks.empty() || (s.assemble && !s.ended) || !proxy_can_work(s.cat)) {
+            ++it;
+            continue;
+        }
+        auto& run = get_idle_worker();
+        run.command = s.command;
+        run.callback = s.callback;
+        run.cat = s.cat;
+        run.job = nullptr;
+        run.compressed.clear();
+        run.deadline = std::chrono::steady_clock::time_point::max();
+        run.pubkey = s.pubkey;
+        run.route.clear();
+        auto peer = peers.find(s.pubkey);
+        run.service_node = peer != peers.end() && peer->second.service_node;
+        run.message_parts.clear();
+        if (s.assemble) {
+            run.stream = {s.id, s.chunks.size(), true};
+            run.stream_key.clear();
+            for (; !s.chunks.empty(); s.chunks.pop())
+                run.message_parts.push_back(std::move(s.chunks.front()));
+            proxy_run_worker(run);
+            it = incoming_streams.erase(it);
+            continue;
+        }
+
+        run.message_parts.push_back(std::move(s.chunks.front()));
+        s.chunks.pop();
+        run.stream = {s.id, s.next_index++, s.ended && s.chunks.empty()};
+        s.busy = true;
+        if (run.stream.last) {
+            run.stream_key.clear();
+            proxy_run_worker(run);
+            it = incoming_streams.erase(it);
+            continue;
+        }
+        run.stream_key = it->first;
+        if (!s.ended) {
+            ++s.credit;
+            proxy_send_builtin(s.pubkey, {"STREAM_CREDIT", std::to_string(s.id), "1"});
+        }
+        proxy_run_worker(run);
+        ++it;
+    }
+}
+
+bool LokiMQ::proxy_send_builtin(const std::string& remote, std::vector<std::string> parts) {
+    auto sock_route = proxy_connect(remote, "", true, false, DEFAULT_SEND_KEEP_ALIVE);
+    if (!sock_route.first)
+        return false;
+    message_frames msgs;
+    msgs.reserve(parts.size() + 1);
+    if (!sock_route.second.empty())
+        msgs.push_back(create_message(std::move(sock_route.second)));
+    std::string cmd = parts[0]; // For logging; the parts get moved into the messages
+    for (auto& p : parts)
+        msgs.push_back(create_message(std::move(p)));
+    try {
+        send_message_parts(*sock_route.first, msgs);
+    } catch (const zmq::error_t& e) {
+        LMQ_LOG(debug, "Unable to send ", cmd, " to ", to_hex(remote), ": ", e.what());
+        return false;
+    }
+    return true;
+}
+
+void LokiMQ::proxy_expire_streams() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = outgoing_streams.begin(); it != outgoing_streams.end(); ) {
+        if (it->second.producing || now - it->second.last_activity <= STREAM_TIMEOUT) {
+            ++it;
+            continue;
+        }
+        LMQ_LOG(info, "Dropping outgoing stream ", it->first, " to ", to_hex(it->second.pubkey), ": stream timed out");
+        proxy_send_builtin(it->second.pubkey, {"STREAM_ABORT", std::to_string(it->first)});
+        it = outgoing_streams.erase(it);
+    }
+    for (auto it = incoming_streams.begin(); it != incoming_streams.end(); ) {
+        if (it->second.busy || now - it->second.last_activity <= STREAM_TIMEOUT) {
+            ++it;
+            continue;
+        }
+        LMQ_LOG(info, "Dropping incoming stream ", it->second.id, " from ", to_hex(it->second.pubkey), ": stream timed out");
+        proxy_send_builtin(it->second.pubkey, {"STREAM_CANCEL", std::to_string(it->second.id)});
+        it = incoming_streams.erase(it);
+    }
+}
+
+void LokiMQ::proxy_queue_job(const bt_document& data) {
+    // The proxy takes ownership of the job pointer
+    std::unique_ptr<std::function<void()>> job{reinterpret_cast<std::function<void()>*>(
+            static_cast<uintptr_t>(get_int<int64_t>(data.at("job"))))};
+    if (data.contains("delay"))
+        timer_jobs.emplace(std::chrono::steady_clock::now() + std::chrono::milliseconds{get_int<int64_t>(data.at("delay"))},
+                std::move(*job));
+    else
+        internal_jobs.push(std::move(*job));
+}
+
+void LokiMQ::proxy_process_jobs() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = timer_jobs.begin(); it != timer_jobs.end() && it->first <= now; it = timer_jobs.erase(it))
+        internal_jobs.push(std::move(it->second));
+
+    while (!internal_jobs.empty() && proxy_can_work(nullptr)) {
+        auto& run = get_idle_worker();
+        run.cat = nullptr;
+        run.stream_key.clear();
+        run.job = std::move(internal_jobs.front());
+        internal_jobs.pop();
+        proxy_run_worker(run);
+    }
+}
+
 void LokiMQ::proxy_loop() {
-    zmq::socket_t zap_auth{context, zmq::socket_type::rep};
     zap_auth.setsockopt<int>(ZMQ_LINGER, 0);
     zap_auth.bind(ZMQ_ADDR_ZAP);
 
@@ -777,6 +1742,13 @@ void LokiMQ::proxy_loop() {
     max_workers = general_workers;
     for (const auto& cat : categories)
         max_workers += cat.second.reserved_threads;
+    zap_category.reserved_threads = ZAP_THREADS;
+    max_workers += ZAP_THREADS;
+
+    for (auto& cat : categories)
+        categories_by_priority.push_back(&cat.second);
+    std::stable_sort(categories_by_priority.begin(), categories_by_priority.end(),
+            [](const category* a, const category* b) { return a->priority > b->priority; });
 
     workers.reserve(max_workers);
     if (!workers.empty())
@@ -787,7 +1759,9 @@ void LokiMQ::proxy_loop() {
     add_pollitem(zap_auth);
     assert(pollitems.size() == poll_internal_size);
 
-    if (!bind.empty()) {
+    const bool listening = !bind.empty() || !local_binds.empty();
+    poll_remote_offset = poll_internal_size + (listening ? 1 : 0);
+    if (listening) {
         // Set up the public tcp listener(s):
         listener = {context, zmq::socket_type::router};
         listener.setsockopt(ZMQ_ZAP_DOMAIN, AUTH_DOMAIN_SN, sizeof(AUTH_DOMAIN_SN)-1);
@@ -797,6 +1771,8 @@ void LokiMQ::proxy_loop() {
         listener.setsockopt<int64_t>(ZMQ_MAXMSGSIZE, SN_ZMQ_MAX_MSG_SIZE);
         listener.setsockopt<int>(ZMQ_ROUTER_HANDOVER, 1);
         listener.setsockopt<int>(ZMQ_ROUTER_MANDATORY, 1);
+        if (COMPRESS_THRESHOLD > 0)
+            advertise_compression(listener);
 
         for (const auto &b : bind) {
             LMQ_LOG(info, "LokiMQ listening on ", b);
@@ -808,6 +1784,20 @@ void LokiMQ::proxy_loop() {
         // be ourselves (which can happen, for example, with cross-quoum Blink communication)
         listener.bind(SN_ADDR_SELF);
 
+        // Security options are captured by each bind, so we can add the trusted local addresses to
+        // the same socket (and so have them handled exactly like other incoming connections) by
+        // switching to the NULL mechanism for them.  Each gets its own ZAP domain so that the ZAP
+        // handler knows which allow callback to use.
+        if (!local_binds.empty()) {
+            listener.setsockopt<int>(ZMQ_CURVE_SERVER, 0);
+            for (size_t i = 0; i < local_binds.size(); i++) {
+                auto domain = AUTH_DOMAIN_LOCAL + std::to_string(i);
+                listener.setsockopt(ZMQ_ZAP_DOMAIN, domain.data(), domain.size());
+                LMQ_LOG(info, "LokiMQ listening on ", local_binds[i].first, " (local, without CURVE)");
+                listener.bind(local_binds[i].first);
+            }
+        }
+
         add_pollitem(listener);
     }
 
@@ -815,11 +1805,14 @@ void LokiMQ::proxy_loop() {
 
     constexpr auto poll_timeout = 5000ms; // Maximum time we spend in each poll
     constexpr auto timeout_check_interval = 10000ms; // Minimum time before for checking for connections to close since the last check
+    constexpr auto spool_retry_interval = 5000ms; // Minimum time between attempts to send spooled messages
     auto last_conn_timeout = std::chrono::steady_clock::now();
 
-    size_t last_conn_index = 0; // Index of the connection we last received a message from; see below
+    if (!SPOOL_DIR.empty())
+        proxy_open_spools();
+    last_spool_attempt = last_conn_timeout;
 
-    std::vector<zmq::message_t> parts;
+    message_frames parts;
 
     while (true) {
         if (max_workers == 0) { // Will be 0 only if we are quitting
@@ -834,7 +1827,22 @@ void LokiMQ::proxy_loop() {
         // messages to forward to a worker.  Otherwise, we just look for a control message or a
         // worker coming back with a ready message.
         bool workers_available = idle_workers.size() > 0 || workers.size() < max_workers;
-        zmq::poll(pollitems.data(), workers_available ? pollitems.size() : poll_internal_size, poll_timeout);
+        std::chrono::milliseconds timeout = poll_timeout;
+        if (!timer_jobs.empty()) {
+            // Don't sleep past the next timer
+            auto until_timer = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    timer_jobs.begin()->first - std::chrono::steady_clock::now()) + 1ms;
+            timeout = std::max(0ms, std::min(timeout, until_timer));
+        }
+        for (auto& g : peer_groups) {
+            if (g.second.on_ready && !g.second.pending.empty()) {
+                // Don't sleep past a persistent group's handshake deadline
+                auto until_deadline = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        g.second.ready_deadline - std::chrono::steady_clock::now()) + 1ms;
+                timeout = std::max(0ms, std::min(timeout, until_deadline));
+            }
+        }
+        zmq::poll(pollitems.data(), workers_available ? pollitems.size() : poll_internal_size, timeout);
 
         LMQ_LOG(trace, "processing control messages");
         // Retrieve any waiting incoming control messages
@@ -850,7 +1858,7 @@ void LokiMQ::proxy_loop() {
                 continue;
             }
             auto route = view(parts[0]), cmd = view(parts[1]);
-            assert(route.size() >= 2 && route[0] == 'w' && route[1] >= '1' && route[1] <= '9');
+            assert(route.size() >= 2 && route[0] == 'w' && route[1] >= '0' && route[1] <= '9');
             string_view worker_id_str{&route[1], route.size()-1}; // Chop off the leading "w"
             unsigned int worker_id = detail::extract_unsigned(worker_id_str);
             if (!worker_id_str.empty() /* didn't consume everything */ || worker_id >= workers.size()) {
@@ -861,6 +1869,28 @@ void LokiMQ::proxy_loop() {
             LMQ_LOG(trace, "received ", cmd, " command from ", route);
             if (cmd == "READY") {
                 LMQ_LOG(debug, "Worker ", route, " is ready");
+                auto& run = workers[worker_id];
+                if (run.cat) {
+                    --run.cat->active_threads;
+                    run.cat = nullptr;
+                }
+                if (!run.stream_key.empty()) {
+                    auto it = incoming_streams.find(run.stream_key);
+                    if (it != incoming_streams.end())
+                        it->second.busy = false;
+                    run.stream_key.clear();
+                }
+                if (!run.zap_reply.empty()) {
+                    zap_frames reply;
+                    reply.reserve(run.zap_reply.size());
+                    for (auto& r : run.zap_reply) reply.push_back(create_message(string_view{r}));
+                    send_message_parts(zap_auth, reply.begin(), reply.end());
+                    if (!run.zap_cache_key.first.empty() && AUTH_CACHE_TTL > 0ms)
+                        proxy_auth_cache_insert(std::move(run.zap_cache_key.first), std::move(run.zap_cache_key.second),
+                                {std::make_move_iterator(run.zap_reply.begin() + 2), std::make_move_iterator(run.zap_reply.end())});
+                    run.zap_cache_key = {};
+                    run.zap_reply.clear();
+                }
                 if (max_workers == 0) { // Shutting down
                     LMQ_LOG(trace, "Telling worker ", route, " to quit");
                     route_control(workers_socket, route, "QUIT");
@@ -877,47 +1907,25 @@ void LokiMQ::proxy_loop() {
 
         // Handle any zap authentication
         LMQ_LOG(trace, "processing zap requests");
-        process_zap_requests(zap_auth);
-
-        workers_available = idle_workers.size() > 0 || workers.size() < max_workers; // recheck - idle_workers could have changed above
-        if (max_workers > 0 && workers_available) {
+        process_zap_requests();
+
+        // Hand off any queued commands, internal jobs and stream work that were waiting for a free
+        // worker
+        if (queued_commands > 0)
+            proxy_process_queued();
+        if (!internal_jobs.empty() || !timer_jobs.empty())
+            proxy_process_jobs();
+        if (!outgoing_streams.empty() || !incoming_streams.empty())
+            proxy_process_streams();
+        if (!spools.empty() && std::chrono::steady_clock::now() - last_spool_attempt >= spool_retry_interval)
+            proxy_process_spools();
+        if (!peer_groups.empty())
+            proxy_expire_group_handshakes();
+
+        if (max_workers > 0 && proxy_worker_available()) {
             LMQ_LOG(trace, "processing incoming messages");
-
-            // FIXME process any queued messages (i.e. that couldn't run but we had reserved tasks
-            // still free) first
-
-            // We round-robin connection queues for any pending messages (as long as we have enough
-            // waiting workers), but we don't want a lot of earlier connection requests to starve
-            // later request so each time through we continue from wherever we left off in the
-            // previous queue.
-
-            const size_t num_sockets = remotes.size() + listener.connected();
-            if (last_conn_index >= num_sockets)
-                last_conn_index = 0;
-            std::queue<size_t> queue_index;
-            for (size_t i = 1; i <= num_sockets; i++)
-                queue_index.push((last_conn_index + i) % num_sockets);
-
-            for (parts.clear(); !queue_index.empty() && workers.size() < max_workers; parts.clear()) {
-                size_t i = queue_index.front();
-                queue_index.pop();
-                auto &sock = listener.connected() ? (i == 0 ? listener : remotes[i - 1].second) : remotes[i].second;
-
-                if (!recv_message_parts(sock, std::back_inserter(parts), zmq::recv_flags::dontwait))
-                    continue;
-
-                last_conn_index = i;
-                queue_index.push(i); // We just read one, but there might be more messages waiting so requeue it at the end
-
-                if (parts.empty()) {
-                    LMQ_LOG(warn, "Ignoring empty (0-part) incoming message");
-                    continue;
-                }
-
-                if (proxy_handle_builtin(last_conn_index, parts)) continue;
-
-                proxy_to_worker(last_conn_index, parts);
-            }
+            proxy_read_incoming();
+            proxy_dispatch_incoming();
         }
 
         // Drop idle connections (if we haven't done it in a while) but *only* if we have some idle
@@ -928,6 +1936,7 @@ void LokiMQ::proxy_loop() {
             if (now - last_conn_timeout >= timeout_check_interval) {
                 LMQ_LOG(trace, "closing idle connections");
                 proxy_expire_idle_peers();
+                proxy_expire_streams();
                 last_conn_timeout = now;
             }
         }
@@ -936,7 +1945,7 @@ void LokiMQ::proxy_loop() {
     }
 }
 
-std::pair<const LokiMQ::category*, const LokiMQ::CommandCallback*> LokiMQ::get_command(std::string& command) {
+std::pair<LokiMQ::category*, const LokiMQ::CommandCallback*> LokiMQ::get_command(std::string& command) {
     if (command.size() > MAX_CATEGORY_LENGTH + 1 + MAX_COMMAND_LENGTH) {
         LMQ_LOG(warn, "Invalid command '", command, "': command too long");
         return {};
@@ -956,13 +1965,13 @@ std::pair<const LokiMQ::category*, const LokiMQ::CommandCallback*> LokiMQ::get_c
     string_view catname{&command[0], dot};
     std::string cmd = command.substr(dot + 1);
 
-    auto catit = categories.find(catname);
+    auto catit = categories.find(std::string{catname});
     if (catit == categories.end()) {
         LMQ_LOG(warn, "Invalid command category '", catname, "'");
         return {};
     }
 
-    const auto& category = catit->second;
+    auto& category = catit->second;
     auto callback_it = category.commands.find(cmd);
     if (callback_it == category.commands.end()) {
         LMQ_LOG(warn, "Invalid command '", command, "'");
@@ -972,33 +1981,86 @@ std::pair<const LokiMQ::category*, const LokiMQ::CommandCallback*> LokiMQ::get_c
     return {&catit->second, &callback_it->second};
 }
 
-std::pair<std::string, LokiMQ::peer_info> &LokiMQ::proxy_lookup_peer(zmq::message_t& msg, ) {
-    std::string pubkey;
-    bool service_node;
-    try {
-        extract_pubkey(parts.back(), pubkey, service_node);
-    } catch (...) {
-        LMQ_LOG(error, "Internal error: socket User-Id not set or invalid; dropping message");
-        return;
-    }
-
-    auto it = peers.find(pubkey);
-    if (it == peers.end())
-        it = peers.emplace(std::move(pubkey), peer_info{});
-    auto &peer_info = peers[pubkey];
-    peer_info.service_node |= service_node;
-
-}
-
+bool LokiMQ::proxy_handle_builtin(size_t conn_index, message_frames& parts) {
+    bool is_outgoing_conn = !listener.connected() || conn_index > 0;
+    size_t command_part_index = is_outgoing_conn ? 0 : 1;
+    if (parts.size() <= command_part_index)
+        return false;
+    auto cmd = view(parts[command_part_index]);
 
-bool LokiMQ::proxy_handle_builtin(size_t conn_index, std::vector<zmq::message_t>& parts) {
-    auto cmd = view(parts.front());
     if (cmd == "BYE") {
-        
+        if (is_outgoing_conn) {
+            auto& remote = remotes[conn_index - listener.connected()].first;
+            LMQ_LOG(info, "BYE command received; disconnecting from ", to_hex(remote));
+            proxy_disconnect(remote);
+        } else {
+            std::string pubkey;
+            bool service_node;
+            try {
+                extract_pubkey(parts.back(), pubkey, service_node);
+            } catch (...) {
+                LMQ_LOG(error, "Internal error: socket User-Id not set or invalid; dropping message");
+                return true;
+            }
+            auto it = peers.find(pubkey);
+            if (it != peers.end()) {
+                LMQ_LOG(info, "BYE command received; forgetting incoming connection from ", to_hex(pubkey));
+                it->second.incoming.clear();
+            }
+        }
+        return true;
     }
+    if (cmd.size() >= 6 && string_view{cmd.data(), 6} == "STREAM") {
+        std::string pubkey;
+        if (is_outgoing_conn) {
+            pubkey = remotes[conn_index - listener.connected()].first;
+        } else {
+            bool service_node;
+            try {
+                extract_pubkey(parts.back(), pubkey, service_node);
+            } catch (...) {
+                LMQ_LOG(error, "Internal error: socket User-Id not set or invalid; dropping message");
+                return true;
+            }
+            auto& peer = proxy_lookup_peer(pubkey, service_node);
+            if (peer.incoming.empty())
+                peer.incoming = std::string{view(parts[0])};
+        }
+        try {
+            proxy_stream_builtin(conn_index, pubkey, cmd, parts, command_part_index + 1);
+        } catch (const std::exception& e) {
+            LMQ_LOG(warn, "Invalid ", cmd, " message from ", to_hex(pubkey), ": ", e.what());
+        }
+        return true;
+    }
+    if (cmd == "HI") {
+        // Sent by a remote immediately after establishing an outgoing connection to us so that it
+        // learns when the connection handshake is complete.
+        if (!is_outgoing_conn)
+            send_routed_message(listener, std::string{view(parts[0])}, "HELLO");
+        return true;
+    }
+    if (cmd == "HELLO") {
+        if (is_outgoing_conn) {
+            auto& remote = remotes[conn_index - listener.connected()].first;
+            auto it = peers.find(remote);
+            if (it != peers.end() && !it->second.established) {
+                LMQ_LOG(debug, "Outgoing connection to ", to_hex(remote), " established");
+                it->second.established = true;
+                it->second.compress = peer_accepts_compression(parts.back());
+                it->second.activity();
+                proxy_handshake_done(remote);
+                auto spool = spools.find(remote);
+                if (spool != spools.end())
+                    proxy_drain_spool(spool);
+            }
+        }
+        return true;
+    }
+    return false;
 }
 
-void LokiMQ::proxy_to_worker(size_t conn_index, std::vector<zmq::message_t>& parts) {
+void LokiMQ::proxy_to_worker(size_t conn_index, message_frames& parts, std::chrono::steady_clock::time_point received) {
     std::string pubkey;
     bool service_node;
     try {
@@ -1011,6 +2073,21 @@ void LokiMQ::proxy_to_worker(size_t conn_index, std::vector<zmq::message_t>& par
     bool is_outgoing_conn = !listener.connected() || conn_index > 0;
     size_t command_part_index = is_outgoing_conn ? 0 : 1;
     std::string command = parts[command_part_index].to_string();
+    std::string compressed;
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    auto flags = split_command_flags(command);
+    if (!flags.empty()) {
+        try {
+            bt_dict_consumer f{flags};
+            if (f.skip_until("t"))
+                deadline = received + std::chrono::milliseconds{f.consume_integer<int64_t>().second};
+            if (f.skip_until("z"))
+                compressed = std::string{f.consume_string().second};
+        } catch (const std::exception& e) {
+            LMQ_LOG(warn, "Invalid message flags received with ", command, ": ", e.what(), "; dropping message");
+            return;
+        }
+    }
     auto cat_call = get_command(command);
 
     if (!cat_call.first) {
@@ -1023,74 +2100,287 @@ void LokiMQ::proxy_to_worker(size_t conn_index, std::vector<zmq::message_t>& par
 
     auto& category = *cat_call.first;
 
-    auto &peer_info = peers[pubkey];
-    peer_info.service_node |= service_node;
+    auto &peer_info = proxy_lookup_peer(pubkey, service_node);
+    if (COMPRESS_THRESHOLD > 0)
+        peer_info.compress = peer_accepts_compression(parts.back());
 
     if (!proxy_check_auth(pubkey, conn_index, peer_info, command, category, parts.back()))
         return;
 
-    bool can_work = false;
-    if (category.active_threads < category.reserved_threads)
-        // Our category still has reserved spots so we get to run even if it would exceed
-        // general_workers.
-        can_work = true;
-    else {
-        // We don't have a reserved spot, so the only way we get to run now is if there is an idle
-        // worker *and* we don't already have >= `general_workers` threads already doing things.
-        unsigned int working_threads = workers.size() - idle_workers.size();
-        if (working_threads < general_workers)
-            can_work = true;
+    category::pending_command cmd;
+    cmd.pubkey = std::move(pubkey);
+    cmd.service_node = peer_info.service_node;
+    if (is_outgoing_conn) {
+        peer_info.activity(); // outgoing connection activity, pump the activity timer
+    } else {
+        // incoming connection; the route is the first argument.  Update the peer route info in case
+        // it has changed (e.g. new connection).
+        auto route = view(parts[0]);
+        proxy_update_incoming_route(cmd.pubkey, peer_info, route);
+        cmd.route = std::string{route};
     }
 
-    if (!can_work) {
-        // We can't handle this now so queue it for later consideration when some workers free up.
-        LMQ_LOG(debug, "No available free workers, queuing task for later");
-        // FIXME TODO
+    LMQ_LOG(trace, __FILE__, __LINE__, "Received ", command, " from ",
+            cmd.service_node ? "SN " : "non-SN ", to_hex(cmd.pubkey), " @ ", peer_address(parts.back()));
+
+    cmd.command = std::move(command);
+    cmd.callback = cat_call.second;
+    cmd.compressed = std::move(compressed);
+    cmd.deadline = deadline;
+    // Keep just the extra argument messages (after the command name)
+    parts.erase(parts.begin(), parts.begin() + (command_part_index + 1));
+    cmd.parts = std::move(parts);
+
+    proxy_queue_command(category, std::move(cmd));
+}
+
+void LokiMQ::proxy_queue_command(category& category, category::pending_command&& cmd) {
+    if (cmd.deadline <= std::chrono::steady_clock::now()) {
+        proxy_expired(cmd);
         return;
     }
 
-    size_t index;
-    std::unique_ptr<run_info> new_run;
-    if (idle_workers.empty()) {
-        index = workers.size();
-        assert(workers.capacity() > index);
-        new_run = std::make_unique<run_info>();
-        new_run->routing_id = "w" + std::to_string(index);
-    } else {
-        index = idle_workers.back();
+    if (!category.pending.empty() || !proxy_can_work(&category)) {
+        // We can't handle this now (or there are already earlier commands waiting) so queue it for
+        // later consideration when some workers free up.
+        if (category.max_queue >= 0 && category.pending.size() >= static_cast<size_t>(category.max_queue)) {
+            LMQ_LOG(warn, "No space to queue ", cmd.command, " for later processing; dropping message");
+            return;
+        }
+        LMQ_LOG(debug, "No available free workers, queuing ", cmd.command, " for later");
+        cmd.queued = std::chrono::steady_clock::now();
+        if (category.max_age > 0ms)
+            cmd.deadline = std::min(cmd.deadline, cmd.queued + category.max_age);
+        category.pending.push(std::move(cmd));
+        queued_commands++;
+        return;
     }
 
-    auto& run = new_run ? *new_run : workers[index];
-    run.pubkey = std::move(pubkey);
-    run.service_node = service_node;
+    proxy_run_command(category, std::move(cmd));
+}
+
+void LokiMQ::proxy_run_command(category& cat, category::pending_command&& cmd) {
+    auto& run = get_idle_worker();
+    LMQ_LOG(trace, "Invoking ", cmd.command, " from ", to_hex(cmd.pubkey), " on worker ", run.worker_index);
+    run.command = std::move(cmd.command);
+    run.callback = cmd.callback;
+    run.pubkey = std::move(cmd.pubkey);
+    run.service_node = cmd.service_node;
+    run.route = std::move(cmd.route);
+    run.cat = &cat;
+    run.job = nullptr;
+    run.stream = {};
+    run.stream_key.clear();
+    run.compressed = std::move(cmd.compressed);
+    run.deadline = cmd.deadline;
+
+    // Move the parts one at a time so that the worker's vector keeps its capacity
+    run.message_parts.clear();
+    for (auto& part : cmd.parts)
+        run.message_parts.push_back(std::move(part));
 
+    proxy_run_worker(run);
+}
+
+void LokiMQ::proxy_process_queued() {
+    auto now = std::chrono::steady_clock::now();
+    while (queued_commands > 0 && proxy_worker_available()) {
+        category* next = nullptr;
+        // Commands that have been waiting longer than PRIORITY_AGING go first (oldest first) so
+        // that busy higher priority categories can delay lower priority ones, but not forever.
+        for (auto* cat : categories_by_priority)
+            if (!cat->pending.empty() && now - cat->pending.front().queued >= PRIORITY_AGING && proxy_can_work(cat) &&
+                    (!next || cat->pending.front().queued < next->pending.front().queued))
+                next = cat;
+        if (!next) {
+            for (auto* cat : categories_by_priority) {
+                if (!cat->pending.empty() && proxy_can_work(cat)) {
+                    next = cat;
+                    break;
+                }
+            }
+        }
+        if (!next)
+            break;
+
+        auto cmd = std::move(next->pending.front());
+        next->pending.pop();
+        queued_commands--;
+        if (cmd.deadline <= now)
+            proxy_expired(cmd);
+        else
+            proxy_run_command(*next, std::move(cmd));
+    }
+}
+
+void LokiMQ::proxy_expired(const category::pending_command& cmd) {
+    LMQ_LOG(debug, "Dropping ", cmd.command, " from ", to_hex(cmd.pubkey), ": deadline passed before a worker was available");
+    if (REPLY_EXPIRED)
+        proxy_send_builtin(cmd.pubkey, {"EXPIRED", cmd.command});
+}
+
+void LokiMQ::proxy_read_incoming() {
+    message_frames parts;
+    const size_t num_sockets = remotes.size() + listener.connected();
+    for (size_t i = 0; i < num_sockets; i++) {
+        bool outgoing = !listener.connected() || i > 0;
+        // Read a limited batch from each connection so that we get back to the workers and control
+        // socket regularly even if a connection is flooding us.
+        for (size_t n = 0; n < 2 * PEER_QUEUE_SIZE; n++) {
+            if (remotes.size() + listener.connected() != num_sockets)
+                return; // A builtin command (e.g. BYE) changed the connections; read the rest next time
+            auto& sock = outgoing ? remotes[i - listener.connected()].second : listener;
+            if (outgoing) {
+                // If this peer's queue is full leave any further messages in the zmq queue for now
+                auto it = peers.find(remotes[i - listener.connected()].first);
+                if (it != peers.end() && it->second.inbound.size() >= PEER_QUEUE_SIZE)
+                    break;
+            }
+
+            parts.clear();
+            if (!recv_message_parts(sock, std::back_inserter(parts), zmq::recv_flags::dontwait))
+                break;
+
+            if (parts.empty()) {
+                LMQ_LOG(warn, "Ignoring empty (0-part) incoming message");
+                continue;
+            }
+
+            if (proxy_handle_builtin(i, parts)) continue;
+
+            proxy_queue_incoming(i, std::move(parts));
+        }
+    }
+}
+
+void LokiMQ::proxy_queue_incoming(size_t conn_index, message_frames&& parts) {
+    bool is_outgoing_conn = !listener.connected() || conn_index > 0;
+    std::string pubkey;
+    peer_info* peer_ptr;
     if (is_outgoing_conn) {
-        peer_info.activity(); // outgoing connection activity, pump the activity timer
+        pubkey = remotes[conn_index - listener.connected()].first;
+        auto it = peers.find(pubkey);
+        if (it == peers.end()) {
+            LMQ_LOG(error, "Internal error: received message on outgoing connection to unknown peer ", to_hex(pubkey));
+            return;
+        }
+        peer_ptr = &it->second;
     } else {
-        // incoming connection; the route is the first argument.  Update the peer route info in case
-        // it has changed (e.g. new connection).
-        auto route = view(parts[0]);
-        if (string_view(peer_info.incoming) != route)
-            peer_info.incoming = route;
+        bool service_node;
+        try {
+            extract_pubkey(parts.back(), pubkey, service_node);
+        } catch (...) {
+            LMQ_LOG(error, "Internal error: socket User-Id not set or invalid; dropping message");
+            return;
+        }
+        peer_ptr = &proxy_lookup_peer(pubkey, service_node);
+        proxy_update_incoming_route(pubkey, *peer_ptr, view(parts[0]));
+    }
+
+    auto& peer = *peer_ptr;
+    if (peer.inbound.size() >= PEER_QUEUE_SIZE) {
+        LMQ_LOG(warn, "Dropping message from ", to_hex(pubkey), ": too many queued messages from that peer");
+        return;
+    }
+    peer.inbound.push({std::move(parts), is_outgoing_conn, std::chrono::steady_clock::now()});
+    if (!peer.scheduled) {
+        peer.scheduled = true;
+        inbound_peers.push_back(std::move(pubkey));
     }
+}
 
-    LMQ_LOG(trace, __FILE__, __LINE__, "Invoking incoming ", command, " from ",
-            run.service_node ? "SN " : "non-SN ", to_hex(run.pubkey), " @ ", peer_address(parts.back()),
-            " on worker ", index);
+void LokiMQ::proxy_dispatch_incoming() {
+    while (!inbound_peers.empty() && proxy_worker_available()) {
+        const auto& pubkey = inbound_peers.front();
+        auto it = peers.find(pubkey);
+        if (it != peers.end() && !it->second.inbound.empty()) {
+            auto* peer = &it->second;
+            if (peer->deficit == 0) // Starting a new turn
+                peer->deficit = peer->dispatch_weight();
+            while (peer->deficit > 0 && !peer->inbound.empty() && proxy_worker_available()) {
+                auto msg = std::move(peer->inbound.front());
+                peer->inbound.pop();
+                peer->deficit--;
+                if (msg.outgoing ? peer->outgoing < 0 : !listener.connected())
+                    continue; // The connection it came in on has since been closed
+                proxy_to_worker(msg.outgoing ? peer->outgoing + listener.connected() : 0, msg.parts, msg.received);
+                // proxy_to_worker can close the connection, which may remove the peer
+                it = peers.find(pubkey);
+                if (it == peers.end())
+                    break;
+                peer = &it->second;
+            }
+            if (it != peers.end() && !it->second.inbound.empty()) {
+                if (peer->deficit == 0) // Turn over: go to the back of the line
+                    inbound_peers.splice(inbound_peers.end(), inbound_peers, inbound_peers.begin());
+                // Otherwise we ran out of workers mid-turn; continue the turn next time
+                continue;
+            }
+        }
+        if (it != peers.end()) {
+            it->second.scheduled = false;
+            it->second.deficit = 0;
+        }
+        inbound_peers.pop_front();
+    }
+}
 
-    run.command = std::move(command);
-    run.callback = cat_call.second;
+void LokiMQ::proxy_update_incoming_route(const std::string& pubkey, peer_info& peer, string_view route) {
+    if (string_view(peer.incoming) == route)
+        return;
+    bool was_connected = !peer.incoming.empty();
+    peer.incoming = std::string{route};
+    if (!was_connected)
+        proxy_handshake_done(pubkey);
+}
 
-    // Steal any extra argument messages (after the command name)
-    run.message_parts.clear();
-    for (size_t i = (command_part_index + 1); i < parts.size(); i++)
-        run.message_parts.push_back(std::move(parts[i]));
-
-    if (new_run) {
-        // The thread processes the first job immediately upon startup, so just start it and don't
-        // send anything.
-        workers.push_back(std::move(run));
-        workers.back().thread = std::thread{&LokiMQ::worker_thread, this, index};
+LokiMQ::peer_info& LokiMQ::proxy_lookup_peer(const std::string& pubkey, bool service_node) {
+    auto it = peers.find(pubkey);
+    if (it == peers.end()) {
+        it = peers.emplace(pubkey, peer_info{}).first;
+        it->second.service_node = sn_set_managed ? active_service_nodes.count(pubkey) > 0 : service_node;
+    } else if (!sn_set_managed) {
+        it->second.service_node |= service_node;
+    }
+    return it->second;
+}
+
+bool LokiMQ::proxy_can_work(const category* cat) const {
+    if (!proxy_worker_available())
+        return false;
+
+    if (cat && cat->active_threads < cat->reserved_threads)
+        // Our category still has reserved spots so we get to run even if it would exceed
+        // general_workers.
+        return true;
+
+    // We don't have a reserved spot, so the only way we get to run now is if there is an idle
+    // worker *and* we don't already have >= `general_workers` threads already doing things.
+    unsigned int working_threads = workers.size() - idle_workers.size();
+    return working_threads < general_workers;
+}
+
+LokiMQ::run_info& LokiMQ::get_idle_worker() {
+    if (idle_workers.empty()) {
+        unsigned int index = workers.size();
+        assert(workers.capacity() > index);
+        workers.emplace_back();
+        auto& run = workers.back();
+        run.worker_index = index;
+        run.routing_id = "w" + std::to_string(index);
+        return run;
+    }
+    return workers[idle_workers.back()];
+}
+
+void LokiMQ::proxy_run_worker(run_info& run) {
+    if (run.cat)
+        ++run.cat->active_threads;
+
+    if (!run.thread.joinable()) {
+        // A newly allocated worker: the thread processes the first job immediately upon startup, so
+        // just start it and don't send anything.
+        run.thread = std::thread{&LokiMQ::worker_thread, this, run.worker_index};
     } else {
         // The worker is idling, send it a RUN (prefixed with the route, for the ROUTER socket)
         // to kick it into action
@@ -1132,94 +2422,334 @@ bool LokiMQ::proxy_check_auth(const std::string& pubkey, size_t conn_index, cons
         send_direct_message(remotes[conn_index - listener.connected()].second, std::move(reply), command);
     else
         send_routed_message(listener, pubkey, std::move(reply), command);
+    return false;
+}
+
+namespace {
+
+// Builds a ZAP reply denying the request, for when authentication itself failed (e.g. the AllowFunc
+// threw): zmq waits for a reply to every request, so one has to be sent regardless.
+std::vector<std::string> zap_error_response(zap_frames& frames) {
+    std::vector<std::string> response_vals(6);
+    response_vals[0] = "1.0";
+    if (frames.size() >= 2)
+        response_vals[1] = view(frames[1]);
+    response_vals[2] = "500";
+    response_vals[3] = "Internal error: authentication failed";
+    return response_vals;
+}
+
+}
+
+void LokiMQ::process_zap_requests() {
+    zap_frames frames;
+    for (; recv_message_parts(zap_auth, std::back_inserter(frames), zmq::recv_flags::dontwait); frames.clear()) {
+        // The request comes in on a router socket and so begins with the router envelope: the route
+        // and an empty delimiter frame, which we echo back at the front of the reply.
+        if (frames.size() < 2 || frames[1].size() != 0) {
+            LMQ_LOG(error, "Bad ZAP authentication request: invalid message envelope");
+            continue;
+        }
+        if ((HANDSHAKE_IP_RATE > 0 || HANDSHAKE_RATE > 0) && !proxy_zap_admit(frames))
+            continue;
+        if (AUTH_CACHE_TTL > 0ms && proxy_zap_cached(frames))
+            continue;
+        if (ZAP_THREADS > 0) {
+            zap_pending.push(std::move(frames));
+            frames.clear();
+            continue;
+        }
+        zap_frames request;
+        request.reserve(frames.size() - 2);
+        for (size_t i = 2; i < frames.size(); i++)
+            request.push_back(std::move(frames[i]));
+        bool cacheable = false;
+        std::vector<std::string> response_vals;
+        try {
+            response_vals = zap_authenticate(request, cacheable);
+        } catch (const std::exception& e) {
+            LMQ_LOG(error, "ZAP authentication raised an exception: ", e.what());
+            response_vals = zap_error_response(request);
+            cacheable = false;
+        } catch (...) {
+            LMQ_LOG(error, "ZAP authentication raised a non-standard exception");
+            response_vals = zap_error_response(request);
+            cacheable = false;
+        }
+        if (cacheable && AUTH_CACHE_TTL > 0ms)
+            proxy_auth_cache_insert(request[6].to_string(), request[3].to_string(), response_vals);
+
+        zap_frames response;
+        response.reserve(response_vals.size() + 2);
+        response.push_back(std::move(frames[0]));
+        response.push_back(std::move(frames[1]));
+        for (auto &r : response_vals) response.push_back(create_message(std::move(r)));
+        send_message_parts(zap_auth, response.begin(), response.end());
+    }
+
+    while (!zap_pending.empty() && proxy_can_work(&zap_category)) {
+        auto& run = get_idle_worker();
+        run.cat = &zap_category;
+        run.stream_key.clear();
+        // std::function requires copyable, so stash the (move-only) request in a shared_ptr
+        auto request = std::make_shared<zap_frames>(std::move(zap_pending.front()));
+        zap_pending.pop();
+        run.job = [this, &run, request] {
+            auto& req = *request;
+            zap_frames frames;
+            frames.reserve(req.size() - 2);
+            for (size_t i = 2; i < req.size(); i++)
+                frames.push_back(std::move(req[i]));
+            bool cacheable = false;
+            std::vector<std::string> response_vals;
+            try {
+                response_vals = zap_authenticate(frames, cacheable);
+            } catch (const std::exception& e) {
+                LMQ_LOG(error, "ZAP authentication raised an exception: ", e.what());
+                response_vals = zap_error_response(frames);
+                cacheable = false;
+            } catch (...) {
+                LMQ_LOG(error, "ZAP authentication raised a non-standard exception");
+                response_vals = zap_error_response(frames);
+                cacheable = false;
+            }
+            if (cacheable)
+                run.zap_cache_key = {frames[6].to_string(), frames[3].to_string()};
+            run.zap_reply.reserve(response_vals.size() + 2);
+            run.zap_reply.push_back(req[0].to_string());
+            run.zap_reply.emplace_back();
+            for (auto& r : response_vals)
+                run.zap_reply.push_back(std::move(r));
+        };
+        proxy_run_worker(run);
+    }
+}
+
+bool LokiMQ::token_bucket::take(double rate, unsigned int burst, std::chrono::steady_clock::time_point now) {
+    if (tokens < 0) // New bucket
+        tokens = burst;
+    else
+        tokens = std::min<double>(burst, tokens + rate * std::chrono::duration<double>(now - last).count());
+    last = now;
+    if (tokens < 1)
+        return false;
+    tokens -= 1;
+    return true;
+}
+
+bool LokiMQ::proxy_zap_admit(zap_frames& frames) {
+    // [route, "", "1.0", request id, domain, ip, ...]; anything malformed gets refused later
+    if (frames.size() < 6)
+        return true;
+    auto now = std::chrono::steady_clock::now();
+    const char* refused = nullptr;
+
+    if (HANDSHAKE_IP_RATE > 0) {
+        auto ip = frames[5].to_string();
+        auto it = handshake_ip_index.find(ip);
+        if (it != handshake_ip_index.end()) {
+            // Move to the front (most recently used)
+            handshake_ip_buckets.splice(handshake_ip_buckets.begin(), handshake_ip_buckets, it->second);
+        } else {
+            if (handshake_ip_buckets.size() >= std::max<size_t>(HANDSHAKE_IP_TRACKED, 1)) {
+                // Reuse the least recently used IP's node rather than allocating a new one
+                auto& lru = handshake_ip_buckets.back();
+                handshake_ip_index.erase(lru.first);
+                handshake_ip_buckets.splice(handshake_ip_buckets.begin(), handshake_ip_buckets, std::prev(handshake_ip_buckets.end()));
+                handshake_ip_buckets.front().first = ip;
+                handshake_ip_buckets.front().second = {-1, {}};
+            } else {
+                handshake_ip_buckets.emplace_front(ip, token_bucket{-1, {}});
+            }
+            handshake_ip_index.emplace(std::move(ip), handshake_ip_buckets.begin());
+        }
+        if (!handshake_ip_buckets.front().second.take(HANDSHAKE_IP_RATE, HANDSHAKE_IP_BURST, now)) {
+            handshakes_rejected_ip.fetch_add(1, std::memory_order_relaxed);
+            refused = "per-IP";
+        }
+    }
+    if (!refused && HANDSHAKE_RATE > 0 && !handshake_bucket.take(HANDSHAKE_RATE, HANDSHAKE_BURST, now)) {
+        handshakes_rejected_global.fetch_add(1, std::memory_order_relaxed);
+        refused = "global";
+    }
+    if (!refused)
+        return true;
+
+    LMQ_LOG(debug, "Refusing incoming connection from ", view(frames[5]), ": ", refused, " handshake rate limit reached");
+    std::array<zmq::message_t, 8> response{{
+        std::move(frames[0]), std::move(frames[1]), create_message(string_view{"1.0"}), std::move(frames[3]),
+        create_message(string_view{"400"}), create_message(string_view{"Too many connections"}), {}, {}}};
+    send_message_parts(zap_auth, response.begin(), response.end());
+    return false;
+}
+
+bool LokiMQ::proxy_zap_cached(zap_frames& frames) {
+    // [route, "", "1.0", request id, domain, ip, identity, "CURVE", pubkey]
+    if (frames.size() != 9 || view(frames[2]) != "1.0" || view(frames[4]) != AUTH_DOMAIN_SN ||
+            view(frames[7]) != "CURVE" || frames[8].size() != 32)
+        return false;
+    auto pk_it = auth_cache.find(frames[8].to_string());
+    if (pk_it == auth_cache.end())
+        return false;
+    auto it = pk_it->second.find(frames[5].to_string());
+    if (it == pk_it->second.end())
+        return false;
+    if (it->second.expiry <= std::chrono::steady_clock::now()) {
+        pk_it->second.erase(it);
+        if (pk_it->second.empty())
+            auth_cache.erase(pk_it);
+        --auth_cache_count;
+        return false;
+    }
+
+    LMQ_LOG(debug, "Replying to ZAP authentication request for ", to_hex(view(frames[8])), " at ", view(frames[5]), " from auth cache");
+    auto& cached = it->second.reply;
+    zap_frames response;
+    response.reserve(cached.size() + 2);
+    response.push_back(std::move(frames[0]));
+    response.push_back(std::move(frames[1]));
+    for (size_t i = 0; i < cached.size(); i++)
+        response.push_back(i == 1 ? std::move(frames[3]) : create_message(string_view{cached[i]}));
+    send_message_parts(zap_auth, response.begin(), response.end());
     return true;
 }
 
-void LokiMQ::process_zap_requests(zmq::socket_t &zap_auth) {
-    std::vector<zmq::message_t> frames;
-    for (frames.reserve(7); recv_message_parts(zap_auth, std::back_inserter(frames), zmq::recv_flags::dontwait); frames.clear()) {
-        if (LogLevel::trace >= log_level()) {
-            std::ostringstream o;
-            o << "Processing ZAP authentication request:";
-            for (size_t i = 0; i < frames.size(); i++) {
-                o << "\n[" << i << "]: ";
-                auto v = view(frames[i]);
-                if (i == 1 || i == 6)
-                    o << to_hex(v);
-                else
-                    o << v;
+void LokiMQ::proxy_auth_cache_insert(std::string pubkey, std::string ip, std::vector<std::string> reply) {
+    auto now = std::chrono::steady_clock::now();
+    // Drop expired entries, and the oldest entries if we are full.  Entries are queued in expiry
+    // order, but the queue may also contain stale values for entries that have since been replaced
+    // or removed (which we recognize by the expiry not matching).
+    while (!auth_cache_order.empty() && (auth_cache_count >= AUTH_CACHE_SIZE || std::get<2>(auth_cache_order.front()) <= now)) {
+        auto& oldest = auth_cache_order.front();
+        auto pk_it = auth_cache.find(std::get<0>(oldest));
+        if (pk_it != auth_cache.end()) {
+            auto it = pk_it->second.find(std::get<1>(oldest));
+            if (it != pk_it->second.end() && it->second.expiry == std::get<2>(oldest)) {
+                pk_it->second.erase(it);
+                if (pk_it->second.empty())
+                    auth_cache.erase(pk_it);
+                --auth_cache_count;
             }
-            log_(LogLevel::trace, __FILE__, __LINE__, o.str());
+        }
+        auth_cache_order.pop();
+    }
+    if (AUTH_CACHE_SIZE == 0)
+        return;
+
+    auto expiry = now + AUTH_CACHE_TTL;
+    auto& entry = auth_cache[pubkey][ip];
+    if (entry.reply.empty())
+        ++auth_cache_count;
+    entry.reply = std::move(reply);
+    entry.expiry = expiry;
+    auth_cache_order.emplace(std::move(pubkey), std::move(ip), expiry);
+}
+
+void LokiMQ::proxy_auth_cache_invalidate(const bt_document& data) {
+    if (!data.contains("pubkey")) {
+        LMQ_LOG(debug, "Clearing auth cache");
+        auth_cache.clear();
+        auth_cache_order = {};
+        auth_cache_count = 0;
+        return;
+    }
+    auto pk_it = auth_cache.find(std::string{data.at("pubkey").string()});
+    if (pk_it != auth_cache.end()) {
+        LMQ_LOG(debug, "Removing cached auth results for ", to_hex(pk_it->first));
+        auth_cache_count -= pk_it->second.size();
+        auth_cache.erase(pk_it);
+    }
+}
+
+std::vector<std::string> LokiMQ::zap_authenticate(zap_frames& frames, bool& cacheable) {
+    if (LogLevel::trace >= log_level()) {
+        std::ostringstream o;
+        o << "Processing ZAP authentication request:";
+        for (size_t i = 0; i < frames.size(); i++) {
+            o << "\n[" << i << "]: ";
+            auto v = view(frames[i]);
+            if (i == 1 || i == 6)
+                o << to_hex(v);
+            else
+                o << v;
+        }
+        log_(LogLevel::trace, __FILE__, __LINE__, o.str());
+    } else {
+        LMQ_LOG(debug, "Processing ZAP authentication request");
+    }
+
+    // https://rfc.zeromq.org/spec:27/ZAP/
+    //
+    // The request message SHALL consist of the following message frames:
+    //
+    //     The version frame, which SHALL contain the three octets "1.0".
+    //     The request id, which MAY contain an opaque binary blob.
+    //     The domain, which SHALL contain a (non-empty) string.
+    //     The address, the origin network IP address.
+    //     The identity, the connection Identity, if any.
+    //     The mechanism, which SHALL contain a string.
+    //     The credentials, which SHALL be zero or more opaque frames.
+    //
+    // The reply message SHALL consist of the following message frames:
+    //
+    //     The version frame, which SHALL contain the three octets "1.0".
+    //     The request id, which MAY contain an opaque binary blob.
+    //     The status code, which SHALL contain a string.
+    //     The status text, which MAY contain a string.
+    //     The user id, which SHALL contain a string.
+    //     The metadata, which MAY contain a blob.
+    //
+    // (NB: there are also null address delimiters at the beginning of each mentioned in the
+    // RFC, but those are part of the router envelope which the caller takes care of)
+
+    std::vector<std::string> response_vals(6);
+    response_vals[0] = "1.0"; // version
+    if (frames.size() >= 2)
+        response_vals[1] = view(frames[1]); // unique identifier
+    std::string &status_code = response_vals[2], &status_text = response_vals[3];
+
+    if (frames.size() < 6 || view(frames[0]) != "1.0") {
+        LMQ_LOG(error, "Bad ZAP authentication request: version != 1.0 or invalid ZAP message parts");
+        status_code = "500";
+        status_text = "Internal error: invalid auth request";
+    }
+    else if (frames.size() == 6 && view(frames[5]) == "NULL") {
+        zap_authenticate_local(frames, response_vals);
+    }
+    else if (frames.size() != 7 || view(frames[5]) != "CURVE") {
+        LMQ_LOG(error, "Bad ZAP authentication request: invalid CURVE authentication request");
+        status_code = "500";
+        status_text = "Invalid CURVE authentication request\n";
+    }
+    else if (frames[6].size() != 32) {
+        LMQ_LOG(error, "Bad ZAP authentication request: invalid request pubkey");
+        status_code = "500";
+        status_text = "Invalid public key size for CURVE authentication";
+    }
+    else {
+        auto domain = view(frames[2]);
+        if (domain != AUTH_DOMAIN_SN) {
+            LMQ_LOG(error, "Bad ZAP authentication request: invalid auth domain '", domain, "'");
+            status_code = "400";
+            status_text = "Unknown authentication domain: " + std::string{domain};
         } else {
-            LMQ_LOG(debug, "Processing ZAP authentication request");
-        }
-
-        // https://rfc.zeromq.org/spec:27/ZAP/
-        //
-        // The request message SHALL consist of the following message frames:
-        //
-        //     The version frame, which SHALL contain the three octets "1.0".
-        //     The request id, which MAY contain an opaque binary blob.
-        //     The domain, which SHALL contain a (non-empty) string.
-        //     The address, the origin network IP address.
-        //     The identity, the connection Identity, if any.
-        //     The mechanism, which SHALL contain a string.
-        //     The credentials, which SHALL be zero or more opaque frames.
-        //
-        // The reply message SHALL consist of the following message frames:
-        //
-        //     The version frame, which SHALL contain the three octets "1.0".
-        //     The request id, which MAY contain an opaque binary blob.
-        //     The status code, which SHALL contain a string.
-        //     The status text, which MAY contain a string.
-        //     The user id, which SHALL contain a string.
-        //     The metadata, which MAY contain a blob.
-        //
-        // (NB: there are also null address delimiters at the beginning of each mentioned in the
-        // RFC, but those have already been removed through the use of a REP socket)
-
-        std::vector<std::string> response_vals(6);
-        response_vals[0] = "1.0"; // version
-        if (frames.size() >= 2)
-            response_vals[1] = view(frames[1]); // unique identifier
-        std::string &status_code = response_vals[2], &status_text = response_vals[3];
-
-        if (frames.size() < 6 || view(frames[0]) != "1.0") {
-            LMQ_LOG(error, "Bad ZAP authentication request: version != 1.0 or invalid ZAP message parts");
-            status_code = "500";
-            status_text = "Internal error: invalid auth request";
-        }
-        else if (frames.size() != 7 || view(frames[5]) != "CURVE") {
-            LMQ_LOG(error, "Bad ZAP authentication request: invalid CURVE authentication request");
-            status_code = "500";
-            status_text = "Invalid CURVE authentication request\n";
-        }
-        else if (frames[6].size() != 32) {
-            LMQ_LOG(error, "Bad ZAP authentication request: invalid request pubkey");
-            status_code = "500";
-            status_text = "Invalid public key size for CURVE authentication";
-        }
-        else {
-            auto domain = view(frames[2]);
-            if (domain != AUTH_DOMAIN_SN) {
-                LMQ_LOG(error, "Bad ZAP authentication request: invalid auth domain '", domain, "'");
+            auto ip = view(frames[3]), pubkey = view(frames[6]);
+            auto result = allow_connection(ip, pubkey);
+            cacheable = true;
+            bool sn = result.remote_sn;
+            auto& user_id = response_vals[4];
+            user_id = sn ? "S:" : "C:"; // see extract_pubkey()
+            user_id.resize(2 + 2 * pubkey.size());
+            to_hex(pubkey, &user_id[2]);
+
+            if (result.auth <= AuthLevel::denied || result.auth > AuthLevel::admin) {
+                LMQ_LOG(info, "Access denied for incoming ", (sn ? "service node" : "non-SN client"),
+                        " connection from ", string_view{&user_id[2], user_id.size()-2}, " at ", ip,
+                        " with initial auth level ", to_string(result.auth));
                 status_code = "400";
-                status_text = "Unknown authentication domain: " + std::string{domain};
+                status_text = "Access denied";
+                user_id.clear();
             } else {
-                auto ip = view(frames[3]), pubkey = view(frames[6]);
-                auto result = allow_connection(ip, pubkey);
-                bool sn = result.remote_sn;
-                auto& user_id = response_vals[4];
-                user_id.reserve(64);
-                to_hex(pubkey.begin(), pubkey.end(), std::back_inserter(user_id));
-
-                if (result.auth <= AuthLevel::denied || result.auth > AuthLevel::admin) {
-                    LMQ_LOG(info, "Access denied for incoming ", (sn ? "service node" : "non-SN client"),
-                            " connection from ", user_id, " at ", ip, " with initial auth level ", to_string(result.auth));
-                    status_code = "400";
-                    status_text = "Access denied";
-                    user_id.clear();
-                }
                 LMQ_LOG(info, "Accepted incoming ", (sn ? "service node" : "non-SN client"),
                         " connection with authentication level ", to_string(result.auth),
                         " from ", string_view{&user_id[2], user_id.size()-2}, " at ", ip);
@@ -1234,14 +2764,64 @@ void LokiMQ::process_zap_requests(zmq::socket_t &zap_auth) {
                 status_text = "";
             }
         }
+    }
 
-        LMQ_LOG(trace, "ZAP request result: ", status_code, " ", status_text);
+    LMQ_LOG(trace, "ZAP request result: ", status_code, " ", status_text);
+    return response_vals;
+}
 
-        std::vector<zmq::message_t> response;
-        response.reserve(response_vals.size());
-        for (auto &r : response_vals) response.push_back(create_message(std::move(r)));
-        send_message_parts(zap_auth, response.begin(), response.end());
+void LokiMQ::zap_authenticate_local(zap_frames& frames, std::vector<std::string>& response_vals) {
+    std::string &status_code = response_vals[2], &status_text = response_vals[3];
+    auto domain = view(frames[2]);
+    constexpr size_t prefix_len = sizeof(AUTH_DOMAIN_LOCAL) - 1;
+    size_t index = local_binds.size();
+    if (domain.size() > prefix_len && string_view{domain.data(), prefix_len} == AUTH_DOMAIN_LOCAL) {
+        string_view index_str{domain.data() + prefix_len, domain.size() - prefix_len};
+        auto parsed = detail::extract_unsigned(index_str);
+        if (index_str.empty())
+            index = parsed;
+    }
+    if (index >= local_binds.size()) {
+        LMQ_LOG(error, "Bad ZAP authentication request: invalid auth domain '", domain, "' for NULL authentication");
+        status_code = "400";
+        status_text = "Unknown authentication domain: " + std::string{domain};
+        return;
+    }
+
+    // For unix sockets with SO_PEERCRED support zmq gives us ":uid:gid:pid" as the address
+    auto credentials = view(frames[3]);
+    if (!credentials.empty() && credentials[0] == ':')
+        credentials.remove_prefix(1);
+    std::string pubkey;
+    auto result = local_binds[index].second(credentials, pubkey);
+    if (pubkey.size() != 32) {
+        LMQ_LOG(error, "Local connection allow callback for ", local_binds[index].first, " did not assign a valid pubkey; refusing connection");
+        status_code = "400";
+        status_text = "Access denied";
+        return;
     }
+    bool sn = result.remote_sn;
+    if (result.auth <= AuthLevel::denied || result.auth > AuthLevel::admin) {
+        LMQ_LOG(info, "Access denied for local connection from ", to_hex(pubkey), " (", credentials, ") on ",
+                local_binds[index].first, " with initial auth level ", to_string(result.auth));
+        status_code = "400";
+        status_text = "Access denied";
+        return;
+    }
+    LMQ_LOG(info, "Accepted local ", (sn ? "service node" : "non-SN client"), " connection with authentication level ",
+            to_string(result.auth), " from ", to_hex(pubkey), " (", credentials, ") on ", local_binds[index].first);
+
+    auto& user_id = response_vals[4];
+    user_id = sn ? "S:" : "C:"; // see extract_pubkey()
+    user_id.resize(2 + 2 * pubkey.size());
+    to_hex(pubkey, &user_id[2]);
+    auto& metadata = response_vals[5];
+    if (sn)
+        metadata += zmtp_metadata("X-SN", "1");
+    if (result.auth != AuthLevel::none)
+        metadata += zmtp_metadata("X-AuthLevel", to_string(result.auth));
+    status_code = "200";
+    status_text = "";
 }
 
 LokiMQ::~LokiMQ() {
@@ -1255,6 +2835,46 @@ void LokiMQ::connect(const std::string &pubkey, std::chrono::milliseconds keep_a
     detail::send_control(get_control_socket(), "CONNECT", bt_serialize<bt_dict>({{"pubkey",pubkey}, {"keep-alive",keep_alive.count()}, {"hint",hint}}));
 }
 
+void LokiMQ::queue_job(std::function<void()> job, std::chrono::milliseconds delay) {
+    // The proxy thread takes ownership of (and deletes) the job
+    bt_dict data{{"job", static_cast<int64_t>(reinterpret_cast<uintptr_t>(new std::function<void()>{std::move(job)}))}};
+    if (delay > 0ms)
+        data["delay"] = delay.count();
+    detail::send_control(get_control_socket(), "JOB", bt_serialize(data));
+}
+
+void LokiMQ::send_stream(const std::string& pubkey, const std::string& command, StreamProducer producer, bool optional) {
+    bt_dict data{{"pubkey", pubkey}, {"command", command},
+        // The proxy thread takes ownership of (and deletes) the producer
+        {"producer", static_cast<int64_t>(reinterpret_cast<uintptr_t>(new StreamProducer{std::move(producer)}))}};
+    if (optional)
+        data["optional"] = 1;
+    detail::send_control(get_control_socket(), "STREAM_OPEN", bt_serialize(data));
+}
+
+void LokiMQ::update_service_nodes(const std::vector<std::string>& added, const std::vector<std::string>& removed) {
+    detail::send_control(get_control_socket(), "UPDATE_SNS", bt_serialize<bt_dict>({
+            {"added", bt_list{added.begin(), added.end()}},
+            {"removed", bt_list{removed.begin(), removed.end()}}}));
+}
+
+void LokiMQ::invalidate_auth(const std::string& pubkey) {
+    detail::send_control(get_control_socket(), "AUTH_CACHE", bt_serialize<bt_dict>({{"pubkey", pubkey}}));
+}
+
+void LokiMQ::clear_auth_cache() {
+    detail::send_control(get_control_socket(), "AUTH_CACHE");
+}
+
+void LokiMQ::set_persistent_peers(const std::string& group, const std::vector<std::string>& pubkeys,
+        std::chrono::milliseconds keep_alive, ReadyCallback on_ready) {
+    bt_dict data{{"group", group}, {"pubkeys", bt_list{pubkeys.begin(), pubkeys.end()}}, {"keep-alive", keep_alive.count()}};
+    if (on_ready)
+        // The proxy thread takes ownership of (and deletes) the callback
+        data["ready"] = static_cast<int64_t>(reinterpret_cast<uintptr_t>(new ReadyCallback{std::move(on_ready)}));
+    detail::send_control(get_control_socket(), "PERSIST", bt_serialize(data));
+}
+
 
 }
 
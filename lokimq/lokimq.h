@@ -33,6 +33,9 @@
 #include <list>
 #include <queue>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <tuple>
 #include <memory>
 #include <functional>
 #include <thread>
@@ -41,6 +44,9 @@
 #include <chrono>
 #include <atomic>
 #include "bt_serialize.h"
+#include "bt_tape.h"
+#include "small_vector.h"
+#include "spool.h"
 #include "string_view.h"
 
 namespace lokimq {
@@ -78,15 +84,76 @@ struct Allow {
 
 class LokiMQ;
 
+/// The frames of a multipart zmq message.  Almost all of our messages have just a few parts, which
+/// this holds without allocating.
+using message_frames = small_vector<zmq::message_t, 4>;
+
+/// The frames of a ZAP request or reply, including the router envelope
+using zap_frames = small_vector<zmq::message_t, 9>;
+
+/// Callback that produces the data of an outgoing stream; see `LokiMQ::send_stream()`.  Each call
+/// should append the next chunk of data to `chunk` (which is empty when called) and return true if
+/// there is more data to come, false if this is the last chunk.
+using StreamProducer = std::function<bool(std::string& chunk)>;
+
+/// Details about the incoming stream that a Message belongs to (see `LokiMQ::send_stream()`).
+struct StreamInfo {
+    /// The stream id (as assigned by the sender; only unique in combination with the pubkey).  0
+    /// if the message is not part of a stream.
+    uint64_t id = 0;
+    /// The index of this chunk within the stream.  For an assembled stream this is the number of
+    /// chunks (all of which are in `Message::data`).
+    uint64_t index = 0;
+    /// True if this is the last chunk of the stream (always true for an assembled stream).
+    bool last = false;
+};
+
+/// The data parts of a Message after ownership has been taken with `Message::take_parts()`.  The
+/// `data` views remain valid for as long as the MessageParts object exists.
+class MessageParts {
+public:
+    std::vector<string_view> data; ///< The message data parts
+
+private:
+    friend class Message;
+    message_frames parts;
+    std::vector<std::string> decompressed;
+};
+
+/// A token for replying to a message after its callback has returned; see `Message::defer()`.  This
+/// is small, copyable, and may be used from any thread for as long as the LokiMQ object exists.
+class DeferredReply {
+public:
+    LokiMQ* lokimq; ///< The owning LokiMQ object
+    std::string pubkey; ///< The originator pubkey (32 bytes)
+    bool service_node; ///< True if the originator was a SN when the message was received
+    std::string route; ///< The listener route of an incoming connection; empty for outgoing connections
+
+    /// Sends a reply, as `Message::reply()` would.  If the message came in on our listening socket
+    /// this replies via that route; if the remote has since disconnected a service node will be
+    /// reconnected to (unless `send_option::optional` is given) while a non-SN reply is dropped.
+    template <typename... Args>
+    void reply(const std::string& command, Args&&... args) const;
+};
+
 /// Encapsulates an incoming message from a remote connection with message details plus extra
 /// info need to send a reply back through the proxy thread via the `reply()` method.  Note that
-/// this object gets reused: callbacks should use but not store any reference beyond the callback.
+/// this object gets reused: callbacks should use but not store any reference beyond the callback
+/// (use `take_parts()` to keep the message data).
 class Message {
 public:
     LokiMQ& lokimq; ///< The owning LokiMQ object
     std::vector<string_view> data; ///< The provided command data parts, if any.
     string_view pubkey; ///< The originator pubkey (32 bytes)
-    bool service_node; ///< True if the pubkey is an active SN (note that this is only checked on initial connection, not every received message)
+    bool service_node; ///< True if the pubkey is an active SN (as of the last `update_service_nodes()`, or as determined on initial connection if that is not used)
+    StreamInfo stream; ///< Set if this message is (or, for assembled streams, contains) the chunk(s) of an incoming stream
+    /// The time after which the sender no longer wants a reply (from a `send_option::ttl` on the
+    /// message or the category's maximum queue age), or time_point::max() if there is no deadline.
+    /// Long-running commands can check this to give up early.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+    /// Returns true if the message has a deadline (see `deadline`) that has passed.
+    bool expired() const { return std::chrono::steady_clock::now() >= deadline; }
 
     /// Constructor
     Message(LokiMQ& lmq) : lokimq{lmq} {}
@@ -106,6 +173,31 @@ public:
     /// an explicit `send_option::optional()` argument.
     template <typename... Args>
     void reply(const std::string& command, Args&&... args);
+
+    /// Replies with a stream of data (see `LokiMQ::send_stream()`).  As with `reply()` this is a
+    /// strong stream to a service node and an optional one (i.e. only over the existing connection)
+    /// otherwise.
+    void reply_stream(const std::string& command, StreamProducer producer);
+
+    /// Takes ownership of the message data parts so that they can be used after the callback
+    /// returns, without copying them.  The returned handle is reference counted and can be freely
+    /// copied and passed to other threads; `data` (which is updated to view into the returned
+    /// object) remains valid until the callback returns.  Calling this more than once returns the
+    /// same handle.
+    std::shared_ptr<const MessageParts> take_parts();
+
+    /// Returns a token that can be used to reply to this message after the callback returns (for
+    /// instance from a thread finishing some slow I/O on the message's behalf) so that the
+    /// callback does not need to keep the worker thread blocked.
+    DeferredReply defer() const { return {&lokimq, std::string{pubkey}, service_node, std::string{route}}; }
+
+private:
+    friend class LokiMQ;
+    message_frames* parts = nullptr; // The worker's message_parts backing `data`
+    std::vector<std::string>* decompressed = nullptr; // The worker's decompressed part buffers
+    const std::string* compressed = nullptr; // Bitmask of the parts that were decompressed
+    std::shared_ptr<MessageParts> taken; // Set once take_parts() has been called
+    string_view route; // The listener route for an incoming message; empty for outgoing connections
 };
 
 
@@ -121,6 +213,12 @@ static constexpr size_t MAX_CATEGORY_LENGTH = 50;
 /// Maximum length of a command
 static constexpr size_t MAX_COMMAND_LENGTH = 200;
 
+#ifdef __cpp_impl_coroutine
+class task; // Coroutine command handler return type; see coroutine.h
+#endif
+
+namespace detail { struct coroutine_access; }
+
 /**
  * Class that handles LokiMQ listeners, connections, proxying, and workers.  An application
  * typically has just one instance of this class.
@@ -128,6 +226,8 @@ static constexpr size_t MAX_COMMAND_LENGTH = 200;
 class LokiMQ {
 
 private:
+    friend class DeferredReply;
+    friend struct detail::coroutine_access;
 
     /// The global context
     zmq::context_t context;
@@ -177,6 +277,24 @@ public:
     /// connection, or AuthLevel::denied if the connection should be refused.
     using AllowFunc = std::function<Allow(string_view ip, string_view pubkey)>;
 
+    /// Callback type invoked to determine whether a new connection to a local (non-CURVE) listening
+    /// address (see `listen_local()`) is allowed and, since such connections have no CURVE pubkey,
+    /// to assign it one.
+    ///
+    /// @param credentials - the credentials of the connecting process, if available: for `ipc://`
+    /// sockets on systems that support SO_PEERCRED (e.g. Linux) this is "uid:gid:pid"; otherwise
+    /// it is empty.
+    /// @param pubkey - set this to the (32-byte) pubkey to assign to the connection; this identifies
+    /// the remote as the message `pubkey` (including for replies).
+    ///
+    /// @returns the Allow value for the connection, as for AllowFunc.
+    using LocalAllowFunc = std::function<Allow(string_view credentials, std::string& pubkey)>;
+
+    /// Callback invoked (from the proxy thread) once all the connections of a persistent peer group
+    /// have finished handshaking.  Because it runs in the proxy thread it must be quick and must
+    /// not block: typically it just schedules or signals whatever is waiting on the connections.
+    using ReadyCallback = std::function<void()>;
+
     /// Callback that is invoked when we need to send a "strong" message to a SN that we aren't
     /// already connected to and need to establish a connection.  This callback returns the ZMQ
     /// connection string we should use which is typically a string such as `tcp://1.2.3.4:5678`.
@@ -212,6 +330,106 @@ public:
      * after the high-level zmq socket is closed. */
     std::chrono::milliseconds CLOSE_LINGER = 5s;
 
+    /** If non-zero then message part compression is offered to peers (via ZMTP metadata) and any
+     * message part of at least this many bytes that we send to a peer that also offers compression
+     * is zstd-compressed (if that makes it smaller).  Compressed parts are transparently
+     * decompressed by the receiving worker.  This has no effect unless LokiMQ is built with
+     * LOKIMQ_ZSTD defined (and linked with libzstd).  Must be set before calling `start()`.
+     *
+     * Compression happens in the thread calling `send()` (or `reply()`), not in the proxy thread,
+     * and happens whether or not the peer turns out to accept compression: only the compressed
+     * part is passed to the proxy thread, which decompresses it again for a peer that doesn't
+     * accept compression (or for a message that gets spooled), so this shouldn't be set so low
+     * that most parts qualify when many peers don't support compression. */
+    size_t COMPRESS_THRESHOLD = 0;
+
+    /** If non-empty then strong (i.e. non-optional) sends to service nodes are spooled to a journal
+     * file in this directory (one file per remote pubkey) rather than being dropped or blocking
+     * the proxy thread when the remote can't currently accept them: that is, when no connection
+     * could be established, while a new outgoing connection hasn't completed its handshake, or when
+     * the connection's send queue is full (which typically happens when the remote is unreachable).
+     * Spooled messages are resent, in order, when the handshake completes or (periodically) once
+     * the remote accepts messages again, and spool files found in the directory at startup are
+     * resumed.  The directory is created if it doesn't exist.  Must be set before calling
+     * `start()`. */
+    std::string SPOOL_DIR;
+
+    /** The maximum size of each spool journal file; when a journal is full the oldest spooled
+     * messages for that remote are dropped. */
+    size_t SPOOL_MAX_SIZE = 64 * 1024 * 1024;
+
+    /** The maximum time a message stays in a spool; older messages are dropped rather than sent.
+     * Messages sent with a `send_option::ttl` are dropped after the shorter of that ttl and this
+     * value. */
+    std::chrono::milliseconds SPOOL_MAX_AGE = 1h;
+
+    /** The number of chunks of an incoming stream we allow the sender to have in flight: the sender
+     * does not send (and does not produce) more chunks until we grant more credit by handing
+     * chunks to workers. */
+    unsigned int STREAM_WINDOW = 8;
+
+    /** Maximum total size of an incoming stream delivered to an assembled stream command (see
+     * `add_stream_command()`); larger streams are aborted. */
+    int64_t MAX_STREAM_SIZE = 64 * 1024 * 1024;
+
+    /** Streams (in either direction) that see no progress for this long are dropped. */
+    std::chrono::milliseconds STREAM_TIMEOUT = 60s;
+
+    /** The maximum number of received messages from a single peer that we hold while waiting for
+     * a free worker.  Peers take turns having their queued messages dispatched (with service nodes
+     * and more privileged connections getting larger turns) so that one busy peer cannot starve the
+     * others.  Once a peer's queue is full we stop reading from its outgoing connection (leaving
+     * further messages to queue up in zmq) or, for incoming connections, drop its messages. */
+    size_t PEER_QUEUE_SIZE = 100;
+
+    /** If true (the default) then a command dropped because its deadline passed (see
+     * `send_option::ttl` and `set_max_queue_age()`) gets an "EXPIRED" reply (with the command name
+     * as the second part); if false such commands are dropped silently. */
+    bool REPLY_EXPIRED = true;
+
+    /** Queued commands that have been waiting at least this long are started before anything else
+     * regardless of category priority (see `add_category()`), so that a busy high priority category
+     * cannot starve lower priority categories indefinitely. */
+    std::chrono::milliseconds PRIORITY_AGING = 1s;
+
+    /** If non-zero then incoming connection authentication (i.e. the AllowFunc call during the
+     * ZAP handshake) is done on worker threads instead of in the proxy thread, with this many
+     * worker threads reserved for it, so that a slow AllowFunc (or a flood of new connections)
+     * does not hold up message routing.  Up to this many authentications (more if general workers
+     * are idle) run in parallel, so the AllowFunc must be thread-safe when this is used.  Must be
+     * set before calling `start()`. */
+    unsigned int ZAP_THREADS = 0;
+
+    /** If non-zero then the results of the AllowFunc for incoming connections are cached (by pubkey
+     * and IP address) for this long, so that a peer reconnecting within this time is authenticated
+     * without calling the AllowFunc again.  Call `invalidate_auth()` or `clear_auth_cache()` when
+     * cached results should no longer apply (e.g. after changing an allow list). */
+    std::chrono::milliseconds AUTH_CACHE_TTL = 0ms;
+
+    /** Maximum number of cached authentication results (see AUTH_CACHE_TTL); the oldest results are
+     * dropped when the cache is full. */
+    size_t AUTH_CACHE_SIZE = 10000;
+
+    /** Admission control for incoming connections: the sustained rate (per second) of connection
+     * handshakes we accept from any single IP address, and the burst above that rate allowed from
+     * an IP that has been quiet.  Handshakes over the limit are refused immediately, before
+     * calling the AllowFunc.  0 disables the per-IP limit. */
+    double HANDSHAKE_IP_RATE = 0;
+    unsigned int HANDSHAKE_IP_BURST = 20;
+
+    /** The same as HANDSHAKE_IP_RATE/HANDSHAKE_IP_BURST, but for all incoming handshakes together. */
+    double HANDSHAKE_RATE = 0;
+    unsigned int HANDSHAKE_BURST = 200;
+
+    /** The maximum number of IP addresses for which we track HANDSHAKE_IP_RATE usage; when more IPs
+     * than this are connecting the least recently seen IP is forgotten (and so gets a fresh burst
+     * allowance if it returns).  This bounds the memory used under a flood of handshakes. */
+    size_t HANDSHAKE_IP_TRACKED = 10000;
+
+    /** Maximum size of a received message part after decompression; a message containing a part
+     * that would decompress to more than this is dropped. */
+    int64_t MAX_DECOMPRESSED_SIZE = 16 * 1024 * 1024;
+
 private:
 
     /// The lookup function that tells us where to connect to a peer
@@ -237,6 +455,11 @@ private:
     /// Addresses to bind to in `start()`
     std::vector<std::string> bind_addresses;
 
+    /// Trusted local addresses on which we listen without CURVE (see `listen_local()`), along with
+    /// the callback that authenticates connections to each.  The index of each is used for its ZAP
+    /// domain.
+    std::vector<std::pair<std::string, LocalAllowFunc>> local_binds;
+
     /// Our listening ROUTER socket for incoming connections (will be left unconnected if not
     /// listening).
     zmq::socket_t listener;
@@ -269,6 +492,40 @@ private:
 
         /// After more than this much inactivity we will close an idle connection
         std::chrono::milliseconds idle_expiry;
+
+        /// True once our outgoing connection to this peer has completed its handshake (i.e. we
+        /// have received the HELLO reply to the HI we send when establishing the connection).
+        bool established = false;
+
+        /// True if the peer advertised that it accepts compressed message parts.  This is learned
+        /// from the metadata of messages received from the peer.
+        bool compress = false;
+
+        /// The number of persistent peer groups this peer belongs to; while non-zero the outgoing
+        /// connection is not subject to idle expiry.
+        unsigned int persistent = 0;
+
+        /// A received message waiting to be dispatched to a worker
+        struct inbound_message {
+            message_frames parts;
+            bool outgoing; ///< True if received on our outgoing connection, false for the listener
+            std::chrono::steady_clock::time_point received; ///< When we read the message
+        };
+
+        /// Messages received from this peer that are waiting for a worker (at most PEER_QUEUE_SIZE)
+        std::queue<inbound_message> inbound;
+
+        /// Deficit round robin counter: the number of messages this peer may still dispatch in its
+        /// current turn.
+        unsigned int deficit = 0;
+
+        /// True if this peer is in `inbound_peers`
+        bool scheduled = false;
+
+        /// The number of messages this peer gets to dispatch per deficit round robin turn
+        unsigned int dispatch_weight() const {
+            return service_node || auth_level == AuthLevel::admin ? 4 : auth_level == AuthLevel::basic ? 2 : 1;
+        }
     };
 
     struct pk_hash {
@@ -281,6 +538,99 @@ private:
     /// Currently peer connections, pubkey -> peer_info
     std::unordered_map<std::string, peer_info, pk_hash> peers;
 
+    /// The active service node pubkeys, maintained via `update_service_nodes()`.
+    std::unordered_set<std::string, pk_hash> active_service_nodes;
+
+    /// True once `update_service_nodes()` has been called at least once: from then on the SN status
+    /// of peers comes from `active_service_nodes` rather than the AllowFunc result at connection
+    /// time.
+    bool sn_set_managed = false;
+
+    /// Peers with messages in their `inbound` queue, in deficit round robin order
+    std::list<std::string> inbound_peers;
+
+    /// A named set of peers to which we maintain (and pre-handshake) outgoing connections; see
+    /// `set_persistent_peers()`.
+    struct peer_group {
+        /// The current members of the group
+        std::unordered_set<std::string, pk_hash> members;
+        /// Members whose connection hasn't yet finished handshaking (or failed); once this is empty
+        /// the `on_ready` callback (if any) is invoked.
+        std::unordered_set<std::string, pk_hash> pending;
+        /// Callback to invoke once all pending handshakes have finished
+        ReadyCallback on_ready;
+        /// When we give up waiting on `pending` and invoke `on_ready` anyway
+        std::chrono::steady_clock::time_point ready_deadline;
+    };
+    /// Persistent peer groups, by group name
+    std::unordered_map<std::string, peer_group> peer_groups;
+
+    /// Spool journals of messages waiting to be sent, by remote pubkey; only used if SPOOL_DIR is
+    /// set.  Entries are removed once their journal has been fully sent.
+    std::unordered_map<std::string, std::unique_ptr<spool_journal>, pk_hash> spools;
+
+    /// When we last tried to send spooled messages
+    std::chrono::steady_clock::time_point last_spool_attempt;
+
+    /// An outgoing stream that we are producing and sending to a peer
+    struct outgoing_stream {
+        std::string pubkey;
+        /// If true only send over an existing connection (i.e. a reply to a non-SN)
+        bool optional = false;
+        /// The producer callback; shared with the worker currently running it, if any.
+        std::shared_ptr<StreamProducer> producer;
+        /// Chunks produced but not yet sent (waiting for credit)
+        std::queue<std::string> queued;
+        /// The number of chunks the receiver has told us we may send
+        unsigned int credits = 0;
+        /// True while the producer is scheduled or running on a worker
+        bool producing = false;
+        /// True once the producer has returned its last chunk
+        bool finished = false;
+        /// Last time the stream made progress (for STREAM_TIMEOUT)
+        std::chrono::steady_clock::time_point last_activity;
+    };
+    /// Outgoing streams, by stream id
+    std::unordered_map<uint64_t, outgoing_stream> outgoing_streams;
+    /// The id assigned to the next outgoing stream
+    uint64_t next_stream_id = 1;
+
+    struct category;
+
+    /// An incoming stream that we are receiving from a peer and handing off to workers
+    struct incoming_stream {
+        std::string pubkey;
+        uint64_t id;
+        std::string command;
+        category* cat;
+        const CommandCallback* callback;
+        /// True if the chunks are all collected and delivered to one callback invocation
+        bool assemble;
+        /// Chunks received but not yet handed to a worker
+        std::queue<zmq::message_t> chunks;
+        /// Total size of the chunks collected so far (only tracked for assembled streams)
+        int64_t size = 0;
+        /// Chunks we have granted credit for but not yet received; a chunk arriving when this is 0
+        /// cancels the stream.
+        uint64_t credit = 0;
+        /// The index of the next chunk to be handed to a worker
+        uint64_t next_index = 0;
+        /// True while a worker is processing a chunk of this stream
+        bool busy = false;
+        /// True once the last chunk has been received
+        bool ended = false;
+        /// Last time the stream made progress (for STREAM_TIMEOUT)
+        std::chrono::steady_clock::time_point last_activity;
+    };
+    /// Incoming streams, keyed by sender pubkey + stream id
+    std::unordered_map<std::string, incoming_stream> incoming_streams;
+
+    /// Internal jobs (such as coroutine resumptions) waiting for a free worker
+    std::queue<std::function<void()>> internal_jobs;
+
+    /// Internal jobs waiting for a timer to expire, by expiry time
+    std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> timer_jobs;
+
     /// different polling sockets the proxy handler polls: this always contains some internal
     /// sockets for inter-thread communication followed by listener socket and a pollitem for every
     /// (outgoing) remote socket in `remotes`.  This must be in a sequential vector because of zmq
@@ -294,7 +644,7 @@ private:
     static constexpr size_t poll_internal_size = 3;
 
     /// The pollitems location corresponding to `remotes[0]`.
-    const size_t poll_remote_offset; // will be poll_internal_size + 1 for a full listener (the +1 is the listening socket); poll_internal_size for a remote-only
+    size_t poll_remote_offset = poll_internal_size; // set by proxy_loop: poll_internal_size + 1 if we have a listener (the +1 is the listening socket); poll_internal_size for a remote-only
 
     /// The outgoing remote connections we currently have open along with the remote pubkeys.  Each
     /// element [i] here corresponds to an the pollitem_t at pollitems[i+1+poll_internal_size].
@@ -310,6 +660,48 @@ private:
     /// Router socket to reach internal worker threads from proxy
     zmq::socket_t workers_socket{context, zmq::socket_type::router};
 
+    /// Router socket on which we receive ZAP authentication requests from zmq (for incoming
+    /// connections) and send back the replies.
+    zmq::socket_t zap_auth{context, zmq::socket_type::router};
+
+    /// ZAP requests (including the router envelope) waiting for a worker when ZAP_THREADS is set
+    std::queue<zap_frames> zap_pending;
+
+    /// Simple token bucket for rate limiting handshakes
+    struct token_bucket {
+        double tokens;
+        std::chrono::steady_clock::time_point last;
+        /// Refills the bucket for the time elapsed since the last call then takes a token, if there
+        /// is one.  Returns false if the bucket is empty.
+        bool take(double rate, unsigned int burst, std::chrono::steady_clock::time_point now);
+    };
+    /// Global handshake rate limiter (see HANDSHAKE_RATE)
+    token_bucket handshake_bucket{-1, {}};
+    /// Per-IP handshake rate limiters (see HANDSHAKE_IP_RATE), most recently used first
+    std::list<std::pair<std::string, token_bucket>> handshake_ip_buckets;
+    /// Index into `handshake_ip_buckets`
+    std::unordered_map<std::string, decltype(handshake_ip_buckets)::iterator> handshake_ip_index;
+    /// Counts of handshakes refused by the per-IP and global limits
+    std::atomic<uint64_t> handshakes_rejected_ip{0}, handshakes_rejected_global{0};
+
+    /// Applies the handshake rate limits to a ZAP request (including the router envelope); if over
+    /// a limit this sends a refusal and returns false.
+    bool proxy_zap_admit(zap_frames& frames);
+
+    /// A cached ZAP reply for a pubkey/IP (see AUTH_CACHE_TTL)
+    struct auth_cache_entry {
+        /// The reply frames (without the router envelope); the request id gets replaced on use
+        std::vector<std::string> reply;
+        std::chrono::steady_clock::time_point expiry;
+    };
+    /// Cached ZAP replies, by pubkey then IP
+    std::unordered_map<std::string, std::unordered_map<std::string, auth_cache_entry>> auth_cache;
+    /// The number of entries in `auth_cache`
+    size_t auth_cache_count = 0;
+    /// Cached pubkey/IP/expiry values in insertion (and thus expiry) order, for expiring and
+    /// evicting entries.  May contain stale values for entries that have been replaced or removed.
+    std::queue<std::tuple<std::string, std::string, std::chrono::steady_clock::time_point>> auth_cache_order;
+
     /// indices of idle, active workers
     std::vector<unsigned int> idle_workers;
 
@@ -331,10 +723,33 @@ private:
     /// be done in the proxy thread anyway (if we forwarded to a worker the worker would just have
     /// to send an instruction back to the proxy to do it).  Returns true if one was handled, false
     /// to continue with sending to a worker.
-    bool proxy_handle_builtin(size_t conn_index, std::vector<zmq::message_t>& parts);
+    bool proxy_handle_builtin(size_t conn_index, message_frames& parts);
+
+    /// Reads waiting messages from the listener and outgoing connections, handling builtin commands
+    /// immediately and queuing everything else on the sending peer's inbound queue.
+    void proxy_read_incoming();
+
+    /// Adds a received message to its peer's inbound queue (dropping it if the queue is full).
+    void proxy_queue_incoming(size_t conn_index, message_frames&& parts);
+
+    /// Dispatches queued inbound messages to workers, taking turns between peers with deficit
+    /// round robin (weighted by `peer_info::dispatch_weight()`).
+    void proxy_dispatch_incoming();
+
+    /// Records the route of an incoming connection (updating any handshake waiters if this is a
+    /// new connection).
+    void proxy_update_incoming_route(const std::string& pubkey, peer_info& peer, string_view route);
 
     /// Sets up a job for a worker then signals the worker (or starts a worker thread)
-    void proxy_to_worker(size_t conn_index, std::vector<zmq::message_t>& parts);
+    void proxy_to_worker(size_t conn_index, message_frames& parts,
+            std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now());
+
+    /// Returns true if a worker is available (idle, or there is room to start a new one)
+    bool proxy_worker_available() const { return !idle_workers.empty() || workers.size() < max_workers; }
+
+    /// Returns true if a job in the given category (or an internal job, if nullptr) may start now
+    /// given the general and reserved thread limits.
+    bool proxy_can_work(const category* cat) const;
 
     /// proxy thread command handlers for commands sent from the outer object QUIT.  This doesn't
     /// get called immediately on a QUIT command: the QUIT commands tells workers to quit, then this
@@ -348,26 +763,125 @@ private:
 
     /// CONNECT command telling us to connect to a new pubkey.  Returns the socket (which could be
     /// existing or a new one).
-    std::pair<zmq::socket_t*, std::string> proxy_connect(bt_dict&& data);
+    std::pair<zmq::socket_t*, std::string> proxy_connect(const bt_document& data);
 
     /// DISCONNECT command telling us to disconnect our remote connection to the given pubkey (if we
     /// have one).
     void proxy_disconnect(const std::string& pubkey);
 
     /// SEND command.  Does a connect first, if necessary.
-    void proxy_send(bt_dict&& data);
+    void proxy_send(const bt_document& data);
+
+    /// SEND to our own pubkey: dispatches the command directly (with our own identity) rather than
+    /// connecting to ourself and going through the listener.
+    void proxy_send_self(const bt_document& data);
+
+    /// Opens the spool journals left in SPOOL_DIR by a previous run (creating SPOOL_DIR if needed).
+    void proxy_open_spools();
+
+    /// Appends a SEND message to the spool of the given remote, opening a new journal if needed.
+    void proxy_spool(const std::string& pubkey, const bt_document& data);
+
+    /// Sends as many of the spooled messages of the given spool as the remote currently accepts.
+    /// Returns true if the spool was fully sent (in which case it is removed and `it` is
+    /// invalidated), false if messages remain.
+    bool proxy_drain_spool(decltype(spools)::iterator it, const std::string& connect_hint = "");
+
+    /// True if `sock` (as returned by proxy_connect for `pubkey`) is ready for spooled messages:
+    /// either it is the listener (i.e. the remote is connected to us), or it is our outgoing
+    /// connection and its HI/HELLO handshake has completed.  Until then zmq would just queue
+    /// messages for a remote that may not be up at all.
+    bool proxy_route_established(const zmq::socket_t* sock, const std::string& pubkey);
+
+    /// Tries to send any spooled messages; called periodically from the proxy loop.
+    void proxy_process_spools();
 
     /// REPLY command.  Like SEND, but only has a listening socket route to send back to and so is
     /// weaker (i.e. it cannot reconnect to the SN if the connection is no longer open).
-    void proxy_reply(bt_dict&& data);
+    void proxy_reply(const bt_document& data);
 
-    /// ZAP (https://rfc.zeromq.org/spec:27/ZAP/) authentication handler; this is called with the
-    /// zap auth socket to do non-blocking processing of any waiting authentication requests waiting
-    /// on it to verify whether the connection is from a valid/allowed SN.
-    void process_zap_requests(zmq::socket_t& zap_auth);
+    /// ZAP (https://rfc.zeromq.org/spec:27/ZAP/) authentication handler; this is called to do
+    /// non-blocking processing of any authentication requests waiting on the zap auth socket to
+    /// verify whether the connection is from a valid/allowed SN.  The requests are handled
+    /// immediately, or handed off to workers if ZAP_THREADS is set.
+    void process_zap_requests();
+
+    /// Handles a single ZAP request (with the router envelope already removed) and returns the
+    /// reply frames.  Called in the proxy thread or, with ZAP_THREADS, in a worker.  `cacheable`
+    /// is set to true if the reply is an AllowFunc result that may be cached.
+    std::vector<std::string> zap_authenticate(zap_frames& frames, bool& cacheable);
+
+    /// Handles the NULL mechanism ZAP request of a connection to one of the `local_binds`, filling
+    /// in the status, user id and metadata of `response_vals`.
+    void zap_authenticate_local(zap_frames& frames, std::vector<std::string>& response_vals);
+
+    /// Replies to a ZAP request (including the router envelope) from the auth cache, if it has a
+    /// live entry for the request's pubkey and IP.  Returns true if a reply was sent.
+    bool proxy_zap_cached(zap_frames& frames);
+
+    /// Adds a ZAP reply to the auth cache, evicting expired (and, if full, the oldest) entries.
+    void proxy_auth_cache_insert(std::string pubkey, std::string ip, std::vector<std::string> reply);
+
+    /// AUTH_CACHE command: removes the cached auth results of a pubkey (or of everyone)
+    void proxy_auth_cache_invalidate(const bt_document& data);
 
     /// Handles a control message from some outer thread to the proxy
-    void proxy_control_message(std::vector<zmq::message_t> parts);
+    void proxy_control_message(message_frames parts);
+
+    /// The parsed data of the control message currently being handled (reused for each message)
+    bt_document control_data;
+
+    /// PERSIST command: replaces the member list of a persistent peer group, connecting to any new
+    /// members and releasing removed members to the usual idle expiry.
+    void proxy_set_persistent(const bt_document& data);
+
+    /// UPDATE_SNS command: applies added/removed service node pubkeys to `active_service_nodes` and
+    /// to the SN status of any existing peer records.
+    void proxy_update_service_nodes(const bt_document& data);
+
+    /// Called when a peer finishes (or fails) its handshake to update any persistent groups waiting
+    /// on it, firing the group's ready callback once nothing is pending.
+    void proxy_handshake_done(const std::string& pubkey);
+
+    /// Fires (and clears) the ready callback of the given group if it has no pending handshakes.
+    void proxy_check_group_ready(peer_group& group);
+
+    /// Fires the ready callback of any group whose handshakes haven't all finished by its
+    /// deadline, treating the remaining members as failed.
+    void proxy_expire_group_handshakes();
+
+    /// STREAM_OPEN command: starts an outgoing stream.
+    void proxy_stream_open(const bt_document& data);
+
+    /// STREAM_DATA command: a chunk returned by a stream producer running on a worker.
+    void proxy_stream_data(const bt_document& data, zmq::message_t& chunk);
+
+    /// Sends whatever queued chunks the stream has credit for and schedules the producer if more
+    /// data is needed.  Returns false if the stream is finished (or failed) and has been removed.
+    bool proxy_stream_send(uint64_t id, outgoing_stream& s);
+
+    /// Handles the STREAM* builtin commands received from a remote.
+    void proxy_stream_builtin(size_t conn_index, const std::string& pubkey, string_view cmd,
+            message_frames& parts, size_t first_arg);
+
+    /// Hands queued stream work (producer jobs and incoming chunks) off to available workers.
+    void proxy_process_streams();
+
+    /// Sends a builtin command (and its arguments) to a peer over an existing connection, if any.
+    /// Returns false if there is no connection or the send failed.
+    bool proxy_send_builtin(const std::string& pubkey, std::vector<std::string> parts);
+
+    /// Drops streams that have made no progress within STREAM_TIMEOUT.
+    void proxy_expire_streams();
+
+    /// JOB and TIMER commands: queues an internal job to run now or after a delay.
+    void proxy_queue_job(const bt_document& data);
+
+    /// Queues any timer jobs that have expired and hands internal jobs off to available workers.
+    void proxy_process_jobs();
+
+    /// Queues an internal job to be run by a worker thread.  Can be called from any thread.
+    void queue_job(std::function<void()> job, std::chrono::milliseconds delay = 0ms);
 
     /// Closing any idle connections that have outlived their idle time.  Note that this only
     /// affects outgoing connections; incomings connections are the responsibility of the other end.
@@ -381,18 +895,61 @@ private:
     struct category {
         Access access;
         std::unordered_map<std::string, CommandCallback> commands;
+        /// Commands whose incoming streams are assembled and delivered in one callback
+        std::unordered_set<std::string> assembled_streams;
         unsigned int reserved_threads = 0;
         unsigned int active_threads = 0;
-        std::queue<std::list<zmq::message_t>> pending; // FIXME - vector?
+
+        /// A received command waiting for a worker
+        struct pending_command {
+            std::string command;
+            const CommandCallback* callback;
+            std::string pubkey;
+            bool service_node;
+            std::string route; ///< The listener route, for an incoming connection
+            std::string compressed; ///< See run_info::compressed
+            message_frames parts; ///< The data parts (i.e. without route or command)
+            std::chrono::steady_clock::time_point queued; ///< When the command was queued
+            /// The command is dropped instead of started if still queued at this time
+            std::chrono::steady_clock::time_point deadline;
+        };
+        /// Commands waiting for a worker to become available for this category
+        std::queue<pending_command> pending;
         int max_queue = 200;
+        /// Queued commands in higher priority categories are started first (see PRIORITY_AGING)
+        int priority = 0;
+        /// If non-zero, queued commands are dropped once they have waited this long
+        std::chrono::milliseconds max_age{0};
 
-        category(Access access, unsigned int reserved_threads, int max_queue)
-            : access{access}, reserved_threads{reserved_threads}, max_queue{max_queue} {}
+        category(Access access, unsigned int reserved_threads, int max_queue, int priority)
+            : access{access}, reserved_threads{reserved_threads}, max_queue{max_queue}, priority{priority} {}
     };
 
     /// Categories, mapped by category name.
     std::unordered_map<std::string, category> categories;
 
+    /// Internal category for ZAP authentication jobs (used to reserve ZAP_THREADS workers)
+    category zap_category{Access{}, 0, 0, 0};
+
+    /// Pointers to the categories in descending priority order (set up when the proxy starts)
+    std::vector<category*> categories_by_priority;
+
+    /// The total number of commands waiting in category `pending` queues
+    size_t queued_commands = 0;
+
+    /// Starts a command on an available worker if it may run now, otherwise queues it in its
+    /// category (or drops it if the queue is full or its deadline has already passed).
+    void proxy_queue_command(category& cat, category::pending_command&& cmd);
+
+    /// Starts a command on an available worker
+    void proxy_run_command(category& cat, category::pending_command&& cmd);
+
+    /// Starts queued commands as workers become available, highest priority category first
+    void proxy_process_queued();
+
+    /// Drops a command whose deadline has passed, replying EXPIRED if REPLY_EXPIRED is set
+    void proxy_expired(const category::pending_command& cmd);
+
     /// For enabling backwards compatibility with command renaming: this allows mapping one command
     /// to another in a different category (which happens before the category and command lookup is
     /// done).
@@ -401,16 +958,17 @@ private:
     /// Retrieve category and callback from a command name, including alias mapping.  Warns on
     /// invalid commands and returns nullptrs.  The command name will be updated in place if it is
     /// aliased to another command.
-    std::pair<const category*, const CommandCallback*> get_command(std::string& command);
+    std::pair<category*, const CommandCallback*> get_command(std::string& command);
+
+    /// Looks up (or creates) the peer_info for the given pubkey of a peer that sent us a message,
+    /// applying the SN status of the connection (or of the managed SN list).
+    peer_info& proxy_lookup_peer(const std::string& pubkey, bool service_node);
 
     /// Checks a peer's authentication level.  Returns true if allowed, warns and returns false if
     /// not.
     bool proxy_check_auth(const std::string& pubkey, size_t conn_index, const peer_info& peer,
             const std::string& command, const category& cat, zmq::message_t& msg);
 
-    /// 
-
-
     /// End of proxy-specific members
     ///////////////////////////////////////////////////////////////////////////////////
 
@@ -422,11 +980,31 @@ private:
         std::string pubkey;
         bool service_node = false;
         const CommandCallback* callback = nullptr;
-        std::vector<zmq::message_t> message_parts;
+        /// The category of the command being run (for active thread tracking); nullptr for internal jobs
+        category* cat = nullptr;
+        /// If set then the worker runs this internal job instead of a command callback
+        std::function<void()> job;
+        /// Stream details for a stream chunk job
+        StreamInfo stream;
+        /// The `incoming_streams` key of the stream this job is processing, if any
+        std::string stream_key;
+        /// The ZAP reply (router envelope included) produced by a ZAP authentication job, to be
+        /// sent by the proxy when the worker reports back READY.
+        std::vector<std::string> zap_reply;
+        /// The pubkey and IP of a cacheable `zap_reply`; empty if not cacheable
+        std::pair<std::string, std::string> zap_cache_key;
+        std::string route; ///< The listener route of an incoming message; empty for outgoing connections
+        message_frames message_parts;
+        /// Bitmask of the `message_parts` that are compressed: bit (i % 8) of byte (i / 8) is set if
+        /// part i needs decompressing.  Empty if nothing is compressed.
+        std::string compressed;
+        /// The deadline of the command (see `Message::deadline`)
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
 
     private:
         friend class LokiMQ;
         std::thread thread;
+        unsigned int worker_index;
         std::string routing_id;
     };
     /// Data passed to workers for the RUN command.  The proxy thread sets elements in this before
@@ -435,6 +1013,14 @@ private:
     /// change it.
     std::vector<run_info> workers;
 
+    /// Returns an available worker (idle or, if none are idle, a newly allocated one) to be set up
+    /// for a job.  Must only be called when `proxy_worker_available()` is true.
+    run_info& get_idle_worker();
+
+    /// Starts (or wakes up) the worker returned by `get_idle_worker()` to run the job it has been
+    /// set up with.
+    void proxy_run_worker(run_info& run);
+
 public:
     /**
      * LokiMQ constructor.  This constructs the object but does not start it; you will typically
@@ -525,8 +1111,23 @@ public:
      * for a category exceeds this many incoming messages then new messages will be dropped until
      * some messages are processed off the queue.  -1 means unlimited, 0 means we will just drop
      * messages for this category when no workers are available.
+     *
+     * @param priority the dispatch priority of this category: when workers become available queued
+     * commands are started from higher priority categories first (within a category, in the order
+     * they arrived), so that, for example, SN traffic does not wait behind queued public requests.
+     * To avoid starving lower priority categories entirely, any command that has been queued for
+     * longer than PRIORITY_AGING is started first, regardless of priority.
      */
-    void add_category(std::string name, Access access_level, unsigned int reserved_threads = 0, int max_queue = 200);
+    void add_category(std::string name, Access access_level, unsigned int reserved_threads = 0, int max_queue = 200, int priority = 0);
+
+    /**
+     * Sets the maximum time commands in a category may wait in the queue for a worker: commands
+     * still queued after this long are dropped (see REPLY_EXPIRED) as the caller has likely given
+     * up on them by then.  This acts as a default deadline for commands that don't have a shorter
+     * one given by the sender (via `send_option::ttl`).  0 (the default) means no limit.  This
+     * method may not be invoked after `start()` has been called.
+     */
+    void set_max_queue_age(const std::string& category, std::chrono::milliseconds max_age);
 
     /**
      * Adds a new command to an existing category.  This method may not be invoked after `start()`
@@ -540,6 +1141,31 @@ public:
      */
     void add_command(const std::string& category, std::string name, CommandCallback callback);
 
+#ifdef __cpp_impl_coroutine
+    /**
+     * Adds a coroutine command: the same as the above, but the callback returns a `lokimq::task`
+     * and so may `co_await` timers, jobs and other events without holding on to a worker thread
+     * while it waits (see coroutine.h, which must be included to use this).  Note that the Message
+     * itself is only valid until the coroutine first suspends.
+     */
+    template <typename F, std::enable_if_t<std::is_same<
+        decltype(std::declval<F&>()(std::declval<Message&>())), task>::value, int> = 0>
+    void add_command(const std::string& category, std::string name, F callback) {
+        add_command(category, std::move(name), CommandCallback{[this, callback = std::move(callback)](Message& m) mutable {
+            callback(m).start(*this);
+        }});
+    }
+#endif
+
+    /**
+     * Adds a command that is intended to receive streams (see `send_stream()`).  Any command can be
+     * the target of a stream; by default each chunk is delivered in its own callback invocation (in
+     * order, one at a time, with `Message::stream` describing the chunk).  If `assemble` is true
+     * then the chunks are instead collected (up to `MAX_STREAM_SIZE` bytes) and delivered together
+     * in a single invocation with one `Message::data` element per chunk.
+     */
+    void add_stream_command(const std::string& category, std::string name, CommandCallback callback, bool assemble);
+
     /**
      * Adds a command alias; this is intended for temporary backwards compatibility: if any aliases
      * are defined then every command (not just aliased ones) has to be checked on invocation to see
@@ -556,6 +1182,35 @@ public:
      */
     void add_command_alias(std::string from, std::string to);
 
+    /**
+     * Adds a trusted local address (typically an `ipc://` socket) on which to listen for
+     * connections *without* CURVE: connections on this address have no key exchange handshake and
+     * no per-message encryption, which avoids their cost for local processes such as the storage
+     * server or lokinet.  This must only be used for addresses that only trusted local processes
+     * can connect to (e.g. a unix socket in a directory with appropriate permissions): the remote
+     * is not cryptographically authenticated.
+     *
+     * Since the remote has no CURVE key, `allow` assigns the pubkey that identifies it (and its
+     * auth level and SN status), typically based on the connecting process credentials.  This
+     * method may not be invoked after `start()` has been called.
+     *
+     * @param bind - the address to bind, e.g. "ipc:///path/to/lokid.sock"
+     * @param allow - callback invoked during the connection handshake; see LocalAllowFunc.  As with
+     * the AllowFunc it may be invoked on a worker thread when ZAP_THREADS is set.
+     */
+    void listen_local(std::string bind, LocalAllowFunc allow);
+
+    /**
+     * Adds a trusted local address on which to listen without CURVE where all connections are
+     * assigned a fixed pubkey and access level; see the above overload.
+     *
+     * @param bind - the address to bind, e.g. "ipc:///path/to/lokid.sock"
+     * @param pubkey - the 32-byte pubkey assigned to all connections to this address (for example,
+     * the storage server's pubkey)
+     * @param allow - the auth level and SN status given to all connections to this address
+     */
+    void listen_local(std::string bind, std::string pubkey, Allow allow = {AuthLevel::admin, false});
+
     /**
      * Finish starting up: binds to the bind locations given in the constructor and launches the
      * proxy thread to handle message dispatching between remote nodes and worker threads.
@@ -618,6 +1273,87 @@ public:
     template <typename... T>
     void send(const std::string& pubkey, const std::string& cmd, const T&... opts);
 
+    /**
+     * Opens a stream of data to the given peer.  Streams allow sending results far larger than the
+     * maximum message size, as a series of chunks with flow control: the receiver grants credit
+     * for a limited number of chunks (`STREAM_WINDOW`) at a time, and the producer is only invoked
+     * when there is credit for another chunk, so neither side buffers more than that window.  Each
+     * chunk is a separate message, so other messages to the peer are interleaved with the stream
+     * rather than waiting behind it.
+     *
+     * @param pubkey - the pubkey of the recipient
+     * @param command - the recipient command that receives the stream (see `add_stream_command()`)
+     * @param producer - callback invoked on a worker thread to produce each chunk (see
+     *                   `StreamProducer`).  Chunks must not exceed the recipient's maximum message
+     *                   size.
+     * @param optional - if true only send over an existing connection (as with
+     *                   `send_option::optional`).
+     */
+    void send_stream(const std::string& pubkey, const std::string& command, StreamProducer producer, bool optional = false);
+
+    /**
+     * Declares the complete set of peers that belong to the named persistent group, for example the
+     * members of an upcoming quorum.  The proxy thread compares the set against the group's
+     * previous members: connections to new members are started immediately (all in parallel, and
+     * each one is handshaked without waiting for a message to be sent), while members no longer in
+     * the group (and not in any other group) are left to close normally once idle for their
+     * keep-alive time.  Connections to members of a group are never closed for inactivity.
+     *
+     * Calling this with an empty `pubkeys` removes the group.
+     *
+     * @param group - an arbitrary name for the group; each group is maintained independently.
+     * @param pubkeys - the pubkeys (32-byte binary strings) of the group members
+     * @param keep_alive - the idle timeout applied to new connections (and, as with `connect()`,
+     *                     to existing connections with a shorter timeout).  This is what
+     *                     determines how long a connection lingers after leaving the group.
+     * @param on_ready - optional callback invoked once every member of the group has either
+     *                   completed its connection handshake or failed to connect (members that
+     *                   haven't done either within SN_HANDSHAKE_TIME are treated as failed).  Note
+     *                   that this is invoked in the proxy thread: see `ReadyCallback`.  If the
+     *                   group is updated again before the callback fires the previous callback is
+     *                   dropped.
+     */
+    void set_persistent_peers(const std::string& group, const std::vector<std::string>& pubkeys,
+            std::chrono::milliseconds keep_alive = 5min, ReadyCallback on_ready = nullptr);
+
+    /**
+     * Updates the set of active service nodes.  The change is applied directly to existing
+     * connections (both incoming and outgoing) so that SN-only commands from a newly deregistered
+     * node are refused, and commands from a newly registered node are accepted, without needing to
+     * reconnect.  The cost in the proxy thread is proportional to the size of the change, not the
+     * size of the service node list, so this is intended to be called with just the changes from
+     * each new block.
+     *
+     * Once this has been called the SN status of new connections also comes from this set rather
+     * than from the `remote_sn` value returned by the AllowFunc; callers should therefore pass the
+     * full initial list (as `added`) the first time this is called.  That first call also rechecks
+     * every existing connection against the list, so that peers the AllowFunc accepted as service
+     * nodes but which aren't in the list lose their SN status.
+     *
+     * @param added - pubkeys (32-byte binary strings) of newly active service nodes
+     * @param removed - pubkeys of service nodes that are no longer active
+     */
+    void update_service_nodes(const std::vector<std::string>& added, const std::vector<std::string>& removed);
+
+    /// Removes any cached authentication results for the given pubkey (see AUTH_CACHE_TTL) so that
+    /// its next connection calls the AllowFunc again.
+    void invalidate_auth(const std::string& pubkey);
+
+    /// Removes all cached authentication results (see AUTH_CACHE_TTL).
+    void clear_auth_cache();
+
+    /// Counts of incoming connection handshakes refused by admission control (see
+    /// HANDSHAKE_IP_RATE and HANDSHAKE_RATE).
+    struct HandshakeStats {
+        uint64_t rejected_ip; ///< Refused because the connecting IP exceeded HANDSHAKE_IP_RATE
+        uint64_t rejected_global; ///< Refused because all handshakes together exceeded HANDSHAKE_RATE
+    };
+
+    /// Returns the handshake admission control counters.  Can be called from any thread.
+    HandshakeStats handshake_stats() const {
+        return {handshakes_rejected_ip.load(std::memory_order_relaxed), handshakes_rejected_global.load(std::memory_order_relaxed)};
+    }
+
     /**
      * Similar to the above, but takes an iterator pair of message parts to send after the value.
      *
@@ -667,6 +1403,15 @@ struct optional {};
 /// and dropped otherwise.
 struct incoming {};
 
+/// Specifies how long the sender wants the message to be processed within: if the recipient cannot
+/// start processing the message within this time (measured from when it receives it) then the
+/// message is dropped (with an "EXPIRED" reply) rather than processed.  The remaining time is also
+/// available to the recipient's command callback (see `Message::deadline`).
+struct ttl {
+    std::chrono::milliseconds time;
+    ttl(std::chrono::milliseconds time) : time{std::move(time)} {}
+};
+
 /// Specifies the idle timeout for the connection - if a new or existing outgoing connection is used
 /// for the send and its current idle timeout setting is less than this value then it is updated.
 struct keep_alive {
@@ -682,6 +1427,13 @@ namespace detail {
 // data (only sent if the data is non-empty).
 void send_control(zmq::socket_t& sock, string_view cmd, std::string data = {});
 
+// Compresses (on the calling thread) the data parts of the "send" list of `control_data` that are
+// at least `threshold` bytes, replacing them in place, and sets "compressed" to a bitmask of the
+// compressed parts (in the same format as the `z` command flag) so that the proxy can pass them on
+// as they are or decompress them, depending on what the peer accepts.  Does nothing if `threshold`
+// is 0 or compression isn't available.
+void compress_send_parts(bt_dict& control_data, size_t threshold);
+
 /// Base case: takes a serializable value and appends it to the message parts
 template <typename T>
 void apply_send_option(bt_list& parts, bt_dict&, const T& arg) {
@@ -713,6 +1465,11 @@ template <> inline void apply_send_option(bt_list&, bt_dict& control_data, const
     control_data["keep-alive"] = timeout.time.count();
 }
 
+/// `ttl` specialization: sets the message time-to-live in the control data
+template <> inline void apply_send_option(bt_list&, bt_dict& control_data, const send_option::ttl& ttl) {
+    control_data["ttl"] = ttl.time.count();
+}
+
 /// Calls apply_send_option on each argument and returns a bt_dict with the command plus data stored
 /// in the "send" key plus whatever else is implied by any given option arguments.
 template <typename InputIt, typename... T>
@@ -736,6 +1493,7 @@ template <typename InputIt, typename... T>
 void LokiMQ::send(const std::string& pubkey, const std::string& cmd, InputIt first, InputIt last, const T &...opts) {
     bt_dict control_data = detail::send_control_data(cmd, std::move(first), std::move(last), opts...);
     control_data["pubkey"] = pubkey;
+    detail::compress_send_parts(control_data, COMPRESS_THRESHOLD);
     detail::send_control(get_control_socket(), "SEND", bt_serialize(control_data));
 }
 
@@ -751,6 +1509,27 @@ void Message::reply(const std::string& command, Args&&... args) {
     else lokimq.send(pubkey, command, send_option::optional{}, std::forward<Args>(args)...);
 }
 
+template <typename... Args>
+void DeferredReply::reply(const std::string& command, Args&&... args) const {
+    if (route.empty()) {
+        if (service_node) lokimq->send(pubkey, command, std::forward<Args>(args)...);
+        else lokimq->send(pubkey, command, send_option::optional{}, std::forward<Args>(args)...);
+        return;
+    }
+    const std::string* no_it = nullptr;
+    bt_dict control_data = service_node
+        ? detail::send_control_data(command, no_it, no_it, std::forward<Args>(args)...)
+        : detail::send_control_data(command, no_it, no_it, send_option::optional{}, std::forward<Args>(args)...);
+    control_data["route"] = route;
+    control_data["pubkey"] = pubkey;
+    detail::compress_send_parts(control_data, lokimq->COMPRESS_THRESHOLD);
+    detail::send_control(lokimq->get_control_socket(), "REPLY", bt_serialize(control_data));
+}
+
+inline void Message::reply_stream(const std::string& command, StreamProducer producer) {
+    lokimq.send_stream(std::string{pubkey}, command, std::move(producer), !service_node);
+}
+
 
 template <typename... T>
 void LokiMQ::log_(LogLevel lvl, const char* file, int line, const T&... stuff) {
@@ -759,7 +1538,7 @@ void LokiMQ::log_(LogLevel lvl, const char* file, int line, const T&... stuff) {
 
     std::ostringstream os;
 #ifdef __cpp_fold_expressions
-    os << ... << stuff;
+    (os << ... << stuff);
 #else
     (void) std::initializer_list<int>{(os << stuff, 0)...};
 #endif
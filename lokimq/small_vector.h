@@ -0,0 +1,254 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace lokimq {
+
+/// A vector that stores up to N elements inline (i.e. without allocating), only moving to heap
+/// storage when it grows beyond that; used for the frames of multipart messages, which almost
+/// always consist of just a few parts.  It supports the subset of the std::vector interface that
+/// LokiMQ needs.
+///
+/// Unlike std::vector, moving a small_vector whose elements are stored inline moves the elements
+/// themselves, so pointers to elements (or into them: small zmq::message_t's store their data
+/// inline) do not remain valid.
+template <typename T, size_t N>
+class small_vector {
+    static_assert(N > 0, "small_vector inline capacity must be positive");
+public:
+    using value_type = T;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = T&;
+    using const_reference = const T&;
+    using pointer = T*;
+    using const_pointer = const T*;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    small_vector() noexcept : data_{inline_data()} {}
+
+    small_vector(std::initializer_list<T> init) : small_vector() {
+        reserve(init.size());
+        for (auto& v : init)
+            push_back(v);
+    }
+
+    small_vector(const small_vector& other) : small_vector() {
+        reserve(other.size_);
+        for (auto& v : other)
+            push_back(v);
+    }
+
+    small_vector(small_vector&& other) noexcept(std::is_nothrow_move_constructible<T>::value)
+        : small_vector() {
+        take(other);
+    }
+
+    small_vector& operator=(const small_vector& other) {
+        if (this != &other) {
+            clear();
+            reserve(other.size_);
+            for (auto& v : other)
+                push_back(v);
+        }
+        return *this;
+    }
+
+    small_vector& operator=(small_vector&& other) noexcept(std::is_nothrow_move_constructible<T>::value) {
+        if (this != &other) {
+            clear();
+            deallocate();
+            take(other);
+        }
+        return *this;
+    }
+
+    ~small_vector() {
+        clear();
+        deallocate();
+    }
+
+    size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    size_t capacity() const noexcept { return capacity_; }
+
+    T* data() noexcept { return data_; }
+    const T* data() const noexcept { return data_; }
+    iterator begin() noexcept { return data_; }
+    iterator end() noexcept { return data_ + size_; }
+    const_iterator begin() const noexcept { return data_; }
+    const_iterator end() const noexcept { return data_ + size_; }
+
+    T& operator[](size_t i) { return data_[i]; }
+    const T& operator[](size_t i) const { return data_[i]; }
+    T& at(size_t i) {
+        if (i >= size_) throw std::out_of_range{"small_vector index out of range"};
+        return data_[i];
+    }
+    const T& at(size_t i) const {
+        if (i >= size_) throw std::out_of_range{"small_vector index out of range"};
+        return data_[i];
+    }
+    T& front() { return data_[0]; }
+    const T& front() const { return data_[0]; }
+    T& back() { return data_[size_ - 1]; }
+    const T& back() const { return data_[size_ - 1]; }
+
+    /// Ensures that there is room for `n` elements, so that adding elements up to that size won't
+    /// move existing elements.
+    void reserve(size_t n) {
+        if (n > capacity_)
+            reallocate(n);
+    }
+
+    template <typename... Args>
+    T& emplace_back(Args&&... args) {
+        if (size_ == capacity_) {
+            // Construct the new element first, in case args refer to an existing element
+            size_t new_capacity = capacity_ * 2;
+            T* new_data = std::allocator<T>{}.allocate(new_capacity);
+            try {
+                new (new_data + size_) T(std::forward<Args>(args)...);
+            } catch (...) {
+                std::allocator<T>{}.deallocate(new_data, new_capacity);
+                throw;
+            }
+            move_to(new_data, new_capacity);
+        } else {
+            new (data_ + size_) T(std::forward<Args>(args)...);
+        }
+        return data_[size_++];
+    }
+
+    void push_back(const T& v) { emplace_back(v); }
+    void push_back(T&& v) { emplace_back(std::move(v)); }
+
+    void pop_back() {
+        data_[--size_].~T();
+    }
+
+    /// Inserts a value before `pos`, moving the later elements back.
+    iterator insert(const_iterator pos, T&& v) {
+        size_t i = pos - data_;
+        emplace_back(std::move(v));
+        std::rotate(data_ + i, data_ + size_ - 1, data_ + size_);
+        return data_ + i;
+    }
+
+    iterator erase(const_iterator first, const_iterator last) {
+        T* f = data_ + (first - data_);
+        T* l = data_ + (last - data_);
+        if (f != l) {
+            T* new_end = std::move(l, end(), f);
+            for (T* p = new_end; p != end(); ++p)
+                p->~T();
+            size_ -= l - f;
+        }
+        return f;
+    }
+    iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+    void resize(size_t n) {
+        while (size_ > n)
+            pop_back();
+        reserve(n);
+        while (size_ < n)
+            emplace_back();
+    }
+
+    void clear() noexcept {
+        for (size_t i = 0; i < size_; i++)
+            data_[i].~T();
+        size_ = 0;
+    }
+
+private:
+    alignas(T) unsigned char inline_[N * sizeof(T)];
+    T* data_;
+    size_t size_ = 0;
+    size_t capacity_ = N;
+
+    T* inline_data() noexcept { return reinterpret_cast<T*>(inline_); }
+    bool is_inline() const noexcept { return data_ == reinterpret_cast<const T*>(inline_); }
+
+    // Moves the elements to `new_data` (with capacity `new_capacity`) and switches to it
+    void move_to(T* new_data, size_t new_capacity) {
+        for (size_t i = 0; i < size_; i++) {
+            new (new_data + i) T(std::move(data_[i]));
+            data_[i].~T();
+        }
+        deallocate();
+        data_ = new_data;
+        capacity_ = new_capacity;
+    }
+
+    void reallocate(size_t new_capacity) {
+        move_to(std::allocator<T>{}.allocate(new_capacity), new_capacity);
+    }
+
+    void deallocate() noexcept {
+        if (!is_inline())
+            std::allocator<T>{}.deallocate(data_, capacity_);
+        data_ = inline_data();
+        capacity_ = N;
+    }
+
+    // Takes the elements of `other` (leaving it empty); we must be empty and inline.
+    void take(small_vector& other) {
+        if (other.is_inline()) {
+            for (size_t i = 0; i < other.size_; i++)
+                new (data_ + i) T(std::move(other.data_[i]));
+            size_ = other.size_;
+            other.clear();
+        } else {
+            data_ = other.data_;
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+            other.data_ = other.inline_data();
+            other.size_ = 0;
+            other.capacity_ = N;
+        }
+    }
+};
+
+}
+
+// vim:sw=4:et
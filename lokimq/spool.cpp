@@ -0,0 +1,267 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "spool.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lokimq {
+
+struct spool_journal::header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t head;  // offset of the first unconsumed record
+    uint64_t tail;  // offset just past the last record
+    uint64_t count; // number of records between head and tail
+};
+
+namespace {
+
+constexpr char MAGIC[8] = {'L', 'M', 'Q', 'S', 'P', 'O', 'O', 'L'};
+constexpr uint32_t VERSION = 1;
+
+// Records start after the header (padded out to keep them nicely aligned)
+constexpr uint64_t DATA_START = 64;
+
+// Each record is: [u32 record size][u32 part count][i64 expiry (ms since epoch)] followed by
+// [u32 size][data] for each part.  Integers are in native byte order (the file isn't portable).
+constexpr size_t RECORD_HEADER = 4 + 4 + 8;
+constexpr size_t PART_HEADER = 4;
+
+template <typename T>
+T load(const char* p) {
+    T val;
+    std::memcpy(&val, p, sizeof(T));
+    return val;
+}
+
+template <typename T>
+void store(char* p, T val) {
+    std::memcpy(p, &val, sizeof(T));
+}
+
+int64_t to_ms(spool_journal::clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+}
+
+[[noreturn]] void throw_errno(const std::string& what, const std::string& path) {
+    throw std::runtime_error{what + " " + path + ": " + std::strerror(errno)};
+}
+
+}
+
+spool_journal::spool_journal(std::string path, size_t capacity) : path_{std::move(path)} {
+    if (capacity < DATA_START + RECORD_HEADER)
+        throw std::runtime_error{"spool journal capacity is too small"};
+
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd_ < 0)
+        throw_errno("Unable to open spool journal", path_);
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        ::close(fd_);
+        throw_errno("Unable to stat spool journal", path_);
+    }
+    // Never shrink an existing journal: it may contain records beyond the requested capacity.
+    capacity_ = std::max<size_t>(capacity, st.st_size);
+    if (static_cast<size_t>(st.st_size) != capacity_ && ftruncate(fd_, capacity_) != 0) {
+        ::close(fd_);
+        throw_errno("Unable to resize spool journal", path_);
+    }
+
+    void* map = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) {
+        ::close(fd_);
+        throw_errno("Unable to map spool journal", path_);
+    }
+    data_ = static_cast<char*>(map);
+
+    auto& h = hdr();
+    if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION ||
+            h.head < DATA_START || h.head > h.tail || h.tail > capacity_ ||
+            (h.count == 0) != (h.head == h.tail))
+        reset();
+}
+
+spool_journal::~spool_journal() {
+    if (data_) {
+        msync(data_, capacity_, MS_ASYNC);
+        munmap(data_, capacity_);
+    }
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+spool_journal::header& spool_journal::hdr() { return *reinterpret_cast<header*>(data_); }
+const spool_journal::header& spool_journal::hdr() const { return *reinterpret_cast<const header*>(data_); }
+
+uint64_t spool_journal::size() const { return hdr().count; }
+
+void spool_journal::reset() {
+    auto& h = hdr();
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.reserved = 0;
+    h.head = h.tail = DATA_START;
+    h.count = 0;
+    flush(0, DATA_START);
+}
+
+void spool_journal::flush(size_t offset, size_t size) {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    msync(data_ + start, offset + size - start, MS_ASYNC);
+}
+
+bool spool_journal::read_record(uint64_t offset, uint32_t& size, int64_t& expires, std::vector<string_view>* parts) {
+    auto& h = hdr();
+    if (h.tail - offset < RECORD_HEADER)
+        return false;
+    const char* p = data_ + offset;
+    size = load<uint32_t>(p);
+    uint32_t nparts = load<uint32_t>(p + 4);
+    expires = load<int64_t>(p + 8);
+    if (size < RECORD_HEADER || size > h.tail - offset)
+        return false;
+
+    if (parts) {
+        parts->clear();
+        const char* end = p + size;
+        p += RECORD_HEADER;
+        for (uint32_t i = 0; i < nparts; i++) {
+            if (end - p < static_cast<ptrdiff_t>(PART_HEADER))
+                return false;
+            uint32_t len = load<uint32_t>(p);
+            p += PART_HEADER;
+            if (static_cast<size_t>(end - p) < len)
+                return false;
+            parts->emplace_back(p, len);
+            p += len;
+        }
+        if (p != end)
+            return false;
+    }
+    return true;
+}
+
+bool spool_journal::append(const std::vector<string_view>& parts, clock::time_point expires) {
+    size_t size = RECORD_HEADER;
+    for (auto& part : parts)
+        size += PART_HEADER + part.size();
+    if (size > capacity_ - DATA_START || size > UINT32_MAX)
+        return false;
+
+    auto& h = hdr();
+    while (capacity_ - h.tail < size) {
+        const uint64_t live = h.tail - h.head;
+        if (h.head > DATA_START && live <= h.head - DATA_START) {
+            // Reclaim the space used by consumed records.  We only do this when the records fit
+            // entirely in the consumed space, so that the copy doesn't overwrite any of the
+            // records the header still points at: if we crash before the header is updated, the
+            // journal is unchanged.
+            std::memcpy(data_ + DATA_START, data_ + h.head, live);
+            flush(DATA_START, live);
+            // Update tail first: if we crash between these, head > tail (or head == tail with a
+            // nonzero count) gets the journal reset when it is next opened, rather than misread.
+            h.tail = DATA_START + live;
+            h.head = DATA_START;
+            flush(0, sizeof(header));
+        } else {
+            // Still no room: drop the oldest message
+            pop();
+            dropped_++;
+        }
+    }
+
+    char* p = data_ + h.tail;
+    store<uint32_t>(p, size);
+    store<uint32_t>(p + 4, parts.size());
+    store<int64_t>(p + 8, to_ms(expires));
+    p += RECORD_HEADER;
+    for (auto& part : parts) {
+        store<uint32_t>(p, part.size());
+        p += PART_HEADER;
+        std::memcpy(p, part.data(), part.size());
+        p += part.size();
+    }
+    flush(h.tail, size);
+
+    // Only update the header once the record is fully written
+    h.tail += size;
+    h.count++;
+    flush(0, sizeof(header));
+    return true;
+}
+
+bool spool_journal::front(std::vector<string_view>& parts) {
+    auto& h = hdr();
+    const int64_t now = to_ms(clock::now());
+    while (h.count > 0) {
+        uint32_t size;
+        int64_t expires;
+        if (!read_record(h.head, size, expires, &parts)) {
+            dropped_ += h.count;
+            reset();
+            return false;
+        }
+        if (expires > now)
+            return true;
+        pop();
+        dropped_++;
+    }
+    return false;
+}
+
+void spool_journal::pop() {
+    auto& h = hdr();
+    if (h.count == 0)
+        return;
+    uint32_t size;
+    int64_t expires;
+    if (h.count == 1 || !read_record(h.head, size, expires, nullptr)) {
+        h.head = h.tail = DATA_START;
+        h.count = 0;
+    } else {
+        h.head += size;
+        h.count--;
+    }
+    flush(0, sizeof(header));
+}
+
+}
+
+// vim:sw=4:et
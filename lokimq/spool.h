@@ -0,0 +1,121 @@
+// Copyright (c) 2019-2020, The Loki Project
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "string_view.h"
+
+namespace lokimq {
+
+/** \file
+ * A durable, size-limited queue of multipart messages stored in a memory-mapped, append-only
+ * journal file; used by LokiMQ to hold on to messages for unreachable peers (see SPOOL_DIR).
+ *
+ * The file consists of a small header (recording where the unconsumed messages start and end)
+ * followed by the message records.  Messages are appended at the end and consumed from the front.
+ * When there isn't room at the end for a new message, the consumed space is reclaimed by copying
+ * the remaining records to the start of the file, but only if they fit into the consumed space
+ * (so that the copy never overwrites records the header still refers to); otherwise, as when the
+ * journal is full, the oldest messages are dropped to make room.  Each message also has an expiry
+ * time after which it is dropped rather than returned.
+ *
+ * Changes are written to the mapped file and scheduled to be flushed to disk, and the header is
+ * only updated once the records it refers to are in place, so they survive the process exiting or
+ * crashing (but not necessarily the whole system crashing).  A crash in the middle of a header
+ * update leaves a header that is detected as invalid, and the journal is then reinitialized (losing
+ * its messages) rather than misread.
+ *
+ * Not thread-safe.
+ */
+class spool_journal {
+public:
+    using clock = std::chrono::system_clock;
+
+    /// Opens the journal at `path`, creating it if it doesn't exist, and keeping any messages it
+    /// contains if it does.  `capacity` is the size of the journal file (which is created as a
+    /// sparse file, so unused space doesn't take up disk space).  An existing file that isn't a
+    /// valid journal is reinitialized.  Throws std::runtime_error if the file can't be opened or
+    /// mapped.
+    spool_journal(std::string path, size_t capacity);
+    ~spool_journal();
+
+    spool_journal(const spool_journal&) = delete;
+    spool_journal& operator=(const spool_journal&) = delete;
+
+    /// Appends a message consisting of the given parts, to be dropped if not consumed by
+    /// `expires`.  Drops the oldest messages if needed to make room.  Returns false (and does
+    /// nothing) if the message is too large to fit in the journal at all.
+    bool append(const std::vector<string_view>& parts, clock::time_point expires);
+
+    /// Sets `parts` to the parts of the oldest unexpired message (dropping any expired messages
+    /// before it) and returns true, or returns false if there are no messages.  The views point
+    /// into the journal and are only valid until the journal is next modified.
+    bool front(std::vector<string_view>& parts);
+
+    /// Removes the oldest message.
+    void pop();
+
+    /// The number of messages in the journal (including any that have expired but not yet been
+    /// dropped)
+    uint64_t size() const;
+    bool empty() const { return size() == 0; }
+
+    /// The number of messages dropped (because of expiry or lack of space) since opening
+    uint64_t dropped() const { return dropped_; }
+
+    /// The path of the journal file
+    const std::string& path() const { return path_; }
+
+private:
+    struct header;
+
+    std::string path_;
+    int fd_ = -1;
+    char* data_ = nullptr;
+    size_t capacity_ = 0;
+    uint64_t dropped_ = 0;
+
+    header& hdr();
+    const header& hdr() const;
+    // Initializes an empty journal
+    void reset();
+    // Flushes a range of the mapping (asynchronously)
+    void flush(size_t offset, size_t size);
+    // Reads the size, expiry, and (if `parts` is non-null) parts of the record at `offset`.
+    // Returns false if the record is corrupt.
+    bool read_record(uint64_t offset, uint32_t& size, int64_t& expires, std::vector<string_view>* parts);
+};
+
+}
+
+// vim:sw=4:et